@@ -0,0 +1,124 @@
+// vim: noet:ts=4:sts=4:sw=4:et
+// vfat_appendbench: a file built from small appends then synced, written
+// through against -o writeback
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "bench.h"
+
+#define BENCH_DEFAULT_KIB       2048
+#define BENCH_DEFAULT_APPEND    128 // bytes
+#define BENCH_DEFAULT_WRITEBACK 8   // MiB
+#define BENCH_IMAGE_MIB         320 // smallest FAT32 volume of 4 KiB clusters, plus room
+#define BENCH_CLUSTER_SECTORS   8
+#define BENCH_FILE              "/append.log"
+
+// Parameters shared with the children
+struct bench_config {
+    const char*  image;
+    size_t       kib;
+    size_t       append;
+    unsigned int writeback;
+};
+
+static void Measure(void* arg)
+{
+    struct bench_config* config = arg;
+    vfat_info.writable = 1;
+    vfat_info.writeback = config->writeback;
+    bench_mount(config->image);
+
+    char* buf = malloc(config->append);
+    if (buf == NULL)
+        err(1, "malloc");
+    memset(buf, 'l', config->append);
+    buf[config->append - 1] = '\n';
+
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY | O_APPEND;
+    unsigned long reads, writes, startWrites;
+    bench_syscalls(&reads, &startWrites);
+    double start = bench_now();
+
+    int ret = vfat_available_ops.create(BENCH_FILE, 0644, &fi);
+    if (ret != 0)
+        errx(1, "creating %s: %s", BENCH_FILE, strerror(-ret));
+    off_t size = (off_t)config->kib << 10;
+    off_t offs;
+    for (offs = 0; offs < size; offs += config->append)
+    {
+        ret = vfat_available_ops.write(BENCH_FILE, buf, config->append, offs, &fi);
+        if (ret != (int)config->append)
+            errx(1, "append at %lld returned %d", (long long)offs, ret);
+    }
+    if ((ret = vfat_available_ops.fsync(BENCH_FILE, 0, &fi)) != 0)
+        errx(1, "fsync: %s", strerror(-ret));
+
+    double elapsed = bench_now() - start;
+    bench_syscalls(&reads, &writes);
+    vfat_available_ops.release(BENCH_FILE, &fi);
+    bench_unmount();
+    free(buf);
+
+    char mode[32];
+    if (config->writeback != 0)
+        snprintf(mode, sizeof(mode), "writeback=%u", config->writeback);
+    else
+        snprintf(mode, sizeof(mode), "write-through");
+    printf("%-14s %9.3f s %12lu\n", mode, elapsed, writes - startWrites);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: vfat_appendbench [-s file KiB] [-b append bytes] [-w writeback MiB]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_config config;
+    memset(&config, 0, sizeof(config));
+    config.kib = BENCH_DEFAULT_KIB;
+    config.append = BENCH_DEFAULT_APPEND;
+    unsigned int writeback = BENCH_DEFAULT_WRITEBACK;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:b:w:")) != -1)
+    {
+        if (opt == 's' && (config.kib = atol(optarg)) > 0)
+            continue;
+        if (opt == 'b' && (config.append = atol(optarg)) > 0)
+            continue;
+        if (opt == 'w' && (writeback = atol(optarg)) > 0)
+            continue;
+        usage();
+    }
+    if (((off_t)config.kib << 10) > ((off_t)BENCH_IMAGE_MIB - 64) << 20)
+        errx(1, "file of %zu KiB does not fit the image", config.kib);
+    bench_defaults();
+
+    printf("%zu KiB in %zu byte appends, then fsync\n", config.kib, config.append);
+    printf("%-14s %11s %12s\n", "", "time", "write calls");
+
+    // A fresh image per mode, so both allocate the same clusters
+    unsigned int modes[2] = { 0, writeback };
+    int m;
+    for (m = 0; m < 2; m++)
+    {
+        config.writeback = modes[m];
+        config.image = bench_image("appendbench", (off_t)BENCH_IMAGE_MIB << 20, BENCH_CLUSTER_SECTORS);
+        bench_run(Measure, &config);
+        unlink(config.image);
+        free((char*)config.image);
+    }
+    return 0;
+}
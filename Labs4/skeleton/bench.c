@@ -0,0 +1,202 @@
+// vim: noet:ts=4:sts=4:sw=4:et
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <err.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "util.h"
+#include "mount.h"
+#include "bench.h"
+
+// Layout of the images bench_image() formats
+#define BENCH_SECTOR_SIZE  512
+#define BENCH_RESERVED     32
+#define BENCH_FSINFO       1
+#define BENCH_BACKUP       6
+#define BENCH_ROOT_CLUSTER 2
+
+double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read and write system calls of this process so far, from /proc/self/io
+void bench_syscalls(unsigned long* reads, unsigned long* writes)
+{
+    FILE* f = fopen("/proc/self/io", "r");
+    char line[128];
+    *reads = *writes = 0;
+    if (f == NULL)
+        err(1, "/proc/self/io");
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        sscanf(line, "syscr: %lu", reads);
+        sscanf(line, "syscw: %lu", writes);
+    }
+    fclose(f);
+}
+
+// Empty FAT32 volume of size bytes, sparse apart from its first sectors.
+// Returns the path of the image, the caller unlinks it
+char* bench_image(const char* name, off_t size, unsigned int sectors_per_cluster)
+{
+    const char* dir = getenv("TMPDIR");
+    char* path;
+    if (asprintf(&path, "%s/vfat_%s.XXXXXX", (dir != NULL) ? dir : "/tmp", name) < 0)
+        err(1, "asprintf");
+    int fd = mkstemp(path);
+    if (fd < 0)
+        err(1, "mkstemp(%s)", path);
+
+    // Sized for every cluster the sectors could hold, the few extra entries stay unused
+    uint32_t total = size / BENCH_SECTOR_SIZE;
+    uint32_t fatSectors = ((uint64_t)(total - BENCH_RESERVED) / sectors_per_cluster + 2) * 4 / BENCH_SECTOR_SIZE + 1;
+    uint32_t clusters = (total - BENCH_RESERVED - 2 * fatSectors) / sectors_per_cluster;
+    if (clusters < 65525)
+        errx(1, "%lld bytes in clusters of %u sectors make no FAT32 volume", (long long)size, sectors_per_cluster);
+
+    struct fat_boot_header boot;
+    memset(&boot, 0, sizeof(boot));
+    memcpy(boot.jmp_boot, "\xEB\x58\x90", 3);
+    memcpy(boot.oemname, "VFATBNCH", 8);
+    boot.bytes_per_sector = htole16(BENCH_SECTOR_SIZE);
+    boot.sectors_per_cluster = sectors_per_cluster;
+    boot.reserved_sectors = htole16(BENCH_RESERVED);
+    boot.fat_count = 2;
+    boot.media_info = 0xF8;
+    boot.total_sectors = htole32(total);
+    boot.sectors_per_fat = htole32(fatSectors);
+    boot.root_cluster = htole32(BENCH_ROOT_CLUSTER);
+    boot.fsinfo_sector = htole16(BENCH_FSINFO);
+    boot.backup_sector = htole16(BENCH_BACKUP);
+    boot.ext_sig = 0x29;
+    memcpy(boot.label, "NO NAME    ", 11);
+    memcpy(boot.fat_name, "FAT32   ", 8);
+    boot.signature = htole16(0xAA55);
+
+    struct fat32_fsinfo info;
+    memset(&info, 0, sizeof(info));
+    info.lead_signature = htole32(VFAT_FSINFO_LEAD_SIGNATURE);
+    info.signature = htole32(VFAT_FSINFO_SIGNATURE);
+    info.free_count = htole32(clusters - 1);
+    info.next_free = htole32(BENCH_ROOT_CLUSTER + 1);
+    info.trail_signature = htole32(0xAA550000);
+
+    // Media descriptor, end of chain marker and the root directory
+    uint32_t fat[3] = { htole32(0x0FFFFFF8), htole32(0x0FFFFFFF), htole32(0x0FFFFFFF) };
+
+    off_t fatOffset = (off_t)BENCH_RESERVED * BENCH_SECTOR_SIZE;
+    if (ftruncate(fd, size) != 0 ||
+        pwrite_full(fd, &boot, sizeof(boot), 0) != 0 ||
+        pwrite_full(fd, &boot, sizeof(boot), (off_t)BENCH_BACKUP * BENCH_SECTOR_SIZE) != 0 ||
+        pwrite_full(fd, &info, sizeof(info), (off_t)BENCH_FSINFO * BENCH_SECTOR_SIZE) != 0 ||
+        pwrite_full(fd, &info, sizeof(info), (off_t)(BENCH_BACKUP + BENCH_FSINFO) * BENCH_SECTOR_SIZE) != 0 ||
+        pwrite_full(fd, fat, sizeof(fat), fatOffset) != 0 ||
+        pwrite_full(fd, fat, sizeof(fat), fatOffset + (off_t)fatSectors * BENCH_SECTOR_SIZE) != 0)
+        err(1, "formatting %s", path);
+    close(fd);
+    return path;
+}
+
+// Writes the image back and evicts it from the page cache, so the next
+// mount reads it from disk. Has no effect on tmpfs
+void bench_drop_cache(const char* image)
+{
+    int fd = open(image, O_RDONLY);
+    if (fd < 0)
+        err(1, "open(%s)", image);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// Same defaults main() sets before parsing the options
+void bench_defaults(void)
+{
+    vfat_info.readahead = VFAT_READAHEAD_DEFAULT;
+    vfat_info.time_offset = VFAT_TIME_OFFSET_LOCAL;
+}
+
+// Mounts with the options set in vfat_info, like main() and the fuse init
+// op do. The mount tasks are finished before anything gets measured
+void bench_mount(const char* image)
+{
+    int task;
+    vfat_info.dev = image;
+    vfat_init(image);
+    vfat_available_ops.init(NULL);
+    for (task = 0; task < MOUNT_TASKS; task++)
+    {
+        mount_wait(task);
+    }
+}
+
+// Writes everything back like the fuse destroy op, needed after writes
+void bench_unmount(void)
+{
+    vfat_available_ops.destroy(NULL);
+}
+
+// Runs run(arg) in a child process and waits for it
+void bench_run(void (*run)(void*), void* arg)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+        err(1, "fork");
+    if (pid == 0)
+    {
+        run(arg);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        errx(1, "benchmark child failed");
+}
+
+// Creates path on a writable mount with size bytes, written chunk bytes at a time
+int bench_put(const char* path, off_t size, size_t chunk)
+{
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY;
+    int ret = vfat_available_ops.create(path, 0644, &fi);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    char* buf = malloc(chunk);
+    if (buf == NULL)
+        err(1, "malloc");
+    off_t done;
+    for (done = 0; ret >= 0 && done < size; done += chunk)
+    {
+        size_t len = (size - done < (off_t)chunk) ? size - done : chunk;
+        memset(buf, 'a' + (done / chunk) % 26, len);
+        ret = vfat_available_ops.write(path, buf, len, done, &fi);
+    }
+    free(buf);
+    vfat_available_ops.flush(path, &fi);
+    vfat_available_ops.release(path, &fi);
+    return (ret < 0) ? ret : 0;
+}
+
+int bench_mkdir(const char* path)
+{
+    return vfat_available_ops.mkdir(path, 0755);
+}
@@ -0,0 +1,22 @@
+#ifndef H_BENCH
+#define H_BENCH
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Shared by the vfat_*bench programs that run against an image. vfat_init()
+// only runs once per process, so every mount lives in a child, see bench_run().
+// Images go to $TMPDIR, /tmp by default, point it at a disk for cold reads.
+
+double bench_now(void);
+void bench_syscalls(unsigned long* reads, unsigned long* writes);
+char* bench_image(const char* name, off_t size, unsigned int sectors_per_cluster);
+void bench_drop_cache(const char* image);
+void bench_defaults(void);
+void bench_mount(const char* image);
+void bench_unmount(void);
+void bench_run(void (*run)(void*), void* arg);
+int bench_put(const char* path, off_t size, size_t chunk);
+int bench_mkdir(const char* path);
+
+#endif
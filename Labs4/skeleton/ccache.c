@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "util.h"
+#include "wbcache.h"
+#include "ccache.h"
+
+// Never fewer slots than this, so a batch always finds room
+#define CCACHE_MIN_SLOTS (2 * CCACHE_BATCH)
+
+// One cached cluster, its contents live at ccache_arena + index * cluster_size
+struct cc_slot {
+    uint32_t        cluster;   // 0 while the slot is free
+    int             refs;      // pins, a pinned slot is never recycled
+    int             loading;   // the thread that claimed it is reading it
+    int             valid;     // contents were read successfully
+    int             stale;     // dropped from the hash while pinned
+    struct cc_slot* hash_next;
+    struct cc_slot* lru_prev;  // towards most recently used
+    struct cc_slot* lru_next;  // towards least recently used
+};
+
+struct cc_slot*  ccache_slots = NULL;
+struct cc_slot** ccache_buckets = NULL;
+struct cc_slot*  ccache_lru_head = NULL;
+struct cc_slot*  ccache_lru_tail = NULL;
+uint8_t*         ccache_arena = NULL;
+size_t           ccache_slot_count = 0;
+size_t           ccache_bucket_mask = 0;
+int              ccache_fd = -1;
+int              ccache_buffered = 0; // O_DIRECT was refused, loads use the page cache
+pthread_mutex_t  ccache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t   ccache_loaded = PTHREAD_COND_INITIALIZER;
+
+unsigned long ccache_hits = 0;
+unsigned long ccache_misses = 0;
+unsigned long ccache_evictions = 0;
+unsigned long ccache_reads = 0;
+
+// Opens the image a second time with O_DIRECT and sets up N MiB of buffers
+// aligned on the sector size (at least a page), nothing happens when N is 0
+void ccache_init(const char* dev)
+{
+    size_t k;
+
+    if (vfat_info.direct == 0)
+    {
+        return;
+    }
+    ccache_fd = open(dev, O_RDONLY | O_DIRECT);
+    if (ccache_fd < 0)
+    {
+        warn("open(%s, O_DIRECT), reading through the page cache", dev);
+        ccache_fd = vfat_info.fd;
+        ccache_buffered = 1;
+    }
+
+    ccache_slot_count = ((size_t)vfat_info.direct << 20) / vfat_info.cluster_size;
+    if (ccache_slot_count < CCACHE_MIN_SLOTS)
+    {
+        ccache_slot_count = CCACHE_MIN_SLOTS;
+    }
+    size_t buckets = 1;
+    while (buckets < ccache_slot_count)
+    {
+        buckets <<= 1;
+    }
+    ccache_bucket_mask = buckets - 1;
+
+    size_t align = vfat_info.bytes_per_sector;
+    if (align < (size_t)sysconf(_SC_PAGESIZE))
+    {
+        align = sysconf(_SC_PAGESIZE);
+    }
+    ccache_slots = calloc(ccache_slot_count, sizeof(struct cc_slot));
+    ccache_buckets = calloc(buckets, sizeof(struct cc_slot*));
+    if (ccache_slots == NULL || ccache_buckets == NULL
+        || posix_memalign((void**)&ccache_arena, align, ccache_slot_count * vfat_info.cluster_size) != 0)
+    {
+        err(1, "cluster cache of %u MiB", vfat_info.direct);
+    }
+
+    for (k = 0; k < ccache_slot_count; k++)
+    {
+        struct cc_slot* slot = &ccache_slots[k];
+        slot->lru_prev = ccache_lru_tail;
+        if (ccache_lru_tail) ccache_lru_tail->lru_next = slot;
+        else ccache_lru_head = slot;
+        ccache_lru_tail = slot;
+    }
+}
+
+static uint8_t* SlotData(const struct cc_slot* slot)
+{
+    return ccache_arena + (size_t)(slot - ccache_slots) * vfat_info.cluster_size;
+}
+
+static struct cc_slot* Find(uint32_t cluster)
+{
+    struct cc_slot* slot = ccache_buckets[cluster & ccache_bucket_mask];
+    while (slot != NULL && slot->cluster != cluster)
+    {
+        slot = slot->hash_next;
+    }
+    return slot;
+}
+
+static void Unhash(struct cc_slot* slot)
+{
+    struct cc_slot** link = &ccache_buckets[slot->cluster & ccache_bucket_mask];
+    while (*link != slot)
+        link = &(*link)->hash_next;
+    *link = slot->hash_next;
+}
+
+static void LruUnlink(struct cc_slot* slot)
+{
+    if (slot->lru_prev) slot->lru_prev->lru_next = slot->lru_next;
+    else ccache_lru_head = slot->lru_next;
+    if (slot->lru_next) slot->lru_next->lru_prev = slot->lru_prev;
+    else ccache_lru_tail = slot->lru_prev;
+    slot->lru_prev = slot->lru_next = NULL;
+}
+
+static void LruPushFront(struct cc_slot* slot)
+{
+    slot->lru_next = ccache_lru_head;
+    if (ccache_lru_head) ccache_lru_head->lru_prev = slot;
+    ccache_lru_head = slot;
+    if (ccache_lru_tail == NULL) ccache_lru_tail = slot;
+}
+
+static void LruPushBack(struct cc_slot* slot)
+{
+    slot->lru_prev = ccache_lru_tail;
+    if (ccache_lru_tail) ccache_lru_tail->lru_next = slot;
+    ccache_lru_tail = slot;
+    if (ccache_lru_head == NULL) ccache_lru_head = slot;
+}
+
+// Pins the slot of cluster, claiming the least recently used free slot on a
+// miss. *claimed tells the caller it has to load it. Called with ccache_lock
+// held, returns NULL if every slot is pinned or the cluster must not be cached
+static struct cc_slot* Acquire(uint32_t cluster, int* claimed)
+{
+    struct cc_slot* slot = Find(cluster);
+    *claimed = 0;
+    if (slot != NULL)
+    {
+        ccache_hits++;
+        slot->refs++;
+        LruUnlink(slot);
+        LruPushFront(slot);
+        return slot;
+    }
+
+    // The image is behind the write-back cache for this one
+    if (wbcache_cluster(cluster) != NULL)
+    {
+        return NULL;
+    }
+
+    for (slot = ccache_lru_tail; slot != NULL && slot->refs > 0; slot = slot->lru_prev)
+    {
+    }
+    if (slot == NULL)
+    {
+        return NULL;
+    }
+    if (slot->cluster != 0)
+    {
+        Unhash(slot);
+        ccache_evictions++;
+    }
+
+    ccache_misses++;
+    slot->cluster = cluster;
+    slot->refs = 1;
+    slot->loading = 1;
+    slot->valid = 0;
+    slot->stale = 0;
+    slot->hash_next = ccache_buckets[cluster & ccache_bucket_mask];
+    ccache_buckets[cluster & ccache_bucket_mask] = slot;
+    LruUnlink(slot);
+    LruPushFront(slot);
+    *claimed = 1;
+    return slot;
+}
+
+static void Release(struct cc_slot* slot)
+{
+    pthread_mutex_lock(&ccache_lock);
+    if (--slot->refs == 0 && (slot->stale || !slot->valid))
+    {
+        if (!slot->stale)
+        {
+            Unhash(slot);
+        }
+        slot->cluster = 0;
+        slot->stale = 0;
+        LruUnlink(slot);
+        LruPushBack(slot);
+    }
+    pthread_mutex_unlock(&ccache_lock);
+}
+
+// Waits until a slot claimed by another thread is loaded, returns whether it is usable
+static int Wait(struct cc_slot* slot)
+{
+    pthread_mutex_lock(&ccache_lock);
+    while (slot->loading)
+    {
+        pthread_cond_wait(&ccache_loaded, &ccache_lock);
+    }
+    int valid = slot->valid;
+    pthread_mutex_unlock(&ccache_lock);
+    return valid;
+}
+
+// Reads count claimed slots holding consecutive clusters from first with one preadv
+static void Load(struct cc_slot** slots, int count, uint32_t first)
+{
+    struct iovec iov[CCACHE_BATCH];
+    size_t size = vfat_info.cluster_size;
+    off_t offset = vfat_info.data_begin_offset + ClusterDataOffset(first);
+    size_t left = (size_t)count * size;
+    int k, ok = 1;
+
+    for (k = 0; k < count; k++)
+    {
+        iov[k].iov_base = SlotData(slots[k]);
+        iov[k].iov_len = size;
+    }
+
+    __atomic_fetch_add(&ccache_reads, 1, __ATOMIC_RELAXED);
+    ssize_t ret = preadv(ccache_fd, iov, count, offset);
+    if (ret < 0 && errno == EINVAL && !ccache_buffered)
+    {
+        warnx("O_DIRECT read refused, reading through the page cache");
+        ccache_fd = vfat_info.fd;
+        ccache_buffered = 1;
+        ret = preadv(ccache_fd, iov, count, offset);
+    }
+
+    // Short reads are completed cluster by cluster
+    if (ret < 0)
+    {
+        ret = 0;
+    }
+    if ((size_t)ret < left)
+    {
+        for (k = (int)(ret / size); k < count; k++)
+        {
+            size_t done = (k == (int)(ret / size)) ? (size_t)ret % size : 0;
+            if (pread_full(vfat_info.fd, SlotData(slots[k]) + done, size - done, offset + (off_t)k * size + done) != 0)
+            {
+                ok = 0;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&ccache_lock);
+    for (k = 0; k < count; k++)
+    {
+        slots[k]->loading = 0;
+        slots[k]->valid = ok;
+    }
+    pthread_cond_broadcast(&ccache_loaded);
+    pthread_mutex_unlock(&ccache_lock);
+}
+
+// Pinned contents of cluster, NULL if the cache has no room for it
+// Release with ccache_put()
+uint8_t* ccache_get(uint32_t cluster)
+{
+    int claimed;
+    pthread_mutex_lock(&ccache_lock);
+    struct cc_slot* slot = Acquire(cluster, &claimed);
+    pthread_mutex_unlock(&ccache_lock);
+
+    if (slot == NULL)
+    {
+        return NULL;
+    }
+    if (claimed)
+    {
+        Load(&slot, 1, cluster);
+    }
+    if (!Wait(slot))
+    {
+        Release(slot);
+        return NULL;
+    }
+    return SlotData(slot);
+}
+
+void ccache_put(const uint8_t* data)
+{
+    Release(&ccache_slots[(data - ccache_arena) / vfat_info.cluster_size]);
+}
+
+int ccache_owns(const uint8_t* ptr)
+{
+    return ccache_arena != NULL && ptr >= ccache_arena
+        && ptr < ccache_arena + ccache_slot_count * vfat_info.cluster_size;
+}
+
+// Copies len bytes starting at offset inner of cluster, the range may span
+// physically contiguous clusters. Misses are loaded in runs, clusters the
+// cache cannot hold are read without it
+int ccache_read(uint32_t cluster, off_t inner, char* dst, size_t len)
+{
+    size_t size = vfat_info.cluster_size;
+    struct cc_slot* slots[CCACHE_BATCH];
+    int claimed[CCACHE_BATCH];
+    int ret = 0;
+
+    cluster += inner / size;
+    inner %= size;
+    while (ret == 0 && len > 0)
+    {
+        int count = (inner + len + size - 1) / size;
+        int k, run;
+        if (count > CCACHE_BATCH)
+        {
+            count = CCACHE_BATCH;
+        }
+
+        pthread_mutex_lock(&ccache_lock);
+        for (k = 0; k < count; k++)
+        {
+            slots[k] = Acquire(cluster + k, &claimed[k]);
+        }
+        pthread_mutex_unlock(&ccache_lock);
+
+        for (k = 0; k < count; k += run)
+        {
+            for (run = 0; k + run < count && claimed[k + run]; run++)
+            {
+            }
+            if (run > 0)
+            {
+                Load(&slots[k], run, cluster + k);
+            }
+            else
+            {
+                run = 1;
+            }
+        }
+
+        for (k = 0; k < count; k++)
+        {
+            size_t chunk = size - inner;
+            if (chunk > len)
+            {
+                chunk = len;
+            }
+            if (slots[k] != NULL && Wait(slots[k]))
+            {
+                memcpy(dst, SlotData(slots[k]) + inner, chunk);
+            }
+            else if (pread_full(vfat_info.fd, dst, chunk, vfat_info.data_begin_offset + ClusterDataOffset(cluster + k) + inner) != 0)
+            {
+                ret = -1;
+            }
+            if (slots[k] != NULL)
+            {
+                Release(slots[k]);
+            }
+            dst += chunk;
+            len -= chunk;
+            inner = 0;
+        }
+        cluster += count;
+    }
+    return ret;
+}
+
+// Forgets clusters [first, first + count), they are about to be overwritten
+void ccache_invalidate(uint32_t first, uint32_t count)
+{
+    uint32_t k;
+    if (ccache_slots == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&ccache_lock);
+    for (k = 0; k < count; k++)
+    {
+        struct cc_slot* slot = Find(first + k);
+        if (slot == NULL)
+        {
+            continue;
+        }
+        Unhash(slot);
+        if (slot->refs > 0)
+        {
+            slot->stale = 1;
+            continue;
+        }
+        slot->cluster = 0;
+        LruUnlink(slot);
+        LruPushBack(slot);
+    }
+    pthread_mutex_unlock(&ccache_lock);
+}
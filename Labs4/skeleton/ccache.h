@@ -0,0 +1,27 @@
+#ifndef H_CCACHE
+#define H_CCACHE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Cluster cache of -o direct=N: the data region is read with O_DIRECT into
+// N MiB of sector aligned buffers, bypassing the page cache entirely.
+
+// Most clusters loaded by a single preadv
+#define CCACHE_BATCH 64
+
+void ccache_init(const char* dev);
+uint8_t* ccache_get(uint32_t cluster);
+void ccache_put(const uint8_t* data);
+int ccache_owns(const uint8_t* ptr);
+int ccache_read(uint32_t cluster, off_t inner, char* dst, size_t len);
+void ccache_invalidate(uint32_t first, uint32_t count);
+
+// Statistics, exported via .debug
+extern unsigned long ccache_hits;
+extern unsigned long ccache_misses;
+extern unsigned long ccache_evictions;
+extern unsigned long ccache_reads;
+
+#endif
@@ -0,0 +1,160 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "vfat.h"
+#include "util.h"
+#include "cfat.h"
+
+#define CFAT_MASK 0x0FFFFFFF
+#define CFAT_BAD  0x0FFFFFF7
+
+struct cfat_run* cfat_run_table = NULL;
+size_t           cfat_run_count = 0;
+
+// index[b] is the first run ending after cluster b << CFAT_INDEX_SHIFT
+uint32_t*        cfat_index = NULL;
+size_t           cfat_index_count = 0;
+
+size_t cfat_bytes = 0;
+
+// Set once the runs and the index are complete
+int cfat_ready = 0;
+
+int cfat_enabled(void)
+{
+    return __atomic_load_n(&cfat_ready, __ATOMIC_ACQUIRE);
+}
+
+// Compresses vfat_info.fat into runs, then drops the pages of the full table
+void cfat_build(void)
+{
+    uint32_t last = vfat_info.spec_CountofClusters + 1;
+    size_t capacity = 1024;
+    uint32_t c, b;
+
+    cfat_run_table = malloc(capacity * sizeof(struct cfat_run));
+    if (cfat_run_table == NULL)
+        err(1, "cfat_build");
+
+    for (c = 2; c <= last; c++)
+    {
+        uint32_t value = vfat_info.fat[c] & CFAT_MASK;
+        if (value == 0)
+        {
+            continue;
+        }
+
+        // A bad cluster always gets a run of its own
+        uint32_t start = c;
+        while (value == c + 1 && c < last && (vfat_info.fat[c + 1] & CFAT_MASK) != CFAT_BAD)
+        {
+            c++;
+            value = vfat_info.fat[c] & CFAT_MASK;
+        }
+
+        if (cfat_run_count == capacity)
+        {
+            capacity *= 2;
+            cfat_run_table = realloc(cfat_run_table, capacity * sizeof(struct cfat_run));
+            if (cfat_run_table == NULL)
+                err(1, "cfat_build");
+        }
+        cfat_run_table[cfat_run_count].start = start;
+        cfat_run_table[cfat_run_count].length = c - start + 1;
+        cfat_run_table[cfat_run_count].next = value;
+        cfat_run_count++;
+    }
+    if (cfat_run_count > 0)
+    {
+        cfat_run_table = realloc(cfat_run_table, cfat_run_count * sizeof(struct cfat_run));
+    }
+
+    // One slot per block of clusters, plus one past the end
+    cfat_index_count = (last >> CFAT_INDEX_SHIFT) + 2;
+    cfat_index = malloc(cfat_index_count * sizeof(uint32_t));
+    if (cfat_index == NULL)
+        err(1, "cfat_build");
+    size_t r = 0;
+    for (b = 0; b < cfat_index_count; b++)
+    {
+        uint64_t blockStart = (uint64_t)b << CFAT_INDEX_SHIFT;
+        while (r < cfat_run_count && (uint64_t)cfat_run_table[r].start + cfat_run_table[r].length <= blockStart)
+        {
+            r++;
+        }
+        cfat_index[b] = r;
+    }
+
+    cfat_bytes = cfat_run_count * sizeof(struct cfat_run) + cfat_index_count * sizeof(uint32_t);
+    __atomic_store_n(&cfat_ready, 1, __ATOMIC_RELEASE);
+
+    // Readers that started before may still walk the mapping, keep it valid
+    madvise(vfat_info.fat, vfat_info.fat_size, MADV_DONTNEED);
+}
+
+// Run holding cluster c, NULL if c is free
+static const struct cfat_run* Find(uint32_t c)
+{
+    size_t b = c >> CFAT_INDEX_SHIFT;
+    if (b + 1 >= cfat_index_count)
+    {
+        return NULL;
+    }
+
+    // Runs are sorted and disjoint, the one holding c lies in [lo, hi]
+    size_t lo = cfat_index[b], hi = cfat_index[b + 1];
+    if (hi >= cfat_run_count)
+    {
+        hi = cfat_run_count;
+    }
+    else
+    {
+        hi++;
+    }
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cfat_run_table[mid].start + cfat_run_table[mid].length <= c)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < cfat_run_count && cfat_run_table[lo].start <= c)
+    {
+        return &cfat_run_table[lo];
+    }
+    return NULL;
+}
+
+// Value of the FAT entry of cluster c
+uint32_t cfat_next(uint32_t c)
+{
+    const struct cfat_run* run = Find(c);
+    if (run == NULL)
+    {
+        return 0;
+    }
+    return (c + 1 < run->start + run->length) ? c + 1 : run->next;
+}
+
+// Number of clusters from c on that link to their neighbour, including the
+// one that does not, whose FAT entry lands in *next. 0 if c is free
+uint32_t cfat_span(uint32_t c, uint32_t* next)
+{
+    const struct cfat_run* run = Find(c);
+    if (run == NULL)
+    {
+        *next = 0;
+        return 0;
+    }
+    *next = run->next;
+    return run->start + run->length - c;
+}
+
+const struct cfat_run* cfat_runs(size_t* count)
+{
+    *count = cfat_run_count;
+    return cfat_run_table;
+}
@@ -0,0 +1,31 @@
+#ifndef H_CFAT
+#define H_CFAT
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Compact FAT of -o compactfat: chains stored as runs of clusters linking to
+// their neighbour instead of one entry per cluster. Read-only mounts only.
+
+// Clusters [start, start + length) each link to the next one, the last
+// links to next. Clusters outside every run are free, a bad cluster is a
+// run of length 1
+struct cfat_run {
+    uint32_t start;
+    uint32_t length;
+    uint32_t next;
+};
+
+// Clusters covered by one slot of the cluster to run index
+#define CFAT_INDEX_SHIFT 10
+
+void cfat_build(void);
+int cfat_enabled(void);
+uint32_t cfat_next(uint32_t c);
+uint32_t cfat_span(uint32_t c, uint32_t* next);
+const struct cfat_run* cfat_runs(size_t* count);
+
+// Statistics, exported via .debug
+extern size_t cfat_bytes;
+
+#endif
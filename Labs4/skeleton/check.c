@@ -0,0 +1,449 @@
+// vim: noet:ts=4:sts=4:sw=4:et
+// vfat_check: offline consistency check of a FAT32 image
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "util.h"
+
+#define CHECK_FAT_MASK          0x0FFFFFFF
+#define CHECK_FAT_BAD           0x0FFFFFF7
+#define CHECK_FAT_EOC_MIN       0x0FFFFFF8
+#define CHECK_DIR_MAX_ENTRIES   65536
+#define CHECK_COMPARE_BLOCK     65536 // bytes of FAT compared per memcmp
+
+// Directory waiting to be scanned by a worker
+struct check_dir {
+    uint32_t          cluster;
+    uint32_t          parent; // as stored in "..", 0 for the root directory
+    char*             path;
+    struct check_dir* next;
+};
+
+struct check_dir* check_queue = NULL;
+int check_busy = 0; // workers scanning a directory
+pthread_mutex_t check_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t check_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t check_output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t* check_claimed; // one bit per cluster, set once a chain references it
+uint64_t* check_lost_next; // clusters referenced by a lost cluster
+unsigned long check_problems = 0;
+unsigned long check_files = 0;
+unsigned long check_dirs = 0;
+unsigned long check_lost_clusters = 0;
+unsigned long check_lost_chains = 0;
+int check_threads = 0;
+
+static void Problem(const char* format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    pthread_mutex_lock(&check_output_lock);
+    vprintf(format, ap);
+    putchar('\n');
+    pthread_mutex_unlock(&check_output_lock);
+    va_end(ap);
+    __atomic_fetch_add(&check_problems, 1, __ATOMIC_RELAXED);
+}
+
+static uint32_t LastCluster()
+{
+    return vfat_info.spec_CountofClusters + 1;
+}
+
+// Sets bit c, returns 0 if it was set already
+static int SetBit(uint64_t* bitmap, uint32_t c)
+{
+    uint64_t mask = (uint64_t)1 << (c % 64);
+    return (__atomic_fetch_or(&bitmap[c / 64], mask, __ATOMIC_RELAXED) & mask) == 0;
+}
+
+static int TestBit(const uint64_t* bitmap, uint32_t c)
+{
+    return (bitmap[c / 64] >> (c % 64)) & 1;
+}
+
+// Runs fn on check_threads slices of [first, last], args holds one structure
+// per thread starting with the uint32_t bounds [from, to) of its slice
+static void ParallelRange(void* (*fn)(void*), uint32_t first, uint32_t last, size_t argSize, void* args)
+{
+    pthread_t threads[check_threads];
+    uint64_t total = (uint64_t)last - first + 1;
+    int t;
+    for (t = 0; t < check_threads; t++)
+    {
+        uint32_t* range = (uint32_t*)((char*)args + t * argSize);
+        range[0] = first + total * t / check_threads;
+        range[1] = first + total * (t + 1) / check_threads; // exclusive
+        if (pthread_create(&threads[t], NULL, fn, range) != 0)
+            err(1, "pthread_create");
+    }
+    for (t = 0; t < check_threads; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+// Used by CompareFats()
+struct check_compare {
+    uint32_t        from;
+    uint32_t        to;
+    const uint32_t* copy;
+    unsigned long   differences;
+    uint32_t        first_difference;
+};
+
+// Compares a slice of a FAT copy with the first FAT. Whole blocks go through
+// memcmp, which is vectorized by the C library, and only differing blocks
+// are looked at entry by entry
+static void* CompareSlice(void* data)
+{
+    struct check_compare* cmp = data;
+    const uint32_t step = CHECK_COMPARE_BLOCK / sizeof(uint32_t);
+    uint32_t block, c;
+    for (block = cmp->from; block < cmp->to; block += step)
+    {
+        uint32_t end = (cmp->to - block < step) ? cmp->to : block + step;
+        if (memcmp(&vfat_info.fat[block], &cmp->copy[block], (size_t)(end - block) * sizeof(uint32_t)) == 0)
+        {
+            continue;
+        }
+        for (c = block; c < end; c++)
+        {
+            if (vfat_info.fat[c] != cmp->copy[c] && cmp->differences++ == 0)
+            {
+                cmp->first_difference = c;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Every FAT copy must match the first one
+static void CompareFats()
+{
+    size_t k;
+    for (k = 1; k < vfat_info.fat_count; k++)
+    {
+        struct check_compare cmp[check_threads];
+        memset(cmp, 0, sizeof(cmp));
+        off_t offset = vfat_info.fat_begin_offset + (off_t)k * vfat_info.fat_size;
+        const uint32_t* copy = (const uint32_t*)mmap_file(vfat_info.fd, offset, vfat_info.fat_size);
+        int t;
+        for (t = 0; t < check_threads; t++)
+        {
+            cmp[t].copy = copy;
+        }
+
+        ParallelRange(CompareSlice, 0, vfat_info.fat_entries - 1, sizeof(cmp[0]), cmp);
+
+        unsigned long differences = 0;
+        uint32_t first = 0;
+        for (t = 0; t < check_threads; t++)
+        {
+            if (cmp[t].differences != 0 && differences == 0)
+            {
+                first = cmp[t].first_difference;
+            }
+            differences += cmp[t].differences;
+        }
+        if (differences != 0)
+        {
+            Problem("FAT %zu differs from FAT 0 in %lu entries, first at cluster %u (%08x vs %08x)",
+                    k, differences, first, copy[first], vfat_info.fat[first]);
+        }
+        unmap((void*)copy, vfat_info.fat_size);
+    }
+}
+
+// Claims every cluster of the chain starting at first for path
+// returns the number of clusters in the chain, -1 if it is broken
+static long ClaimChain(uint32_t first, const char* path)
+{
+    uint32_t c = first;
+    long count = 0;
+
+    while (c != 0)
+    {
+        if (c < 2 || c > LastCluster())
+        {
+            Problem("%s: chain points outside the volume (cluster %u)", path, c);
+            return -1;
+        }
+        if (!SetBit(check_claimed, c))
+        {
+            Problem("%s: cross-linked or looping chain at cluster %u", path, c);
+            return -1;
+        }
+        count++;
+
+        uint32_t next = vfat_info.fat[c] & CHECK_FAT_MASK;
+        if (next >= CHECK_FAT_EOC_MIN)
+        {
+            break;
+        }
+        if (next == CHECK_FAT_BAD || next == 0)
+        {
+            Problem("%s: chain runs into a %s cluster after %u", path, next ? "bad" : "free", c);
+            return -1;
+        }
+        c = next;
+    }
+    return count;
+}
+
+static void PushDir(uint32_t cluster, uint32_t parent, const char* path)
+{
+    struct check_dir* dir = malloc(sizeof(*dir));
+    if (dir == NULL || (dir->path = strdup(path)) == NULL)
+        err(1, "PushDir");
+    dir->cluster = cluster;
+    dir->parent = parent;
+
+    pthread_mutex_lock(&check_lock);
+    dir->next = check_queue;
+    check_queue = dir;
+    pthread_cond_signal(&check_cond);
+    pthread_mutex_unlock(&check_lock);
+}
+
+// Checks one entry of the directory being scanned
+static int CheckEntry(void* data, const struct vfat_dirent* de)
+{
+    struct check_dir* dir = data;
+    uint32_t cluster = de->st.st_ino;
+
+    if (strcmp(de->short_name, ".") == 0)
+    {
+        if (cluster != dir->cluster)
+        {
+            Problem("%s/.: points at cluster %u instead of %u", dir->path, cluster, dir->cluster);
+        }
+        return 0;
+    }
+    if (strcmp(de->short_name, "..") == 0)
+    {
+        if (cluster != dir->parent)
+        {
+            Problem("%s/..: points at cluster %u instead of %u", dir->path, cluster, dir->parent);
+        }
+        return 0;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir->path, de->name);
+
+    long clusters = ClaimChain(cluster, path);
+    if (S_ISDIR(de->st.st_mode))
+    {
+        __atomic_fetch_add(&check_dirs, 1, __ATOMIC_RELAXED);
+        if (de->st.st_size != 0)
+        {
+            Problem("%s: directory has size %ld instead of 0", path, (long)de->st.st_size);
+        }
+        if (clusters == 0)
+        {
+            Problem("%s: directory has no cluster", path);
+        }
+        else if (clusters > 0 && clusters * vfat_info.direntry_per_cluster > CHECK_DIR_MAX_ENTRIES)
+        {
+            Problem("%s: directory spans %ld clusters, more than %d entries", path, clusters, CHECK_DIR_MAX_ENTRIES);
+        }
+
+        // Only intact chains are scanned, this also keeps loops in the tree out
+        if (clusters > 0)
+        {
+            PushDir(cluster, (dir->cluster == vfat_info.root_inode.st_ino) ? 0 : dir->cluster, path);
+        }
+    }
+    else
+    {
+        __atomic_fetch_add(&check_files, 1, __ATOMIC_RELAXED);
+        long expected = (de->st.st_size + vfat_info.cluster_size - 1) / vfat_info.cluster_size;
+        if (clusters >= 0 && clusters != expected)
+        {
+            Problem("%s: size %ld needs %ld clusters, chain has %ld", path, (long)de->st.st_size, expected, clusters);
+        }
+    }
+    return 0;
+}
+
+// Pops directories off the shared queue until every directory was scanned
+static void* WalkWorker(void* unused)
+{
+    pthread_mutex_lock(&check_lock);
+    for (;;)
+    {
+        while (check_queue == NULL && check_busy > 0)
+        {
+            pthread_cond_wait(&check_cond, &check_lock);
+        }
+        if (check_queue == NULL)
+        {
+            break;
+        }
+
+        struct check_dir* dir = check_queue;
+        check_queue = dir->next;
+        check_busy++;
+        pthread_mutex_unlock(&check_lock);
+
+        vfat_scan_dir(dir->cluster, CheckEntry, dir);
+        free(dir->path);
+        free(dir);
+
+        pthread_mutex_lock(&check_lock);
+        if (--check_busy == 0 && check_queue == NULL)
+        {
+            pthread_cond_broadcast(&check_cond);
+        }
+    }
+    pthread_mutex_unlock(&check_lock);
+    return NULL;
+}
+
+static void WalkTree()
+{
+    uint32_t root = vfat_info.root_inode.st_ino;
+    if (ClaimChain(root, "/") <= 0)
+    {
+        return;
+    }
+    PushDir(root, 0, "");
+
+    pthread_t threads[check_threads];
+    int t;
+    for (t = 0; t < check_threads; t++)
+    {
+        if (pthread_create(&threads[t], NULL, WalkWorker, NULL) != 0)
+            err(1, "pthread_create");
+    }
+    for (t = 0; t < check_threads; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+// Used by FindLost()
+struct check_range {
+    uint32_t      from;
+    uint32_t      to;
+    unsigned long count;
+};
+
+static int IsLost(uint32_t c)
+{
+    uint32_t value = vfat_info.fat[c] & CHECK_FAT_MASK;
+    return value != 0 && value != CHECK_FAT_BAD && !TestBit(check_claimed, c);
+}
+
+// Allocated clusters no chain of the tree references
+static void* CountLost(void* data)
+{
+    struct check_range* range = data;
+    uint32_t c;
+    for (c = range->from; c < range->to; c++)
+    {
+        if (IsLost(c))
+        {
+            range->count++;
+            uint32_t next = vfat_info.fat[c] & CHECK_FAT_MASK;
+            if (next >= 2 && next <= LastCluster())
+            {
+                SetBit(check_lost_next, next);
+            }
+        }
+    }
+    return NULL;
+}
+
+// A lost chain starts at a lost cluster no other lost cluster points to
+static void* CountLostChains(void* data)
+{
+    struct check_range* range = data;
+    uint32_t c;
+    for (c = range->from; c < range->to; c++)
+    {
+        if (IsLost(c) && !TestBit(check_lost_next, c))
+        {
+            range->count++;
+        }
+    }
+    return NULL;
+}
+
+static void FindLost()
+{
+    struct check_range ranges[check_threads];
+    int t;
+
+    memset(ranges, 0, sizeof(ranges));
+    ParallelRange(CountLost, 2, LastCluster(), sizeof(ranges[0]), ranges);
+    for (t = 0; t < check_threads; t++)
+    {
+        check_lost_clusters += ranges[t].count;
+    }
+
+    memset(ranges, 0, sizeof(ranges));
+    ParallelRange(CountLostChains, 2, LastCluster(), sizeof(ranges[0]), ranges);
+    for (t = 0; t < check_threads; t++)
+    {
+        check_lost_chains += ranges[t].count;
+    }
+
+    if (check_lost_clusters != 0)
+    {
+        Problem("%lu lost clusters in %lu chains", check_lost_clusters, check_lost_chains);
+    }
+}
+
+static void usage()
+{
+    errx(2, "usage: vfat_check [-j threads] image");
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1)
+    {
+        if (opt != 'j' || (check_threads = atoi(optarg)) <= 0)
+        {
+            usage();
+        }
+    }
+    if (optind != argc - 1)
+    {
+        usage();
+    }
+    if (check_threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        check_threads = (cpus > 0) ? cpus : 1;
+    }
+
+    vfat_info.dev = argv[optind];
+    vfat_init(vfat_info.dev);
+
+    size_t words = (LastCluster() + 64) / 64;
+    check_claimed = calloc(words, sizeof(uint64_t));
+    check_lost_next = calloc(words, sizeof(uint64_t));
+    if (check_claimed == NULL || check_lost_next == NULL)
+        err(1, "calloc");
+
+    CompareFats();
+    WalkTree();
+    FindLost();
+
+    printf("%s: %lu files, %lu directories, %lu problems\n", vfat_info.dev, check_files, check_dirs, check_problems);
+    return (check_problems == 0) ? 0 : 1;
+}
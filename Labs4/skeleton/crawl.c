@@ -0,0 +1,187 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vfat.h"
+#include "dcache.h"
+#include "crawl.h"
+
+// Directories waiting for a worker, scanned in the order they were found
+uint32_t*       crawl_queue = NULL;
+size_t          crawl_head = 0;
+size_t          crawl_tail = 0;
+size_t          crawl_busy = 0;   // workers scanning a directory
+unsigned long   crawl_found = 0;  // directories queued so far, capped at CRAWL_MAX_DIRS
+pthread_mutex_t crawl_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  crawl_cond = PTHREAD_COND_INITIALIZER;
+
+// Progress, exported via .debug
+unsigned int    crawl_workers = 0;
+unsigned long   crawl_dirs = 0;
+unsigned long   crawl_entries = 0;
+unsigned long   crawl_truncated = 0; // subdirectories left out once the cap was hit
+double          crawl_start = 0;
+double          crawl_end = 0;
+
+// Used by CrawlEntry()
+struct crawl_scan {
+    struct dirindex* index;   // NULL when the directory is already indexed
+    uint32_t*        subdirs;
+    size_t           count;
+    size_t           capacity;
+    unsigned long    entries;
+};
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int CrawlEntry(void* data, const struct vfat_dirent* de)
+{
+    struct crawl_scan* scan = data;
+
+    if (scan->index != NULL)
+    {
+        dirindex_add(scan->index, de);
+    }
+    scan->entries++;
+
+    if (!S_ISDIR(de->st.st_mode) || de->st.st_ino < 2 ||
+        strcmp(de->short_name, ".") == 0 || strcmp(de->short_name, "..") == 0)
+    {
+        return 0;
+    }
+    if (scan->count == scan->capacity)
+    {
+        scan->capacity = scan->capacity ? scan->capacity * 2 : 16;
+        scan->subdirs = realloc(scan->subdirs, scan->capacity * sizeof(uint32_t));
+        if (scan->subdirs == NULL)
+            err(1, "CrawlEntry");
+    }
+    scan->subdirs[scan->count++] = de->st.st_ino;
+    return 0;
+}
+
+// Queues what fits under the cap, the queue never holds more than CRAWL_MAX_DIRS
+static void Enqueue(const uint32_t* dirs, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        if (crawl_found >= CRAWL_MAX_DIRS)
+        {
+            crawl_truncated += count - i;
+            break;
+        }
+        crawl_queue[crawl_tail++] = dirs[i];
+        crawl_found++;
+    }
+    pthread_cond_broadcast(&crawl_cond);
+}
+
+static void* Worker(void* unused)
+{
+    struct crawl_scan scan;
+    memset(&scan, 0, sizeof(scan));
+
+    pthread_mutex_lock(&crawl_lock);
+    for (;;)
+    {
+        // Done once nothing is queued and nobody can queue more
+        while (crawl_head == crawl_tail && crawl_busy > 0)
+        {
+            pthread_cond_wait(&crawl_cond, &crawl_lock);
+        }
+        if (crawl_head == crawl_tail)
+        {
+            break;
+        }
+        uint32_t dir = crawl_queue[crawl_head++];
+        crawl_busy++;
+        pthread_mutex_unlock(&crawl_lock);
+
+        // Writers keep built indexes in sync, the tree lock keeps them out of the scan
+        scan.count = 0;
+        scan.entries = 0;
+        pthread_rwlock_rdlock(&vfat_tree_lock);
+        scan.index = dirindex_contains(dir) ? NULL : dirindex_begin(dir);
+        vfat_scan_dir(dir, CrawlEntry, &scan);
+        if (scan.index != NULL)
+        {
+            dirindex_commit(scan.index);
+        }
+        pthread_rwlock_unlock(&vfat_tree_lock);
+
+        pthread_mutex_lock(&crawl_lock);
+        crawl_busy--;
+        crawl_dirs++;
+        crawl_entries += scan.entries;
+        Enqueue(scan.subdirs, scan.count);
+    }
+    pthread_mutex_unlock(&crawl_lock);
+
+    free(scan.subdirs);
+    return NULL;
+}
+
+// Task MOUNT_TREE: walks the tree breadth first from the root with
+// vfat_info.crawl workers, the calling thread being one of them
+void crawl_tree(void)
+{
+    if (vfat_info.crawl == 0)
+    {
+        return;
+    }
+
+    crawl_queue = malloc(CRAWL_MAX_DIRS * sizeof(uint32_t));
+    pthread_t* threads = calloc(vfat_info.crawl, sizeof(pthread_t));
+    if (crawl_queue == NULL || threads == NULL)
+        err(1, "crawl_tree");
+    dirindex_reserve(CRAWL_MAX_DIRS);
+
+    uint32_t root = vfat_info.root_inode.st_ino;
+    pthread_mutex_lock(&crawl_lock);
+    crawl_start = Now();
+    crawl_workers = vfat_info.crawl;
+    Enqueue(&root, 1);
+    pthread_mutex_unlock(&crawl_lock);
+
+    unsigned int i, started = 0;
+    for (i = 1; i < vfat_info.crawl; i++)
+    {
+        if (pthread_create(&threads[started], NULL, Worker, NULL) == 0)
+        {
+            started++;
+        }
+    }
+    Worker(NULL);
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    pthread_mutex_lock(&crawl_lock);
+    crawl_end = Now();
+    pthread_mutex_unlock(&crawl_lock);
+}
+
+// Progress of the crawl, one value per line
+int crawl_format(char* buf, size_t size)
+{
+    pthread_mutex_lock(&crawl_lock);
+    const char* state = (crawl_workers == 0) ? "off" : (crawl_end != 0) ? "done" : "running";
+    double elapsed = (crawl_workers == 0) ? 0 : ((crawl_end != 0) ? crawl_end : Now()) - crawl_start;
+    int len = snprintf(buf, size,
+                       "state %s\nworkers %u\ndirs %lu\nentries %lu\nqueued %zu\ntruncated %lu\nelapsed %.1f ms\n",
+                       state, crawl_workers, crawl_dirs, crawl_entries, crawl_tail - crawl_head,
+                       crawl_truncated, elapsed);
+    pthread_mutex_unlock(&crawl_lock);
+    return (len < (int)size) ? len : (int)size - 1;
+}
@@ -0,0 +1,15 @@
+#ifndef H_CRAWL
+#define H_CRAWL
+
+#include <stddef.h>
+
+// Tree crawler of -o crawl=N: N workers scan the whole directory tree after
+// mount and index every directory, so a first walk resolves from memory.
+
+// Directories the crawler may keep indexed, it stops descending beyond that
+#define CRAWL_MAX_DIRS 4096
+
+void crawl_tree(void);
+int crawl_format(char* buf, size_t size);
+
+#endif
@@ -0,0 +1,503 @@
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "vfat.h"
+#include "dcache.h"
+
+// Path resolution cache: (parent directory cluster, name) -> stat
+// Entries with st == NULL remember that a name does not exist
+#define DCACHE_BUCKETS     8192
+#define DCACHE_MAX_ENTRIES 16384
+
+struct dcache_entry {
+    uint32_t             parent;
+    uint32_t             hash;
+    char*                name;
+    int                  negative;
+    struct stat          st;
+    struct dcache_entry* hash_next;
+    struct dcache_entry* lru_prev; // towards most recently used
+    struct dcache_entry* lru_next; // towards least recently used
+};
+
+struct dcache_entry* dcache_buckets[DCACHE_BUCKETS];
+struct dcache_entry* dcache_lru_head = NULL;
+struct dcache_entry* dcache_lru_tail = NULL;
+pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long dcache_hits = 0;
+unsigned long dcache_negative_hits = 0;
+unsigned long dcache_misses = 0;
+unsigned long dcache_evictions = 0;
+unsigned long dcache_entries = 0;
+
+// FNV-1a over the name, seeded with the parent cluster
+static uint32_t dcache_hash(uint32_t parent, const char* name)
+{
+    uint32_t h = 2166136261u ^ parent;
+    while (*name)
+    {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void lru_unlink(struct dcache_entry* e)
+{
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else dcache_lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else dcache_lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(struct dcache_entry* e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = dcache_lru_head;
+    if (dcache_lru_head) dcache_lru_head->lru_prev = e;
+    dcache_lru_head = e;
+    if (dcache_lru_tail == NULL) dcache_lru_tail = e;
+}
+
+static void dcache_remove(struct dcache_entry* e)
+{
+    struct dcache_entry** link = &dcache_buckets[e->hash % DCACHE_BUCKETS];
+    while (*link != e)
+        link = &(*link)->hash_next;
+    *link = e->hash_next;
+    lru_unlink(e);
+    free(e->name);
+    free(e);
+    dcache_entries--;
+}
+
+static struct dcache_entry* dcache_find(uint32_t parent, const char* name, uint32_t hash)
+{
+    struct dcache_entry* e = dcache_buckets[hash % DCACHE_BUCKETS];
+    while (e != NULL)
+    {
+        if (e->hash == hash && e->parent == parent && strcmp(e->name, name) == 0)
+            return e;
+        e = e->hash_next;
+    }
+    return NULL;
+}
+
+// Looks name up in directory parent
+// returns DCACHE_POSITIVE and fills st, DCACHE_NEGATIVE or DCACHE_MISS
+int dcache_lookup(uint32_t parent, const char* name, struct stat* st)
+{
+    int ret;
+
+    pthread_mutex_lock(&dcache_lock);
+    struct dcache_entry* e = dcache_find(parent, name, dcache_hash(parent, name));
+    if (e == NULL)
+    {
+        dcache_misses++;
+        ret = DCACHE_MISS;
+    }
+    else
+    {
+        lru_unlink(e);
+        lru_push_front(e);
+
+        if (e->negative)
+        {
+            dcache_negative_hits++;
+            ret = DCACHE_NEGATIVE;
+        }
+        else
+        {
+            dcache_hits++;
+            *st = e->st;
+            ret = DCACHE_POSITIVE;
+        }
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return ret;
+}
+
+// Remembers the result of a lookup, st == NULL records a missing name
+void dcache_insert(uint32_t parent, const char* name, const struct stat* st)
+{
+    uint32_t hash = dcache_hash(parent, name);
+
+    pthread_mutex_lock(&dcache_lock);
+    struct dcache_entry* e = dcache_find(parent, name, hash);
+
+    if (e == NULL)
+    {
+        // Make room by evicting the least recently used entry
+        if (dcache_entries >= DCACHE_MAX_ENTRIES)
+        {
+            dcache_remove(dcache_lru_tail);
+            dcache_evictions++;
+        }
+
+        e = calloc(1, sizeof(*e));
+        if (e == NULL || (e->name = strdup(name)) == NULL)
+            err(1, "dcache_insert");
+        e->parent = parent;
+        e->hash = hash;
+        e->hash_next = dcache_buckets[hash % DCACHE_BUCKETS];
+        dcache_buckets[hash % DCACHE_BUCKETS] = e;
+        dcache_entries++;
+    }
+    else
+    {
+        lru_unlink(e);
+    }
+
+    e->negative = (st == NULL);
+    if (st != NULL)
+        e->st = *st;
+    lru_push_front(e);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// Forgets everything, e.g. after the directory structure changed
+void dcache_invalidate_all(void)
+{
+    pthread_mutex_lock(&dcache_lock);
+    while (dcache_lru_head != NULL)
+        dcache_remove(dcache_lru_head);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// Forgets the entries of one directory, e.g. after it was removed
+void dcache_invalidate_parent(uint32_t parent)
+{
+    pthread_mutex_lock(&dcache_lock);
+    struct dcache_entry* e = dcache_lru_head;
+    while (e != NULL)
+    {
+        struct dcache_entry* next = e->lru_next;
+        if (e->parent == parent)
+            dcache_remove(e);
+        e = next;
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// Directory name index: every name (long and short) of one directory -> stat
+// At most dirindex_max_dirs directories are indexed, least recently used go first
+#define DIRINDEX_BUCKETS  512
+
+struct dirindex_entry {
+    uint32_t    hash;
+    uint32_t    name;  // offset into the names arena
+    int32_t     next;  // next entry in the same bucket, -1 terminates
+    int         alias; // short name of an entry that also has a long name
+    struct stat st;
+};
+
+struct dirindex {
+    uint32_t               cluster;
+    size_t                 count;
+    size_t                 capacity;
+    struct dirindex_entry* entries;
+    char*                  names;
+    size_t                 names_size;
+    size_t                 names_capacity;
+    size_t                 bucket_mask;
+    int32_t*               buckets;
+    struct dirindex*       hash_next;
+    struct dirindex*       lru_prev;
+    struct dirindex*       lru_next;
+};
+
+struct dirindex* dirindex_table[DIRINDEX_BUCKETS];
+struct dirindex* dirindex_lru_head = NULL;
+struct dirindex* dirindex_lru_tail = NULL;
+pthread_mutex_t dirindex_lock = PTHREAD_MUTEX_INITIALIZER; // indexes are only read while holding it
+
+unsigned long dirindex_builds = 0;
+unsigned long dirindex_dirs = 0;
+unsigned long dirindex_max_dirs = DIRINDEX_MAX_DIRS;
+
+static void dirindex_free(struct dirindex* index)
+{
+    free(index->entries);
+    free(index->names);
+    free(index->buckets);
+    free(index);
+}
+
+static void dirindex_lru_unlink(struct dirindex* index)
+{
+    if (index->lru_prev) index->lru_prev->lru_next = index->lru_next;
+    else dirindex_lru_head = index->lru_next;
+    if (index->lru_next) index->lru_next->lru_prev = index->lru_prev;
+    else dirindex_lru_tail = index->lru_prev;
+    index->lru_prev = index->lru_next = NULL;
+}
+
+static void dirindex_lru_push_front(struct dirindex* index)
+{
+    index->lru_prev = NULL;
+    index->lru_next = dirindex_lru_head;
+    if (dirindex_lru_head) dirindex_lru_head->lru_prev = index;
+    dirindex_lru_head = index;
+    if (dirindex_lru_tail == NULL) dirindex_lru_tail = index;
+}
+
+static void dirindex_remove(struct dirindex* index)
+{
+    struct dirindex** link = &dirindex_table[index->cluster % DIRINDEX_BUCKETS];
+    while (*link != index)
+        link = &(*link)->hash_next;
+    *link = index->hash_next;
+    dirindex_lru_unlink(index);
+    dirindex_free(index);
+    dirindex_dirs--;
+}
+
+static struct dirindex* dirindex_find(uint32_t dir)
+{
+    struct dirindex* index = dirindex_table[dir % DIRINDEX_BUCKETS];
+    while (index != NULL && index->cluster != dir)
+        index = index->hash_next;
+    return index;
+}
+
+int dirindex_contains(uint32_t dir)
+{
+    pthread_mutex_lock(&dirindex_lock);
+    int found = dirindex_find(dir) != NULL;
+    pthread_mutex_unlock(&dirindex_lock);
+    return found;
+}
+
+// Starts an index for dir, feed it with dirindex_add() and publish it with dirindex_commit()
+struct dirindex* dirindex_begin(uint32_t dir)
+{
+    struct dirindex* index = calloc(1, sizeof(*index));
+    if (index == NULL)
+        err(1, "dirindex_begin");
+    index->cluster = dir;
+    return index;
+}
+
+static void dirindex_add_name(struct dirindex* index, const char* name, int alias, const struct stat* st)
+{
+    size_t len = strlen(name) + 1;
+
+    if (index->count == index->capacity)
+    {
+        index->capacity = index->capacity ? index->capacity * 2 : 64;
+        index->entries = realloc(index->entries, index->capacity * sizeof(struct dirindex_entry));
+        if (index->entries == NULL)
+            err(1, "dirindex_add");
+    }
+    if (index->names_size + len > index->names_capacity)
+    {
+        while (index->names_size + len > index->names_capacity)
+            index->names_capacity = index->names_capacity ? index->names_capacity * 2 : 1024;
+        index->names = realloc(index->names, index->names_capacity);
+        if (index->names == NULL)
+            err(1, "dirindex_add");
+    }
+
+    struct dirindex_entry* e = &index->entries[index->count++];
+    e->hash = dcache_hash(0, name);
+    e->name = index->names_size;
+    e->alias = alias;
+    e->st = *st;
+    memcpy(index->names + index->names_size, name, len);
+    index->names_size += len;
+}
+
+void dirindex_add(struct dirindex* index, const struct vfat_dirent* de)
+{
+    dirindex_add_name(index, de->name, 0, &de->st);
+    if (strcmp(de->name, de->short_name) != 0)
+        dirindex_add_name(index, de->short_name, 1, &de->st);
+}
+
+// Hashes the collected names and makes the index visible to lookups
+static void dirindex_commit_locked(struct dirindex* index)
+{
+    size_t buckets = 16;
+    while (buckets < index->count)
+        buckets *= 2;
+    index->bucket_mask = buckets - 1;
+    index->buckets = malloc(buckets * sizeof(int32_t));
+    if (index->buckets == NULL)
+        err(1, "dirindex_commit");
+    memset(index->buckets, 0xff, buckets * sizeof(int32_t));
+
+    size_t i;
+    for (i = 0; i < index->count; i++)
+    {
+        struct dirindex_entry* e = &index->entries[i];
+        e->next = index->buckets[e->hash & index->bucket_mask];
+        index->buckets[e->hash & index->bucket_mask] = i;
+    }
+
+    // A concurrent scan of the same directory may have been committed first
+    struct dirindex* old = dirindex_find(index->cluster);
+    if (old != NULL)
+        dirindex_remove(old);
+    if (dirindex_dirs >= dirindex_max_dirs)
+        dirindex_remove(dirindex_lru_tail);
+
+    index->hash_next = dirindex_table[index->cluster % DIRINDEX_BUCKETS];
+    dirindex_table[index->cluster % DIRINDEX_BUCKETS] = index;
+    dirindex_lru_push_front(index);
+    dirindex_dirs++;
+    dirindex_builds++;
+}
+
+void dirindex_commit(struct dirindex* index)
+{
+    pthread_mutex_lock(&dirindex_lock);
+    dirindex_commit_locked(index);
+    pthread_mutex_unlock(&dirindex_lock);
+}
+
+// Drops an index that was begun but will not be complete
+void dirindex_discard(struct dirindex* index)
+{
+    dirindex_free(index);
+}
+
+static int dirindex_collect(void* data, const struct vfat_dirent* de)
+{
+    dirindex_add((struct dirindex*)data, de);
+    return 0;
+}
+
+// Looks name up in directory dir, scanning and indexing the directory if needed
+// returns DCACHE_POSITIVE and fills st or DCACHE_NEGATIVE
+int dirindex_lookup(uint32_t dir, const char* name, struct stat* st)
+{
+    pthread_mutex_lock(&dirindex_lock);
+    struct dirindex* index = dirindex_find(dir);
+    if (index == NULL)
+    {
+        // Scan without holding the lock
+        pthread_mutex_unlock(&dirindex_lock);
+        index = dirindex_begin(dir);
+        vfat_scan_dir(dir, dirindex_collect, index);
+        pthread_mutex_lock(&dirindex_lock);
+        dirindex_commit_locked(index);
+    }
+    else
+    {
+        dirindex_lru_unlink(index);
+        dirindex_lru_push_front(index);
+    }
+
+    int ret = DCACHE_NEGATIVE;
+
+    // Long names win over a short name alias that happens to be equal
+    uint32_t hash = dcache_hash(0, name);
+    struct dirindex_entry* match = NULL;
+    int32_t i;
+    for (i = index->buckets[hash & index->bucket_mask]; i >= 0; i = index->entries[i].next)
+    {
+        struct dirindex_entry* e = &index->entries[i];
+        if (e->hash != hash || strcmp(index->names + e->name, name) != 0)
+            continue;
+        match = e;
+        if (!e->alias)
+            break;
+    }
+    if (match != NULL)
+    {
+        *st = match->st;
+        ret = DCACHE_POSITIVE;
+    }
+    pthread_mutex_unlock(&dirindex_lock);
+    return ret;
+}
+
+// Slot of name in the bucket chains of index, NULL if it is not indexed
+static int32_t* dirindex_link(struct dirindex* index, const char* name, int alias)
+{
+    uint32_t hash = dcache_hash(0, name);
+    int32_t* link = &index->buckets[hash & index->bucket_mask];
+    while (*link >= 0)
+    {
+        struct dirindex_entry* e = &index->entries[*link];
+        if (e->hash == hash && e->alias == alias && strcmp(index->names + e->name, name) == 0)
+            return link;
+        link = &e->next;
+    }
+    return NULL;
+}
+
+static void dirindex_set_name(struct dirindex* index, const char* name, int alias, const struct stat* st)
+{
+    int32_t* link = dirindex_link(index, name, alias);
+    if (link != NULL)
+    {
+        index->entries[*link].st = *st;
+        return;
+    }
+
+    dirindex_add_name(index, name, alias, st);
+    struct dirindex_entry* e = &index->entries[index->count - 1];
+    e->next = index->buckets[e->hash & index->bucket_mask];
+    index->buckets[e->hash & index->bucket_mask] = index->count - 1;
+}
+
+// Keeps an already built index in sync after an entry was created or changed
+void dirindex_set(uint32_t dir, const struct vfat_dirent* de)
+{
+    pthread_mutex_lock(&dirindex_lock);
+    struct dirindex* index = dirindex_find(dir);
+    if (index != NULL)
+    {
+        dirindex_set_name(index, de->name, 0, &de->st);
+        if (strcmp(de->name, de->short_name) != 0)
+            dirindex_set_name(index, de->short_name, 1, &de->st);
+    }
+    pthread_mutex_unlock(&dirindex_lock);
+}
+
+// Drops the names of a removed entry from an already built index
+void dirindex_forget(uint32_t dir, const struct vfat_dirent* de)
+{
+    pthread_mutex_lock(&dirindex_lock);
+    struct dirindex* index = dirindex_find(dir);
+    if (index != NULL)
+    {
+        int32_t* link = dirindex_link(index, de->name, 0);
+        if (link != NULL)
+            *link = index->entries[*link].next;
+        if (strcmp(de->name, de->short_name) != 0 && (link = dirindex_link(index, de->short_name, 1)) != NULL)
+            *link = index->entries[*link].next;
+    }
+    pthread_mutex_unlock(&dirindex_lock);
+}
+
+// Lets up to dirs directories be indexed at once, never lowers the limit
+void dirindex_reserve(unsigned long dirs)
+{
+    pthread_mutex_lock(&dirindex_lock);
+    if (dirs > dirindex_max_dirs)
+        dirindex_max_dirs = dirs;
+    pthread_mutex_unlock(&dirindex_lock);
+}
+
+void dirindex_invalidate(uint32_t dir)
+{
+    pthread_mutex_lock(&dirindex_lock);
+    struct dirindex* index = dirindex_find(dir);
+    if (index != NULL)
+        dirindex_remove(index);
+    pthread_mutex_unlock(&dirindex_lock);
+}
+
+void dirindex_invalidate_all(void)
+{
+    pthread_mutex_lock(&dirindex_lock);
+    while (dirindex_lru_head != NULL)
+        dirindex_remove(dirindex_lru_head);
+    pthread_mutex_unlock(&dirindex_lock);
+}
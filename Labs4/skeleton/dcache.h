@@ -0,0 +1,46 @@
+#ifndef H_DCACHE
+#define H_DCACHE
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Results of dcache_lookup()
+#define DCACHE_MISS     -1
+#define DCACHE_NEGATIVE 0
+#define DCACHE_POSITIVE 1
+
+int dcache_lookup(uint32_t parent, const char* name, struct stat* st);
+void dcache_insert(uint32_t parent, const char* name, const struct stat* st);
+void dcache_invalidate_parent(uint32_t parent);
+void dcache_invalidate_all(void);
+
+// Per-directory name index, built by a full scan of the directory
+// DIRINDEX_MAX_DIRS directories are indexed at once unless dirindex_reserve() raises it
+#define DIRINDEX_MAX_DIRS 256
+
+struct vfat_dirent;
+struct dirindex;
+
+int dirindex_lookup(uint32_t dir, const char* name, struct stat* st);
+int dirindex_contains(uint32_t dir);
+struct dirindex* dirindex_begin(uint32_t dir);
+void dirindex_add(struct dirindex* index, const struct vfat_dirent* de);
+void dirindex_commit(struct dirindex* index);
+void dirindex_discard(struct dirindex* index);
+void dirindex_set(uint32_t dir, const struct vfat_dirent* de);
+void dirindex_forget(uint32_t dir, const struct vfat_dirent* de);
+void dirindex_reserve(unsigned long dirs);
+void dirindex_invalidate(uint32_t dir);
+void dirindex_invalidate_all(void);
+
+// Statistics, exported via .debug
+extern unsigned long dcache_hits;
+extern unsigned long dcache_negative_hits;
+extern unsigned long dcache_misses;
+extern unsigned long dcache_evictions;
+extern unsigned long dcache_entries;
+extern unsigned long dirindex_builds;
+extern unsigned long dirindex_dirs;
+extern unsigned long dirindex_max_dirs;
+
+#endif
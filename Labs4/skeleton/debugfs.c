@@ -4,8 +4,16 @@
 
 #include "vfat.h"
 #include "debugfs.h"
+#include "dcache.h"
+#include "fatstats.h"
+#include "wbcache.h"
+#include "uring.h"
+#include "ccache.h"
+#include "cfat.h"
+#include "mount.h"
+#include "crawl.h"
 
-#define DEBUGFS_MAX_FILE_LEN 1024
+#define DEBUGFS_MAX_FILE_LEN 4096
 
 #define NEXT_CLUSTER_PATH "/next_cluster"
 
@@ -26,6 +34,78 @@ int debugfs_fuse_read(const char *path, char *buf, size_t size, off_t offs,
         eof += sprintf(eof, "%d", (int) vfat_info.fat_begin_offset);
     } else if (strcmp(path, "/fat_num_entries")==0) {
         eof += sprintf(eof, "%d", (int) vfat_info.fat_entries);
+    } else if (strcmp(path, "/cluster_map_calls")==0) {
+        eof += sprintf(eof, "%lu", vfat_info.cluster_map_calls);
+    } else if (strcmp(path, "/cluster_unmap_calls")==0) {
+        eof += sprintf(eof, "%lu", vfat_info.cluster_unmap_calls);
+    } else if (strcmp(path, "/readahead")==0) {
+        eof += sprintf(eof, "%u", vfat_info.readahead);
+    } else if (strcmp(path, "/time_offset")==0) {
+        eof += sprintf(eof, "%d", vfat_info.time_offset);
+    } else if (strcmp(path, "/sequential_reads")==0) {
+        eof += sprintf(eof, "%lu", vfat_info.sequential_reads);
+    } else if (strcmp(path, "/random_reads")==0) {
+        eof += sprintf(eof, "%lu", vfat_info.random_reads);
+    } else if (strcmp(path, "/readahead_requests")==0) {
+        eof += sprintf(eof, "%lu", vfat_info.readahead_requests);
+    } else if (strcmp(path, "/readahead_clusters")==0) {
+        eof += sprintf(eof, "%lu", vfat_info.readahead_clusters);
+    } else if (strcmp(path, "/dcache_hits")==0) {
+        eof += sprintf(eof, "%lu", dcache_hits);
+    } else if (strcmp(path, "/dcache_negative_hits")==0) {
+        eof += sprintf(eof, "%lu", dcache_negative_hits);
+    } else if (strcmp(path, "/dcache_misses")==0) {
+        eof += sprintf(eof, "%lu", dcache_misses);
+    } else if (strcmp(path, "/dcache_evictions")==0) {
+        eof += sprintf(eof, "%lu", dcache_evictions);
+    } else if (strcmp(path, "/dcache_entries")==0) {
+        eof += sprintf(eof, "%lu", dcache_entries);
+    } else if (strcmp(path, "/dirindex_builds")==0) {
+        eof += sprintf(eof, "%lu", dirindex_builds);
+    } else if (strcmp(path, "/dirindex_dirs")==0) {
+        eof += sprintf(eof, "%lu", dirindex_dirs);
+    } else if (strcmp(path, "/writeback_dirty")==0) {
+        eof += sprintf(eof, "%lu", wbcache_dirty);
+    } else if (strcmp(path, "/writeback_fat_sectors")==0) {
+        eof += sprintf(eof, "%lu", wbcache_fat_dirty_sectors);
+    } else if (strcmp(path, "/writeback_flushes")==0) {
+        eof += sprintf(eof, "%lu", wbcache_flushes);
+    } else if (strcmp(path, "/writeback_writes")==0) {
+        eof += sprintf(eof, "%lu", wbcache_writes);
+    } else if (strcmp(path, "/uring_batches")==0) {
+        eof += sprintf(eof, "%lu", uring_batches);
+    } else if (strcmp(path, "/uring_reads")==0) {
+        eof += sprintf(eof, "%lu", uring_reads);
+    } else if (strcmp(path, "/uring_prefetches")==0) {
+        eof += sprintf(eof, "%lu", uring_prefetches);
+    } else if (strcmp(path, "/ccache_hits")==0) {
+        eof += sprintf(eof, "%lu", ccache_hits);
+    } else if (strcmp(path, "/ccache_misses")==0) {
+        eof += sprintf(eof, "%lu", ccache_misses);
+    } else if (strcmp(path, "/ccache_evictions")==0) {
+        eof += sprintf(eof, "%lu", ccache_evictions);
+    } else if (strcmp(path, "/ccache_reads")==0) {
+        eof += sprintf(eof, "%lu", ccache_reads);
+    } else if (strcmp(path, "/cfat_runs")==0) {
+        size_t runs;
+        cfat_runs(&runs);
+        eof += sprintf(eof, "%zu", runs);
+    } else if (strcmp(path, "/cfat_bytes")==0) {
+        eof += sprintf(eof, "%zu", cfat_bytes);
+    } else if (strcmp(path, "/fat_backing")==0) {
+        eof += sprintf(eof, "%s", __atomic_load_n(&vfat_info.fat_backing, __ATOMIC_ACQUIRE));
+    } else if (strcmp(path, "/fat_mirror_mismatches")==0) {
+        mount_wait(MOUNT_MIRROR);
+        eof += sprintf(eof, "%lu", mount_fat_mismatches);
+    } else if (strcmp(path, "/mount_tasks")==0) {
+        eof += mount_format(eof, tmpbuf + sizeof(tmpbuf) - eof);
+    } else if (strcmp(path, "/crawl")==0) {
+        eof += crawl_format(eof, tmpbuf + sizeof(tmpbuf) - eof);
+    } else if (strcmp(path, "/fat_stats")==0) {
+        struct fat_stats stats;
+        mount_wait(MOUNT_FREE);
+        fat_stats_get(&stats);
+        eof += fat_stats_format(&stats, eof, tmpbuf + sizeof(tmpbuf) - eof);
     } else if (CONSUME_PREFIX(path, NEXT_CLUSTER_PATH "/")) {
       unsigned int i;
       if (sscanf(path, "%u", &i) == 1) {
@@ -40,7 +120,7 @@ int debugfs_fuse_read(const char *path, char *buf, size_t size, off_t offs,
     int len = (eof - tmpbuf) - offs;
     if (len < 0) return 0;
     
-    assert(len < 1024);
+    assert(len < DEBUGFS_MAX_FILE_LEN);
     if (len > size) {
       len = size;
     }
@@ -60,6 +140,39 @@ int debugfs_fuse_readdir(
         "reserved_sectors",
         "fat_begin_offset",
         "fat_num_entries",
+        "cluster_map_calls",
+        "cluster_unmap_calls",
+        "readahead",
+        "time_offset",
+        "sequential_reads",
+        "random_reads",
+        "readahead_requests",
+        "readahead_clusters",
+        "dcache_hits",
+        "dcache_negative_hits",
+        "dcache_misses",
+        "dcache_evictions",
+        "dcache_entries",
+        "dirindex_builds",
+        "dirindex_dirs",
+        "writeback_dirty",
+        "writeback_fat_sectors",
+        "writeback_flushes",
+        "writeback_writes",
+        "uring_batches",
+        "uring_reads",
+        "uring_prefetches",
+        "ccache_hits",
+        "ccache_misses",
+        "ccache_evictions",
+        "ccache_reads",
+        "cfat_runs",
+        "cfat_bytes",
+        "fat_backing",
+        "fat_mirror_mismatches",
+        "mount_tasks",
+        "crawl",
+        "fat_stats",
         "next_cluster", // directory
         NULL,
     };
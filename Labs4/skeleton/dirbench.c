@@ -0,0 +1,133 @@
+// vim: noet:ts=4:sts=4:sw=4:et
+// vfat_dirbench: vfat_scan_dir() with a callback that does nothing, over
+// directories of 8.3 names, of long ASCII names and of long non-ASCII names
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "bench.h"
+
+#define BENCH_DEFAULT_ENTRIES 1000
+#define BENCH_DEFAULT_SCANS   200
+#define BENCH_IMAGE_MIB       320 // smallest FAT32 volume of 4 KiB clusters, plus room
+#define BENCH_CLUSTER_SECTORS 8
+
+// Parameters shared with the children
+struct bench_config {
+    const char* image;
+    long        entries;
+    long        scans;
+};
+
+// Directories and the names of their files, %05ld is the file number
+static const struct {
+    const char* dir;
+    const char* format;
+} bench_dirs[] = {
+    { "/SHORT", "F%05ld.TXT" },
+    { "/ascii", "a rather long file name for the directory benchmark %05ld.txt" },
+    { "/utf8", "r\xC3\xA9pertoire fa\xC3\xA7" "ade na\xC3\xAFve \xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E %05ld.txt" },
+};
+
+#define BENCH_DIRS (sizeof(bench_dirs) / sizeof(bench_dirs[0]))
+
+static int Nothing(void* data, const struct vfat_dirent* de)
+{
+    (*(long*)data)++;
+    return 0;
+}
+
+static void Populate(void* arg)
+{
+    struct bench_config* config = arg;
+    vfat_info.writable = 1;
+    bench_mount(config->image);
+
+    char path[PATH_MAX];
+    size_t d;
+    long f;
+    for (d = 0; d < BENCH_DIRS; d++)
+    {
+        if (bench_mkdir(bench_dirs[d].dir) != 0)
+            errx(1, "mkdir %s", bench_dirs[d].dir);
+        for (f = 0; f < config->entries; f++)
+        {
+            int len = snprintf(path, sizeof(path), "%s/", bench_dirs[d].dir);
+            snprintf(path + len, sizeof(path) - len, bench_dirs[d].format, f);
+            int ret = bench_put(path, 0, 1);
+            if (ret != 0)
+                errx(1, "creating %s: %s", path, strerror(-ret));
+        }
+    }
+    bench_unmount();
+}
+
+static void Measure(void* arg)
+{
+    struct bench_config* config = arg;
+    bench_mount(config->image);
+
+    size_t d;
+    for (d = 0; d < BENCH_DIRS; d++)
+    {
+        struct stat st;
+        pthread_rwlock_rdlock(&vfat_tree_lock);
+        if (vfat_resolve(bench_dirs[d].dir, &st) != 0)
+            errx(1, "resolving %s", bench_dirs[d].dir);
+
+        // Best of the scans, the directory is in the page cache after the first
+        double best = 1e9;
+        long seen = 0, s;
+        for (s = 0; s < config->scans; s++)
+        {
+            seen = 0;
+            double start = bench_now();
+            vfat_scan_dir(st.st_ino, Nothing, &seen);
+            double elapsed = bench_now() - start;
+            if (elapsed < best)
+                best = elapsed;
+        }
+        pthread_rwlock_unlock(&vfat_tree_lock);
+
+        // . and .. are part of the scan
+        if (seen != config->entries + 2)
+            errx(1, "scan of %s saw %ld entries", bench_dirs[d].dir, seen);
+        printf("%-8s %10.3f ms %8.1f ns/entry\n", bench_dirs[d].dir + 1, best * 1000, best * 1e9 / seen);
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: vfat_dirbench [-n entries per directory] [-s scans]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_config config;
+    memset(&config, 0, sizeof(config));
+    config.entries = BENCH_DEFAULT_ENTRIES;
+    config.scans = BENCH_DEFAULT_SCANS;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1)
+    {
+        if (opt == 'n' && (config.entries = atol(optarg)) > 0 && config.entries < 65536)
+            continue;
+        if (opt == 's' && (config.scans = atol(optarg)) > 0)
+            continue;
+        usage();
+    }
+    bench_defaults();
+    config.image = bench_image("dirbench", (off_t)BENCH_IMAGE_MIB << 20, BENCH_CLUSTER_SECTORS);
+    bench_run(Populate, &config);
+
+    printf("%ld entries per directory, best of %ld scans\n", config.entries, config.scans);
+    bench_run(Measure, &config);
+    unlink(config.image);
+    return 0;
+}
@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "vfat.h"
+#include "extent.h"
+#include "cfat.h"
+
+// Extent maps are cached per chain, keyed by first cluster
+#define EXTENT_CACHE_SLOTS 256
+
+struct vfat_extent_map* extent_cache[EXTENT_CACHE_SLOTS];
+struct vfat_extent_map* extent_live = NULL;
+unsigned long extent_next_id = 1;
+pthread_mutex_t extent_cache_lock = PTHREAD_MUTEX_INITIALIZER; // protects the slots, the live list and refs
+
+static int is_valid_cluster(uint32_t c)
+{
+    return (c > 0x00000001) && (c < 0x0FFFFFF0);
+}
+
+// Walks the FAT from cluster c to the end of the chain, adding its runs to
+// those map already has. capacity is the size of map->extents
+static void extent_map_walk(struct vfat_extent_map* map, uint32_t c, size_t capacity)
+{
+    while (is_valid_cluster(c) && map->cluster_count < vfat_info.fat_entries)
+    {
+        // The compact FAT hands out whole runs of contiguous clusters at once
+        uint32_t span = 1, next;
+        if (cfat_enabled())
+        {
+            span = cfat_span(c, &next);
+            if (span == 0)
+            {
+                span = 1;
+            }
+            if (span > vfat_info.fat_entries - map->cluster_count)
+            {
+                span = vfat_info.fat_entries - map->cluster_count;
+            }
+        }
+        else
+        {
+            next = vfat_next_cluster(c);
+        }
+
+        struct vfat_extent* last = map->count ? &map->extents[map->count - 1] : NULL;
+        if (last != NULL && c == last->physical + last->length)
+        {
+            last->length += span;
+        }
+        else
+        {
+            if (map->count == capacity)
+            {
+                capacity *= 2;
+                map->extents = realloc(map->extents, capacity * sizeof(struct vfat_extent));
+                if (map->extents == NULL)
+                    err(1, "extent_map_build");
+            }
+            map->extents[map->count].logical = map->cluster_count;
+            map->extents[map->count].physical = c;
+            map->extents[map->count].length = span;
+            map->count++;
+        }
+        map->cluster_count += span;
+        c = next & 0x0FFFFFFF;
+    }
+}
+
+// Walks the FAT once and records every contiguous run of the chain
+static struct vfat_extent_map* extent_map_build(uint32_t first_cluster)
+{
+    struct vfat_extent_map* map = calloc(1, sizeof(*map));
+    size_t capacity = 4;
+    if (map == NULL || (map->extents = malloc(capacity * sizeof(struct vfat_extent))) == NULL)
+        err(1, "extent_map_build");
+    map->first_cluster = first_cluster;
+    map->refs = 1; // reference held by the cache
+    extent_map_walk(map, first_cluster, capacity);
+    return map;
+}
+
+static void extent_map_register_locked(struct vfat_extent_map* map)
+{
+    map->id = extent_next_id++;
+    map->live_prev = NULL;
+    map->live_next = extent_live;
+    if (extent_live)
+        extent_live->live_prev = map;
+    extent_live = map;
+}
+
+static void extent_map_put_locked(struct vfat_extent_map* map)
+{
+    if (map == NULL || --map->refs > 0)
+        return;
+    if (map->live_prev) map->live_prev->live_next = map->live_next;
+    else extent_live = map->live_next;
+    if (map->live_next) map->live_next->live_prev = map->live_prev;
+    free(map->extents);
+    free(map);
+}
+
+// Takes another reference on a map, NULL is passed through
+struct vfat_extent_map* extent_map_hold(struct vfat_extent_map* map)
+{
+    if (map == NULL)
+        return NULL;
+    pthread_mutex_lock(&extent_cache_lock);
+    map->refs++;
+    pthread_mutex_unlock(&extent_cache_lock);
+    return map;
+}
+
+// Releases a map returned by extent_map_get()
+void extent_map_put(struct vfat_extent_map* map)
+{
+    pthread_mutex_lock(&extent_cache_lock);
+    extent_map_put_locked(map);
+    pthread_mutex_unlock(&extent_cache_lock);
+}
+
+// Returns the (possibly cached) extent map of the chain starting at first_cluster
+// or NULL for an empty chain, release it with extent_map_put()
+struct vfat_extent_map* extent_map_get(uint32_t first_cluster)
+{
+    first_cluster &= 0x0FFFFFFF;
+    if (!is_valid_cluster(first_cluster))
+        return NULL;
+
+    struct vfat_extent_map** slot = &extent_cache[first_cluster % EXTENT_CACHE_SLOTS];
+    struct vfat_extent_map* map;
+
+    pthread_mutex_lock(&extent_cache_lock);
+    if (*slot != NULL && (*slot)->first_cluster == first_cluster)
+    {
+        map = *slot;
+        map->refs++;
+        pthread_mutex_unlock(&extent_cache_lock);
+        return map;
+    }
+    pthread_mutex_unlock(&extent_cache_lock);
+
+    // Walk the chain without holding the lock
+    map = extent_map_build(first_cluster);
+
+    pthread_mutex_lock(&extent_cache_lock);
+    extent_map_register_locked(map);
+    if (*slot != NULL && (*slot)->first_cluster == first_cluster)
+    {
+        // Somebody else built the same chain meanwhile
+        extent_map_put_locked(map);
+        map = *slot;
+    }
+    else
+    {
+        extent_map_put_locked(*slot);
+        *slot = map;
+    }
+    map->refs++;
+    pthread_mutex_unlock(&extent_cache_lock);
+    return map;
+}
+
+// Map of a chain the FAT just linked to the chain starting at tail. Only the
+// new clusters are walked, so growing a file one cluster at a time stays
+// linear. The result replaces the cached map and copies held by open files
+// are marked stale, release it with extent_map_put()
+struct vfat_extent_map* extent_map_append(const struct vfat_extent_map* map, uint32_t tail)
+{
+    struct vfat_extent_map* grown = calloc(1, sizeof(*grown));
+    size_t capacity = map->count + 4;
+    if (grown == NULL || (grown->extents = malloc(capacity * sizeof(struct vfat_extent))) == NULL)
+        err(1, "extent_map_append");
+    memcpy(grown->extents, map->extents, map->count * sizeof(struct vfat_extent));
+    grown->first_cluster = map->first_cluster;
+    grown->cluster_count = map->cluster_count;
+    grown->count = map->count;
+    grown->refs = 1; // reference held by the cache
+    extent_map_walk(grown, tail & 0x0FFFFFFF, capacity);
+
+    struct vfat_extent_map** slot = &extent_cache[grown->first_cluster % EXTENT_CACHE_SLOTS];
+    struct vfat_extent_map* other;
+    pthread_mutex_lock(&extent_cache_lock);
+    for (other = extent_live; other != NULL; other = other->live_next)
+    {
+        if (other->first_cluster == grown->first_cluster)
+            __atomic_store_n(&other->stale, 1, __ATOMIC_RELAXED);
+    }
+    extent_map_register_locked(grown);
+    extent_map_put_locked(*slot);
+    *slot = grown;
+    grown->refs++;
+    pthread_mutex_unlock(&extent_cache_lock);
+    return grown;
+}
+
+// Translates the logical cluster index of a chain into its physical cluster
+// run is set to the number of contiguous clusters starting there
+// returns -1 past the end of the chain
+int extent_lookup(const struct vfat_extent_map* map, uint32_t logical, uint32_t* physical, uint32_t* run)
+{
+    if (map == NULL || logical >= map->cluster_count)
+        return -1;
+
+    // Binary search the last extent starting at or before logical
+    size_t lo = 0, hi = map->count;
+    while (hi - lo > 1)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (map->extents[mid].logical <= logical)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    const struct vfat_extent* e = &map->extents[lo];
+    *physical = e->physical + (logical - e->logical);
+    *run = e->length - (logical - e->logical);
+    return 0;
+}
+
+// Drops the cached map of a chain whose FAT entries changed and marks the
+// copies held by open files stale
+void extent_cache_invalidate(uint32_t first_cluster)
+{
+    first_cluster &= 0x0FFFFFFF;
+    struct vfat_extent_map** slot = &extent_cache[first_cluster % EXTENT_CACHE_SLOTS];
+    struct vfat_extent_map* map;
+    pthread_mutex_lock(&extent_cache_lock);
+    for (map = extent_live; map != NULL; map = map->live_next)
+    {
+        if (map->first_cluster == first_cluster)
+            __atomic_store_n(&map->stale, 1, __ATOMIC_RELAXED);
+    }
+    if (*slot != NULL && (*slot)->first_cluster == first_cluster)
+    {
+        extent_map_put_locked(*slot);
+        *slot = NULL;
+    }
+    pthread_mutex_unlock(&extent_cache_lock);
+}
@@ -0,0 +1,36 @@
+#ifndef H_EXTENT
+#define H_EXTENT
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A run of physically contiguous clusters inside a cluster chain
+struct vfat_extent {
+    uint32_t logical;  // index of the run's first cluster inside the chain
+    uint32_t physical; // cluster number of the run's first cluster on disk
+    uint32_t length;   // number of clusters in the run
+};
+
+// Whole cluster chain of a file or directory, compressed as extents
+struct vfat_extent_map {
+    uint32_t            first_cluster;
+    uint32_t            cluster_count;
+    size_t              count;
+    struct vfat_extent* extents;
+    int                 refs;
+    unsigned long       id;    // unique per built map
+    int                 stale; // the chain changed since the map was built
+
+    // All maps alive, cached or held by open files
+    struct vfat_extent_map* live_prev;
+    struct vfat_extent_map* live_next;
+};
+
+struct vfat_extent_map* extent_map_get(uint32_t first_cluster);
+struct vfat_extent_map* extent_map_hold(struct vfat_extent_map* map);
+void extent_map_put(struct vfat_extent_map* map);
+struct vfat_extent_map* extent_map_append(const struct vfat_extent_map* map, uint32_t tail);
+int extent_lookup(const struct vfat_extent_map* map, uint32_t logical, uint32_t* physical, uint32_t* run);
+void extent_cache_invalidate(uint32_t first_cluster);
+
+#endif
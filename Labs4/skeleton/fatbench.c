@@ -0,0 +1,199 @@
+// vim: noet:ts=4:sts=4:sw=4:et
+// vfat_fatbench: random cluster chain walks over a FAT mapped with mmap_file()
+// against the copy load_file_huge() makes for -o hugefat
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define BENCH_DEFAULT_MIB   256
+#define BENCH_DEFAULT_STEPS 20000000
+#define BENCH_FAT_MASK      0x0FFFFFFF
+#define BENCH_WRITE_CHUNK   ((size_t)1 << 20) // entries written per pwrite
+
+// Keeps the compiler from dropping the walks
+volatile uint32_t bench_sink;
+
+static double Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, plenty for shuffling
+static uint64_t Random(uint64_t* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ull;
+}
+
+// Writes a FAT of entries entries to an unlinked temporary file, linking all
+// of them into one chain in random order (Sattolo's shuffle gives a single cycle)
+static int MakeFat(size_t entries)
+{
+    uint32_t* fat = malloc(entries * sizeof(uint32_t));
+    if (fat == NULL)
+        err(1, "malloc");
+
+    size_t i;
+    uint64_t state = 88172645463325252ull;
+    for (i = 0; i < entries; i++)
+    {
+        fat[i] = i;
+    }
+    for (i = entries - 1; i > 0; i--)
+    {
+        size_t j = Random(&state) % i;
+        uint32_t tmp = fat[i];
+        fat[i] = fat[j];
+        fat[j] = tmp;
+    }
+
+    char path[] = "/tmp/vfat_fatbench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        err(1, "mkstemp");
+    unlink(path);
+    for (i = 0; i < entries; i += BENCH_WRITE_CHUNK)
+    {
+        size_t n = (entries - i < BENCH_WRITE_CHUNK) ? entries - i : BENCH_WRITE_CHUNK;
+        if (pwrite_full(fd, fat + i, n * sizeof(uint32_t), i * sizeof(uint32_t)) != 0)
+            err(1, "pwrite");
+    }
+    free(fat);
+    return fd;
+}
+
+// Counter of data TLB read misses of this thread, -1 if perf events are unavailable
+static int OpenTlbCounter(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB
+                | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Follows the chain for steps steps, like vfat_next_cluster() does
+static uint32_t Walk(const uint32_t* fat, long steps)
+{
+    uint32_t c = 2;
+    long i;
+    for (i = 0; i < steps; i++)
+    {
+        c = fat[c] & BENCH_FAT_MASK;
+    }
+    return c;
+}
+
+static void Run(const char* name, const uint32_t* fat, size_t entries, long steps, int counter)
+{
+    // Fault every page in first, only the walk itself is measured
+    uint32_t sum = 0;
+    size_t i;
+    for (i = 0; i < entries; i += 1024)
+    {
+        sum += fat[i];
+    }
+    Walk(fat, steps / 10);
+
+    uint64_t misses = 0;
+    if (counter >= 0)
+    {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    double start = Now();
+    sum += Walk(fat, steps);
+    double elapsed = Now() - start;
+    if (counter >= 0)
+    {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &misses, sizeof(misses)) != sizeof(misses))
+            misses = 0;
+    }
+    bench_sink = sum;
+
+    printf("%-10s %8.1f ns/step", name, elapsed * 1e9 / steps);
+    if (counter >= 0)
+        printf(" %8.3f dTLB misses/step", (double)misses / steps);
+    printf("\n");
+}
+
+// Anonymous memory of this process backed by transparent huge pages, in KiB
+static long HugePagesKiB(void)
+{
+    FILE* f = fopen("/proc/self/smaps_rollup", "r");
+    char line[256];
+    long kib = -1;
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kib) == 1)
+            break;
+    }
+    fclose(f);
+    return kib;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: vfat_fatbench [-s FAT MiB] [-n steps]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    size_t mib = BENCH_DEFAULT_MIB;
+    long steps = BENCH_DEFAULT_STEPS;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:")) != -1)
+    {
+        if (opt == 's' && (mib = atol(optarg)) > 0)
+            continue;
+        if (opt == 'n' && (steps = atol(optarg)) > 0)
+            continue;
+        usage();
+    }
+
+    size_t size = mib << 20;
+    size_t entries = size / sizeof(uint32_t);
+    if (entries > BENCH_FAT_MASK)
+        errx(1, "FAT of %zu MiB has more entries than FAT32 allows", mib);
+
+    int fd = MakeFat(entries);
+    int counter = OpenTlbCounter();
+    printf("FAT %zu MiB, %zu entries, %ld steps%s\n", mib, entries, steps,
+           (counter < 0) ? ", no perf events for dTLB misses" : "");
+
+    const uint32_t* mapped = mmap_file(fd, 0, size);
+    Run("mmap_file", mapped, entries, steps, counter);
+    unmap((void*)mapped, size);
+
+    int hugetlb;
+    const uint32_t* copy = load_file_huge(fd, 0, size, &hugetlb);
+    Run(hugetlb ? "hugetlb" : "thp", copy, entries, steps, counter);
+    if (!hugetlb)
+        printf("thp: %ld KiB in transparent huge pages\n", HugePagesKiB());
+    return 0;
+}
@@ -0,0 +1,320 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT_STATS_X86 1
+#endif
+
+#include "vfat.h"
+#include "fatstats.h"
+#include "cfat.h"
+
+#define FAT_STATS_MASK  0x0FFFFFFF
+#define FAT_STATS_BAD   0x0FFFFFF7 // anything above is an end of chain marker
+
+// Classification of 64 consecutive FAT entries, bit k describes entry first + k
+struct fat_masks {
+    uint64_t free;
+    uint64_t bad;
+    uint64_t eoc;
+    uint64_t link; // entry points at the cluster right after it
+};
+
+typedef void (*fat_classify_fn)(const uint32_t* fat, uint32_t first, int n, struct fat_masks* m);
+
+static void ClassifyScalar(const uint32_t* fat, uint32_t first, int n, struct fat_masks* m)
+{
+    int k;
+    memset(m, 0, sizeof(*m));
+    for (k = 0; k < n; k++)
+    {
+        uint32_t value = fat[first + k] & FAT_STATS_MASK;
+        uint64_t bit = (uint64_t)1 << k;
+        if (value == 0)
+            m->free |= bit;
+        else if (value == FAT_STATS_BAD)
+            m->bad |= bit;
+        else if (value > FAT_STATS_BAD)
+            m->eoc |= bit;
+        else if (value == first + k + 1)
+            m->link |= bit;
+    }
+}
+
+#ifdef FAT_STATS_X86
+// Masked entries stay below 2^28, so signed compares work for "above BAD"
+__attribute__((target("sse2")))
+static void ClassifySse2(const uint32_t* fat, uint32_t first, int n, struct fat_masks* m)
+{
+    if (n < 64)
+    {
+        ClassifyScalar(fat, first, n, m);
+        return;
+    }
+
+    const __m128i mask = _mm_set1_epi32(FAT_STATS_MASK);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bad = _mm_set1_epi32(FAT_STATS_BAD);
+    const __m128i step = _mm_set1_epi32(4);
+    __m128i next = _mm_setr_epi32(first + 1, first + 2, first + 3, first + 4);
+    uint64_t isFree = 0, isBad = 0, isEoc = 0, isLink = 0;
+    int k;
+
+    for (k = 0; k < 64; k += 4)
+    {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(fat + first + k)), mask);
+        isFree |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))) << k;
+        isBad |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, bad))) << k;
+        isEoc |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, bad))) << k;
+        isLink |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, next))) << k;
+        next = _mm_add_epi32(next, step);
+    }
+    m->free = isFree;
+    m->bad = isBad;
+    m->eoc = isEoc;
+    m->link = isLink;
+}
+
+__attribute__((target("avx2")))
+static void ClassifyAvx2(const uint32_t* fat, uint32_t first, int n, struct fat_masks* m)
+{
+    if (n < 64)
+    {
+        ClassifyScalar(fat, first, n, m);
+        return;
+    }
+
+    const __m256i mask = _mm256_set1_epi32(FAT_STATS_MASK);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i bad = _mm256_set1_epi32(FAT_STATS_BAD);
+    const __m256i step = _mm256_set1_epi32(8);
+    __m256i next = _mm256_setr_epi32(first + 1, first + 2, first + 3, first + 4,
+                                     first + 5, first + 6, first + 7, first + 8);
+    uint64_t isFree = 0, isBad = 0, isEoc = 0, isLink = 0;
+    int k;
+
+    for (k = 0; k < 64; k += 8)
+    {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(fat + first + k)), mask);
+        isFree |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero))) << k;
+        isBad |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, bad))) << k;
+        isEoc |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, bad))) << k;
+        isLink |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, next))) << k;
+        next = _mm256_add_epi32(next, step);
+    }
+    m->free = isFree;
+    m->bad = isBad;
+    m->eoc = isEoc;
+    m->link = isLink;
+}
+#endif
+
+static int Bucket(uint32_t length)
+{
+    int bucket = 63 - __builtin_clzll(length);
+    return (bucket < FAT_STATS_BUCKETS) ? bucket : FAT_STATS_BUCKETS - 1;
+}
+
+// Feeds n bits into a run length histogram, *open carries the length of the
+// run still going on at the end of the previous word. extra is added to each
+// length before bucketing
+static void CountRuns(uint64_t bits, int n, uint32_t* open, int extra, unsigned long* hist, uint32_t* runs)
+{
+    int pos = 0;
+
+    if (n == 64 && bits == ~(uint64_t)0)
+    {
+        *open += 64;
+        return;
+    }
+    while (pos < n)
+    {
+        uint64_t rest = bits >> pos;
+        if (rest & 1)
+        {
+            int ones = __builtin_ctzll(~rest);
+            *open += ones;
+            pos += ones;
+            continue;
+        }
+        if (*open != 0)
+        {
+            hist[Bucket(*open + extra)]++;
+            (*runs)++;
+            *open = 0;
+        }
+        if (rest == 0)
+        {
+            break;
+        }
+        pos += __builtin_ctzll(rest);
+    }
+}
+
+static fat_classify_fn ChooseClassify(const char** method)
+{
+#ifdef FAT_STATS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        *method = "avx2";
+        return ClassifyAvx2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        *method = "sse2";
+        return ClassifySse2;
+    }
+#endif
+    *method = "scalar";
+    return ClassifyScalar;
+}
+
+// Same summary taken from the runs of the compact FAT, gaps between runs are free
+static void ScanRuns(struct fat_stats* stats)
+{
+    size_t count, r;
+    const struct cfat_run* runs = cfat_runs(&count);
+    uint32_t used = 0, end = 2;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->method = "compact";
+    stats->clusters = vfat_info.spec_CountofClusters;
+
+    for (r = 0; r < count; r++)
+    {
+        if (runs[r].start > end)
+        {
+            stats->free_hist[Bucket(runs[r].start - end)]++;
+            stats->free_runs++;
+        }
+        end = runs[r].start + runs[r].length;
+        used += runs[r].length;
+
+        if (runs[r].next == FAT_STATS_BAD)
+        {
+            stats->bad++;
+            continue;
+        }
+        if (runs[r].next > FAT_STATS_BAD)
+        {
+            stats->eoc++;
+        }
+        stats->extents++;
+        stats->extent_hist[Bucket(runs[r].length)]++;
+    }
+    if (vfat_info.spec_CountofClusters + 2 > end)
+    {
+        stats->free_hist[Bucket(vfat_info.spec_CountofClusters + 2 - end)]++;
+        stats->free_runs++;
+    }
+    stats->free = stats->clusters - used;
+}
+
+// One pass over the in-memory FAT, 64 entries at a time
+void fat_stats_scan(struct fat_stats* stats)
+{
+    uint32_t last = vfat_info.spec_CountofClusters + 1;
+    uint32_t openFree = 0, openLink = 0, linkRuns = 0;
+    unsigned long linkHist[FAT_STATS_BUCKETS];
+    uint32_t c;
+
+    if (cfat_enabled())
+    {
+        ScanRuns(stats);
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    memset(linkHist, 0, sizeof(linkHist));
+    fat_classify_fn classify = ChooseClassify(&stats->method);
+    stats->clusters = vfat_info.spec_CountofClusters;
+
+    for (c = 2; c <= last; c += 64)
+    {
+        int n = (last - c + 1 < 64) ? (int)(last - c + 1) : 64;
+        uint64_t valid = (n == 64) ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+        struct fat_masks m;
+        classify(vfat_info.fat, c, n, &m);
+
+        uint64_t used = valid & ~m.free & ~m.bad;
+        uint64_t link = m.link & used;
+        stats->free += __builtin_popcountll(m.free & valid);
+        stats->bad += __builtin_popcountll(m.bad & valid);
+        stats->eoc += __builtin_popcountll(m.eoc & valid);
+
+        // Every used cluster not linking to its neighbour ends an extent
+        stats->extents += __builtin_popcountll(used & ~link);
+
+        CountRuns(m.free & valid, n, &openFree, 0, stats->free_hist, &stats->free_runs);
+        CountRuns(link, n, &openLink, 1, linkHist, &linkRuns);
+    }
+    CountRuns(0, 1, &openFree, 0, stats->free_hist, &stats->free_runs);
+    CountRuns(0, 1, &openLink, 1, linkHist, &linkRuns);
+
+    // A run of k linking clusters is an extent of k + 1 clusters, the other
+    // extents are single clusters
+    int b;
+    for (b = 0; b < FAT_STATS_BUCKETS; b++)
+    {
+        stats->extent_hist[b] = linkHist[b];
+    }
+    stats->extent_hist[0] += stats->extents - linkRuns;
+}
+
+// Scanning is cheap but not free, readers asking within the same second share a result
+struct fat_stats fat_stats_cached;
+time_t fat_stats_time = 0;
+pthread_mutex_t fat_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void fat_stats_get(struct fat_stats* stats)
+{
+    pthread_mutex_lock(&fat_stats_lock);
+    time_t now = time(NULL);
+    if (now != fat_stats_time)
+    {
+        fat_stats_scan(&fat_stats_cached);
+        fat_stats_time = now;
+    }
+    *stats = fat_stats_cached;
+    pthread_mutex_unlock(&fat_stats_lock);
+}
+
+static int FormatHistogram(const char* name, const unsigned long* hist, char* buf, size_t size)
+{
+    int len = snprintf(buf, size, "%s", name);
+    int b;
+    for (b = 0; b < FAT_STATS_BUCKETS && len < (int)size; b++)
+    {
+        if (hist[b] == 0)
+            continue;
+        if (b == 0)
+            len += snprintf(buf + len, size - len, " 1:%lu", hist[b]);
+        else
+            len += snprintf(buf + len, size - len, " %u-%u:%lu", 1u << b, (2u << b) - 1, hist[b]);
+    }
+    if (len < (int)size)
+        len += snprintf(buf + len, size - len, "\n");
+    return len;
+}
+
+// Text form exported as /.debug/fat_stats, returns its length
+int fat_stats_format(const struct fat_stats* stats, char* buf, size_t size)
+{
+    int len = snprintf(buf, size,
+                       "clusters %u\nfree %u\nbad %u\nused %u\nchains %u\nextents %u\n"
+                       "extents_per_chain %.2f\nfree_runs %u\n",
+                       stats->clusters, stats->free, stats->bad, stats->clusters - stats->free - stats->bad,
+                       stats->eoc, stats->extents,
+                       stats->eoc ? (double)stats->extents / stats->eoc : 0.0, stats->free_runs);
+    if (len < (int)size)
+        len += FormatHistogram("extent_lengths", stats->extent_hist, buf + len, size - len);
+    if (len < (int)size)
+        len += FormatHistogram("free_run_lengths", stats->free_hist, buf + len, size - len);
+    if (len < (int)size)
+        len += snprintf(buf + len, size - len, "scan %s\n", stats->method);
+    return (len < (int)size) ? len : (int)size - 1;
+}
@@ -0,0 +1,27 @@
+#ifndef H_FATSTATS
+#define H_FATSTATS
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Run lengths are bucketed by powers of two: 1, 2-3, 4-7, ...
+#define FAT_STATS_BUCKETS 29
+
+// Summary of the whole FAT, see fat_stats_get()
+struct fat_stats {
+    uint32_t      clusters;   // data clusters of the volume
+    uint32_t      free;
+    uint32_t      bad;
+    uint32_t      eoc;        // end of chain markers, one per chain
+    uint32_t      extents;    // runs of contiguous clusters inside chains
+    uint32_t      free_runs;  // runs of contiguous free clusters
+    unsigned long extent_hist[FAT_STATS_BUCKETS];
+    unsigned long free_hist[FAT_STATS_BUCKETS];
+    const char*   method;     // scan implementation that was used
+};
+
+void fat_stats_scan(struct fat_stats* stats);
+void fat_stats_get(struct fat_stats* stats);
+int fat_stats_format(const struct fat_stats* stats, char* buf, size_t size);
+
+#endif
@@ -0,0 +1,194 @@
+// vim: noet:ts=4:sts=4:sw=4:et
+// vfat_lsbench: the walk of ls -lR, paged readdir then getattr on every
+// entry, with the dentry cache filled by readdir and without
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "dcache.h"
+#include "bench.h"
+
+#define BENCH_DEFAULT_DIRS    100
+#define BENCH_DEFAULT_FILES   1000
+#define BENCH_PAGE            64  // entries per readdir call, about what fits a 4 KiB fuse buffer
+#define BENCH_PASSES          2
+#define BENCH_IMAGE_MIB       320 // smallest FAT32 volume of 4 KiB clusters, plus room
+#define BENCH_CLUSTER_SECTORS 8
+
+// Parameters shared with the children
+struct bench_config {
+    const char* image;
+    long        dirs;
+    long        files;
+    int         drop; // drop what readdir put in the dentry cache, as before it did
+};
+
+// Entries of one directory, gathered a page at a time
+struct bench_listing {
+    char** names;
+    int*   isdir;
+    size_t count;
+    size_t capacity;
+    int    left;  // room left in the current page
+    off_t  next;  // offset the next page starts from
+};
+
+static int Fill(void* data, const char* name, const struct stat* st, off_t off)
+{
+    struct bench_listing* listing = data;
+    if (listing->left == 0)
+    {
+        return 1;
+    }
+    listing->left--;
+    listing->next = off;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        return 0;
+    }
+
+    if (listing->count == listing->capacity)
+    {
+        listing->capacity = listing->capacity ? listing->capacity * 2 : 64;
+        listing->names = realloc(listing->names, listing->capacity * sizeof(char*));
+        listing->isdir = realloc(listing->isdir, listing->capacity * sizeof(int));
+        if (listing->names == NULL || listing->isdir == NULL)
+            err(1, "realloc");
+    }
+    listing->names[listing->count] = strdup(name);
+    listing->isdir[listing->count] = S_ISDIR(st->st_mode);
+    listing->count++;
+    return 0;
+}
+
+// Lists path like ls -l, then descends into its subdirectories. Returns the entries seen
+static long Walk(const struct bench_config* config, const char* path)
+{
+    struct bench_listing listing;
+    memset(&listing, 0, sizeof(listing));
+    size_t before;
+    do
+    {
+        before = listing.count;
+        listing.left = BENCH_PAGE;
+        if (vfat_available_ops.readdir(path, &listing, Fill, listing.next, NULL) != 0)
+            errx(1, "readdir %s", path);
+    }
+    while (listing.left == 0 || listing.count != before);
+
+    struct stat st;
+    if (config->drop && vfat_available_ops.getattr(path, &st) == 0)
+    {
+        dcache_invalidate_parent(st.st_ino);
+    }
+
+    long seen = listing.count;
+    size_t i;
+    char child[PATH_MAX];
+    for (i = 0; i < listing.count; i++)
+    {
+        snprintf(child, sizeof(child), "%s/%s", (strcmp(path, "/") == 0) ? "" : path, listing.names[i]);
+        if (vfat_available_ops.getattr(child, &st) != 0)
+            errx(1, "getattr %s", child);
+    }
+    for (i = 0; i < listing.count; i++)
+    {
+        if (listing.isdir[i])
+        {
+            snprintf(child, sizeof(child), "%s/%s", (strcmp(path, "/") == 0) ? "" : path, listing.names[i]);
+            seen += Walk(config, child);
+        }
+        free(listing.names[i]);
+    }
+    free(listing.names);
+    free(listing.isdir);
+    return seen;
+}
+
+static void Populate(void* arg)
+{
+    struct bench_config* config = arg;
+    vfat_info.writable = 1;
+    bench_mount(config->image);
+
+    char path[PATH_MAX];
+    long d, f;
+    for (d = 0; d < config->dirs; d++)
+    {
+        snprintf(path, sizeof(path), "/directory %03ld", d);
+        if (bench_mkdir(path) != 0)
+            errx(1, "mkdir %s", path);
+        for (f = 0; f < config->files; f++)
+        {
+            snprintf(path, sizeof(path), "/directory %03ld/document %05ld.txt", d, f);
+            int ret = bench_put(path, 0, 1);
+            if (ret != 0)
+                errx(1, "creating %s: %s", path, strerror(-ret));
+        }
+    }
+    bench_unmount();
+}
+
+static void Measure(void* arg)
+{
+    struct bench_config* config = arg;
+    bench_mount(config->image);
+
+    printf("%-22s", config->drop ? "dropped after readdir" : "filled by readdir");
+    int pass;
+    for (pass = 0; pass < BENCH_PASSES; pass++)
+    {
+        unsigned long misses = dcache_misses;
+        double start = bench_now();
+        long seen = Walk(config, "/");
+        double elapsed = bench_now() - start;
+        if (seen != config->dirs * (config->files + 1))
+            errx(1, "walk saw %ld entries", seen);
+        printf(" %8.1f ms %8lu", elapsed * 1000, dcache_misses - misses);
+    }
+    printf("\n");
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: vfat_lsbench [-d directories] [-f files per directory]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_config config;
+    memset(&config, 0, sizeof(config));
+    config.dirs = BENCH_DEFAULT_DIRS;
+    config.files = BENCH_DEFAULT_FILES;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:f:")) != -1)
+    {
+        if (opt == 'd' && (config.dirs = atol(optarg)) > 0 && config.dirs < 1000)
+            continue;
+        if (opt == 'f' && (config.files = atol(optarg)) > 0 && config.files < 65536)
+            continue;
+        usage();
+    }
+    bench_defaults();
+    config.image = bench_image("lsbench", (off_t)BENCH_IMAGE_MIB << 20, BENCH_CLUSTER_SECTORS);
+    bench_run(Populate, &config);
+
+    // Read-only mounts, the defaults of the dentry cache are theirs
+    printf("%ld directories x %ld files, read-only mount\n", config.dirs, config.files);
+    printf("%-22s %20s %20s\n", "dentry cache", "first pass  misses", "second pass  misses");
+    for (config.drop = 0; config.drop <= 1; config.drop++)
+    {
+        bench_run(Measure, &config);
+    }
+    unlink(config.image);
+    return 0;
+}
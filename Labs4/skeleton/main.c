@@ -0,0 +1,55 @@
+// vim: noet:ts=4:sts=4:sw=4:et
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <fuse.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vfat.h"
+
+static struct fuse_opt vfat_opts[] = {
+    { "readahead=%u", offsetof(struct vfat_data, readahead), 0 },
+    { "rw", offsetof(struct vfat_data, writable), 1 },
+    { "writeback=%u", offsetof(struct vfat_data, writeback), 0 },
+    { "uring", offsetof(struct vfat_data, uring), 1 },
+    { "direct=%u", offsetof(struct vfat_data, direct), 0 },
+    { "hugefat", offsetof(struct vfat_data, hugefat), 1 },
+    { "compactfat", offsetof(struct vfat_data, compactfat), 1 },
+    { "crawl=%u", offsetof(struct vfat_data, crawl), 0 },
+    { "time_offset=%d", offsetof(struct vfat_data, time_offset), 0 },
+    FUSE_OPT_END
+};
+
+int
+vfat_opt_args(void *data, const char *arg, int key, struct fuse_args *oargs)
+{
+    if (key == FUSE_OPT_KEY_NONOPT && !vfat_info.dev) {
+        vfat_info.dev = strdup(arg);
+        return (0);
+    }
+    return (1);
+}
+
+int main(int argc, char **argv)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    vfat_info.readahead = VFAT_READAHEAD_DEFAULT;
+    vfat_info.time_offset = VFAT_TIME_OFFSET_LOCAL;
+    fuse_opt_parse(&args, &vfat_info, vfat_opts, vfat_opt_args);
+
+    if (!vfat_info.dev)
+        errx(1, "missing file system parameter");
+
+    // Inserted ahead of the user's options, which still override them
+    if (!vfat_info.writable)
+        fuse_opt_insert_arg(&args, 1, "-oentry_timeout=" VFAT_RO_CACHE_TIMEOUT
+                            ",attr_timeout=" VFAT_RO_CACHE_TIMEOUT
+                            ",negative_timeout=" VFAT_RO_CACHE_TIMEOUT);
+
+    vfat_init(vfat_info.dev);
+    return (fuse_main(args.argc, args.argv, &vfat_available_ops, NULL));
+}
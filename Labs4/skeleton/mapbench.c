@@ -0,0 +1,191 @@
+// vim: noet:ts=4:sts=4:sw=4:et
+// vfat_mapbench: cluster map and unmap calls per MB read, with the whole data
+// region mapped and with the fallback windows, for file reads through the
+// read op and for directory scans through vfat_scan_dir()
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "util.h"
+#include "extent.h"
+#include "bench.h"
+
+#define BENCH_DEFAULT_MIB      64
+#define BENCH_DEFAULT_ENTRIES  2000
+#define BENCH_DEFAULT_SCANS    100
+#define BENCH_REQUEST          ((size_t)128 << 10) // the largest read fuse sends
+#define BENCH_CLUSTER_SECTORS  8                   // 4 KiB clusters
+#define BENCH_FILE             "/data.bin"
+#define BENCH_DIR              "/names"
+
+// Parameters shared with the children
+struct bench_config {
+    const char* image;
+    size_t      mib;
+    long        entries;
+    long        scans;
+    int         windows; // drop the mapping of the data region after the mount
+};
+
+// Keeps the compiler from dropping the reads
+volatile char bench_sink;
+
+static int Nothing(void* data, const struct vfat_dirent* de)
+{
+    (*(long*)data)++;
+    return 0;
+}
+
+static void Populate(void* arg)
+{
+    struct bench_config* config = arg;
+    vfat_info.writable = 1;
+    bench_mount(config->image);
+    int ret = bench_put(BENCH_FILE, (off_t)config->mib << 20, (size_t)1 << 20);
+    if (ret != 0)
+        errx(1, "writing %s: %s", BENCH_FILE, strerror(-ret));
+
+    char path[PATH_MAX];
+    long f;
+    if (bench_mkdir(BENCH_DIR) != 0)
+        errx(1, "mkdir %s", BENCH_DIR);
+    for (f = 0; f < config->entries; f++)
+    {
+        snprintf(path, sizeof(path), BENCH_DIR "/a long name so each entry takes a few slots %05ld.txt", f);
+        if ((ret = bench_put(path, 0, 1)) != 0)
+            errx(1, "creating %s: %s", path, strerror(-ret));
+    }
+    bench_unmount();
+}
+
+static void Measure(void* arg)
+{
+    struct bench_config* config = arg;
+    bench_mount(config->image);
+    if (config->windows && vfat_info.data != NULL)
+    {
+        unmap(vfat_info.data, vfat_info.data_size);
+        vfat_info.data = NULL;
+    }
+    const char* mode = config->windows ? "windows" : "region";
+    if (!config->windows && vfat_info.data == NULL)
+    {
+        printf("%-8s unavailable\n", mode);
+        return;
+    }
+
+    // The file, front to back in fuse sized requests
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDONLY;
+    if (vfat_available_ops.open(BENCH_FILE, &fi) != 0)
+        errx(1, "open %s", BENCH_FILE);
+    char* buf = malloc(BENCH_REQUEST);
+    if (buf == NULL)
+        err(1, "malloc");
+
+    unsigned long maps = vfat_info.cluster_map_calls, unmaps = vfat_info.cluster_unmap_calls;
+    unsigned long reads, writes, startReads;
+    bench_syscalls(&startReads, &writes);
+    double start = bench_now();
+    off_t size = (off_t)config->mib << 20, offs;
+    for (offs = 0; offs < size; offs += BENCH_REQUEST)
+    {
+        int ret = vfat_available_ops.read(BENCH_FILE, buf, BENCH_REQUEST, offs, &fi);
+        if (ret != (int)BENCH_REQUEST)
+            errx(1, "read at %lld returned %d", (long long)offs, ret);
+        bench_sink = buf[0];
+    }
+    double elapsed = bench_now() - start;
+    bench_syscalls(&reads, &writes);
+    vfat_available_ops.release(BENCH_FILE, &fi);
+    free(buf);
+
+    double mb = size / 1e6;
+    printf("%-8s %-10s %8.0f %10.2f %10.2f %10.2f %10.1f\n", mode, "file", mb,
+           (vfat_info.cluster_map_calls - maps) / mb, (vfat_info.cluster_unmap_calls - unmaps) / mb,
+           (reads - startReads) / mb, mb / elapsed);
+
+    // The directory, scanned over and over under the tree lock like readdir
+    struct stat st;
+    pthread_rwlock_rdlock(&vfat_tree_lock);
+    if (vfat_resolve(BENCH_DIR, &st) != 0)
+        errx(1, "resolving %s", BENCH_DIR);
+    struct vfat_extent_map* extents = extent_map_get(st.st_ino);
+    mb = (double)extents->cluster_count * vfat_info.cluster_size * config->scans / 1e6;
+    extent_map_put(extents);
+
+    maps = vfat_info.cluster_map_calls;
+    unmaps = vfat_info.cluster_unmap_calls;
+    bench_syscalls(&startReads, &writes);
+    start = bench_now();
+    long s, seen = 0;
+    for (s = 0; s < config->scans; s++)
+    {
+        seen = 0;
+        vfat_scan_dir(st.st_ino, Nothing, &seen);
+    }
+    elapsed = bench_now() - start;
+    bench_syscalls(&reads, &writes);
+    pthread_rwlock_unlock(&vfat_tree_lock);
+
+    // . and .. are part of the scan
+    if (seen != config->entries + 2)
+        errx(1, "scan of %s saw %ld entries", BENCH_DIR, seen);
+    printf("%-8s %-10s %8.1f %10.2f %10.2f %10.2f %10.1f\n", mode, "directory", mb,
+           (vfat_info.cluster_map_calls - maps) / mb, (vfat_info.cluster_unmap_calls - unmaps) / mb,
+           (reads - startReads) / mb, mb / elapsed);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: vfat_mapbench [-m file MiB] [-n directory entries] [-s directory scans]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_config config;
+    memset(&config, 0, sizeof(config));
+    config.mib = BENCH_DEFAULT_MIB;
+    config.entries = BENCH_DEFAULT_ENTRIES;
+    config.scans = BENCH_DEFAULT_SCANS;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:n:s:")) != -1)
+    {
+        if (opt == 'm' && (config.mib = atol(optarg)) > 0)
+            continue;
+        if (opt == 'n' && (config.entries = atol(optarg)) > 0 && config.entries < 65536 / 6)
+            continue;
+        if (opt == 's' && (config.scans = atol(optarg)) > 0)
+            continue;
+        usage();
+    }
+    bench_defaults();
+
+    // Smallest FAT32 volume of 4 KiB clusters is about 260 MiB
+    off_t imageSize = ((off_t)config.mib + 64) << 20;
+    if (imageSize < (off_t)320 << 20)
+        imageSize = (off_t)320 << 20;
+    config.image = bench_image("mapbench", imageSize, BENCH_CLUSTER_SECTORS);
+    bench_run(Populate, &config);
+
+    // Mapping one cluster at a time took a map and an unmap call per cluster
+    printf("hot page cache, per cluster mapping would take %.0f map and unmap calls per MB\n",
+           1e6 / (BENCH_CLUSTER_SECTORS * 512));
+    printf("%-8s %-10s %8s %10s %10s %10s %10s\n", "data", "read", "MB", "maps/MB", "unmaps/MB", "reads/MB", "MB/s");
+    for (config.windows = 0; config.windows <= 1; config.windows++)
+    {
+        bench_run(Measure, &config);
+    }
+    unlink(config.image);
+    return 0;
+}
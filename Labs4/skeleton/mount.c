@@ -0,0 +1,217 @@
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vfat.h"
+#include "util.h"
+#include "dcache.h"
+#include "fatstats.h"
+#include "crawl.h"
+#include "mount.h"
+
+// Chunk of each FAT copy compared at once
+#define MOUNT_MIRROR_CHUNK (64 * 1024)
+
+#define MOUNT_PENDING 0
+#define MOUNT_RUNNING 1
+#define MOUNT_DONE    2
+
+struct mount_task {
+    const char* name;
+    void        (*run)(void);
+    int         state;
+    double      millis; // time the task took, exported via .debug
+};
+
+unsigned long mount_fat_mismatches = 0;
+
+static void ScanFree(void);
+static void CompareMirrors(void);
+static void IndexRoot(void);
+
+struct mount_task mount_tasks[MOUNT_TASKS] = {
+    { "fat", vfat_load_fat, MOUNT_PENDING, 0 },
+    { "free", ScanFree, MOUNT_PENDING, 0 },
+    { "mirror", CompareMirrors, MOUNT_PENDING, 0 },
+    { "root", IndexRoot, MOUNT_PENDING, 0 },
+    { "tree", crawl_tree, MOUNT_PENDING, 0 },
+};
+pthread_mutex_t mount_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  mount_cond = PTHREAD_COND_INITIALIZER;
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Runs the task if nobody did yet, otherwise waits until it is done
+void mount_wait(int task)
+{
+    struct mount_task* t = &mount_tasks[task];
+
+    pthread_mutex_lock(&mount_lock);
+    if (t->state == MOUNT_PENDING)
+    {
+        t->state = MOUNT_RUNNING;
+        pthread_mutex_unlock(&mount_lock);
+
+        double start = Now();
+        t->run();
+
+        pthread_mutex_lock(&mount_lock);
+        t->millis = Now() - start;
+        t->state = MOUNT_DONE;
+        pthread_cond_broadcast(&mount_cond);
+    }
+    while (t->state != MOUNT_DONE)
+    {
+        pthread_cond_wait(&mount_cond, &mount_lock);
+    }
+    pthread_mutex_unlock(&mount_lock);
+}
+
+// Counted once the FAT is in its final form, so a compact FAT is scanned
+// from its runs. Writers keep the count up to date from there on
+static void ScanFree(void)
+{
+    struct fat_stats stats;
+
+    mount_wait(MOUNT_FAT);
+    pthread_rwlock_rdlock(&vfat_tree_lock);
+    fat_stats_scan(&stats);
+    __atomic_store_n(&vfat_info.free_clusters, (long)stats.free, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&vfat_tree_lock);
+}
+
+// Counts the sectors where a mirror disagrees with the first FAT on disk
+// Writers update every copy under the tree lock, which is held per chunk
+static void CompareMirrors(void)
+{
+    uint8_t* first = malloc(MOUNT_MIRROR_CHUNK);
+    uint8_t* mirror = malloc(MOUNT_MIRROR_CHUNK);
+    unsigned long mismatches = 0;
+    unsigned int copy;
+    size_t done;
+
+    if (first == NULL || mirror == NULL)
+        err(1, "CompareMirrors");
+
+    for (copy = 1; copy < vfat_info.fat_count; copy++)
+    {
+        for (done = 0; done < vfat_info.fat_size; done += MOUNT_MIRROR_CHUNK)
+        {
+            size_t len = vfat_info.fat_size - done;
+            if (len > MOUNT_MIRROR_CHUNK)
+            {
+                len = MOUNT_MIRROR_CHUNK;
+            }
+            off_t offset = vfat_info.fat_begin_offset + done;
+
+            pthread_rwlock_rdlock(&vfat_tree_lock);
+            int ret = pread_full(vfat_info.fd, first, len, offset);
+            if (ret == 0)
+            {
+                ret = pread_full(vfat_info.fd, mirror, len, offset + (off_t)copy * vfat_info.fat_size);
+            }
+            pthread_rwlock_unlock(&vfat_tree_lock);
+            if (ret != 0)
+            {
+                warn("reading FAT copy %u", copy);
+                break;
+            }
+
+            size_t s;
+            for (s = 0; s < len; s += vfat_info.bytes_per_sector)
+            {
+                if (memcmp(first + s, mirror + s, vfat_info.bytes_per_sector) != 0)
+                {
+                    mismatches++;
+                }
+            }
+        }
+    }
+    free(first);
+    free(mirror);
+
+    mount_fat_mismatches = mismatches;
+    if (mismatches != 0)
+    {
+        warnx("FAT mirrors differ from the first FAT in %lu sectors", mismatches);
+    }
+}
+
+static int IndexEntry(void* data, const struct vfat_dirent* de)
+{
+    dirindex_add(data, de);
+    return 0;
+}
+
+// Same index vfat_readdir() builds, so the first lookups under / skip the scan
+static void IndexRoot(void)
+{
+    uint32_t root = vfat_info.root_inode.st_ino;
+
+    pthread_rwlock_rdlock(&vfat_tree_lock);
+    if (!dirindex_contains(root))
+    {
+        struct dirindex* index = dirindex_begin(root);
+        vfat_scan_dir(root, IndexEntry, index);
+        dirindex_commit(index);
+    }
+    pthread_rwlock_unlock(&vfat_tree_lock);
+}
+
+static void* TaskThread(void* task)
+{
+    mount_wait((int)(intptr_t)task);
+    return NULL;
+}
+
+// Starts one thread per task, called once fuse runs since threads do not
+// survive its daemonization
+void mount_start(void)
+{
+    int task;
+    for (task = 0; task < MOUNT_TASKS; task++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, TaskThread, (void*)(intptr_t)task) == 0)
+        {
+            pthread_detach(thread);
+        }
+    }
+}
+
+// One line per task: name, state and how long it took
+int mount_format(char* buf, size_t size)
+{
+    static const char* states[] = { "pending", "running", "done" };
+    int len = 0, task;
+
+    pthread_mutex_lock(&mount_lock);
+    for (task = 0; task < MOUNT_TASKS && (size_t)len < size; task++)
+    {
+        struct mount_task* t = &mount_tasks[task];
+        len += snprintf(buf + len, size - len, "%s %s %.1f ms\n", t->name, states[t->state], t->millis);
+    }
+    pthread_mutex_unlock(&mount_lock);
+    return ((size_t)len < size) ? len : (int)size - 1;
+}
+
+// Name of a task and how long it took, 0 until it is done
+const char* mount_timing(int task, double* millis)
+{
+    pthread_mutex_lock(&mount_lock);
+    *millis = mount_tasks[task].millis;
+    pthread_mutex_unlock(&mount_lock);
+    return mount_tasks[task].name;
+}
@@ -0,0 +1,25 @@
+#ifndef H_MOUNT
+#define H_MOUNT
+
+#include <stddef.h>
+
+// Expensive mount work, run on background threads once fuse is up. Whoever
+// needs a result first, a background thread or a request, runs the task and
+// the others wait for it to finish.
+
+#define MOUNT_FAT     0 // huge page copy or compact runs of the FAT, see vfat_load_fat()
+#define MOUNT_FREE    1 // free cluster count behind statfs, see vfat_fuse_statfs()
+#define MOUNT_MIRROR  2 // comparison of the FAT with its mirrors
+#define MOUNT_ROOT    3 // name index of the root directory
+#define MOUNT_TREE    4 // name indexes of the whole tree with -o crawl=N, see crawl_tree()
+#define MOUNT_TASKS   5
+
+void mount_start(void);
+void mount_wait(int task);
+int mount_format(char* buf, size_t size);
+const char* mount_timing(int task, double* millis);
+
+// Statistics, exported via .debug
+extern unsigned long mount_fat_mismatches;
+
+#endif
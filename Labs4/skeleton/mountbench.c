@@ -0,0 +1,100 @@
+// vim: noet:ts=4:sts=4:sw=4:et
+// vfat_mountbench: vfat_init() and each mount task on empty sparse images of
+// growing size, for every way the FAT can be held
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "mount.h"
+#include "bench.h"
+
+#define BENCH_CLUSTER_SECTORS 8 // 4 KiB clusters
+#define BENCH_MAX_SIZES       16
+
+// Parameters shared with the children
+struct bench_config {
+    const char* image;
+    int         mode;
+};
+
+static const char* modes[] = { "mmap", "hugefat", "compactfat" };
+
+// Mounts as main() would, then runs the tasks the fuse init op hands to
+// background threads one after the other, each timed by mount_wait()
+static void Measure(void* arg)
+{
+    struct bench_config* config = arg;
+    vfat_info.hugefat = (config->mode == 1);
+    vfat_info.compactfat = (config->mode == 2);
+
+    double start = bench_now();
+    vfat_info.dev = config->image;
+    vfat_init(config->image);
+    double init = (bench_now() - start) * 1000;
+
+    double total = 0, millis;
+    int task;
+    printf("%9uk %-10s %8.2f", vfat_info.spec_CountofClusters >> 10, modes[config->mode], init);
+    for (task = 0; task < MOUNT_TASKS; task++)
+    {
+        mount_wait(task);
+        mount_timing(task, &millis);
+        total += millis;
+        printf(" %8.1f", millis);
+    }
+    printf(" %8.1f\n", total);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: vfat_mountbench [M clusters ...]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_config config;
+    memset(&config, 0, sizeof(config));
+    if (getopt(argc, argv, "") != -1)
+        usage();
+
+    long sizes[BENCH_MAX_SIZES] = { 1, 4, 16, 64 };
+    int count = 4, i;
+    if (optind < argc)
+    {
+        for (count = 0; optind < argc && count < BENCH_MAX_SIZES; count++)
+        {
+            if ((sizes[count] = atol(argv[optind++])) <= 0 || sizes[count] > 256)
+                usage();
+        }
+    }
+    bench_defaults();
+
+    double millis;
+    printf("empty sparse images of 4 KiB clusters, ms\n");
+    printf("%10s %-10s %8s", "clusters", "", "init");
+    for (i = 0; i < MOUNT_TASKS; i++)
+    {
+        printf(" %8s", mount_timing(i, &millis));
+    }
+    printf(" %8s\n", "tasks");
+
+    for (i = 0; i < count; i++)
+    {
+        // Data region plus both FATs, four bytes per cluster each
+        off_t clusters = (off_t)sizes[i] << 20;
+        config.image = bench_image("mountbench", clusters * (BENCH_CLUSTER_SECTORS * 512 + 8) + (1 << 20), BENCH_CLUSTER_SECTORS);
+        for (config.mode = 0; config.mode < 3; config.mode++)
+        {
+            bench_run(Measure, &config);
+        }
+        unlink(config.image);
+        free((char*)config.image);
+    }
+    return 0;
+}
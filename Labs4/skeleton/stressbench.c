@@ -0,0 +1,231 @@
+// vim: noet:ts=4:sts=4:sw=4:et
+// vfat_stressbench: reader threads sharing one mount, path lookups through
+// vfat_resolve() and file reads through vfat_read_file(), per thread count
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "bench.h"
+
+#define BENCH_DEFAULT_THREADS  8
+#define BENCH_DEFAULT_RESOLVES 200000 // per thread
+#define BENCH_DEFAULT_READS    4000   // per thread
+#define BENCH_READ_SIZE        65536
+#define BENCH_DIRS             4
+#define BENCH_FILES            8      // per directory
+#define BENCH_FILE_SIZE        ((off_t)4 << 20)
+#define BENCH_IMAGE_MIB        320    // smallest FAT32 volume of 4 KiB clusters, plus room
+#define BENCH_CLUSTER_SECTORS  8
+
+// Parameters shared with the children and the threads
+struct bench_config {
+    const char* image;
+    long        resolves;
+    long        reads;
+    int         threads;
+};
+
+struct bench_thread {
+    const struct bench_config* config;
+    pthread_t                  thread;
+    int                        id;
+    int                        reading; // reads rather than lookups
+    long                       failures;
+};
+
+// xorshift64*, plenty for picking files and offsets
+static uint64_t Random(uint64_t* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ull;
+}
+
+static void FilePath(char* path, size_t size, int n)
+{
+    snprintf(path, size, "/shared directory %d/stress file %02d.bin", n / BENCH_FILES, n % BENCH_FILES);
+}
+
+static void Populate(void* arg)
+{
+    struct bench_config* config = arg;
+    vfat_info.writable = 1;
+    bench_mount(config->image);
+
+    char path[PATH_MAX];
+    int n;
+    for (n = 0; n < BENCH_DIRS * BENCH_FILES; n++)
+    {
+        if (n % BENCH_FILES == 0)
+        {
+            snprintf(path, sizeof(path), "/shared directory %d", n / BENCH_FILES);
+            if (bench_mkdir(path) != 0)
+                errx(1, "mkdir %s", path);
+        }
+        FilePath(path, sizeof(path), n);
+        int ret = bench_put(path, BENCH_FILE_SIZE, (size_t)1 << 20);
+        if (ret != 0)
+            errx(1, "writing %s: %s", path, strerror(-ret));
+    }
+    bench_unmount();
+}
+
+// Looks paths up like every request does, under the tree read lock
+static void Resolve(struct bench_thread* t, uint64_t* state)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    long i;
+    for (i = 0; i < t->config->resolves; i++)
+    {
+        FilePath(path, sizeof(path), Random(state) % (BENCH_DIRS * BENCH_FILES));
+        pthread_rwlock_rdlock(&vfat_tree_lock);
+        if (vfat_resolve(path, &st) != 0 || st.st_size != BENCH_FILE_SIZE)
+            t->failures++;
+        pthread_rwlock_unlock(&vfat_tree_lock);
+    }
+}
+
+// Random reads through handles of its own on every file, the read op ends
+// in vfat_read_file()
+static void Read(struct bench_thread* t, uint64_t* state)
+{
+    struct fuse_file_info fi[BENCH_DIRS * BENCH_FILES];
+    char path[PATH_MAX];
+    char* buf = malloc(BENCH_READ_SIZE);
+    if (buf == NULL)
+        err(1, "malloc");
+    int n;
+    for (n = 0; n < BENCH_DIRS * BENCH_FILES; n++)
+    {
+        memset(&fi[n], 0, sizeof(fi[n]));
+        fi[n].flags = O_RDONLY;
+        FilePath(path, sizeof(path), n);
+        if (vfat_available_ops.open(path, &fi[n]) != 0)
+            errx(1, "open %s", path);
+    }
+
+    long i;
+    for (i = 0; i < t->config->reads; i++)
+    {
+        n = Random(state) % (BENCH_DIRS * BENCH_FILES);
+        off_t offs = Random(state) % (BENCH_FILE_SIZE / BENCH_READ_SIZE) * BENCH_READ_SIZE;
+        FilePath(path, sizeof(path), n);
+        int ret = vfat_available_ops.read(path, buf, BENCH_READ_SIZE, offs, &fi[n]);
+        if (ret != BENCH_READ_SIZE || buf[0] != 'a' + offs / ((off_t)1 << 20) % 26)
+            t->failures++;
+    }
+
+    for (n = 0; n < BENCH_DIRS * BENCH_FILES; n++)
+    {
+        FilePath(path, sizeof(path), n);
+        vfat_available_ops.release(path, &fi[n]);
+    }
+    free(buf);
+}
+
+static void* Worker(void* arg)
+{
+    struct bench_thread* t = arg;
+    uint64_t state = 88172645463325252ull + t->id;
+    if (t->reading)
+        Read(t, &state);
+    else
+        Resolve(t, &state);
+    return NULL;
+}
+
+// Runs threads workers at once, returns the seconds until all are done
+static double Run(const struct bench_config* config, int threads, int reading)
+{
+    struct bench_thread* workers = calloc(threads, sizeof(struct bench_thread));
+    if (workers == NULL)
+        err(1, "calloc");
+
+    double start = bench_now();
+    int i;
+    for (i = 0; i < threads; i++)
+    {
+        workers[i].config = config;
+        workers[i].id = i;
+        workers[i].reading = reading;
+        if (pthread_create(&workers[i].thread, NULL, Worker, &workers[i]) != 0)
+            errx(1, "pthread_create");
+    }
+    long failures = 0;
+    for (i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        failures += workers[i].failures;
+    }
+    double elapsed = bench_now() - start;
+    free(workers);
+
+    if (failures != 0)
+        errx(1, "%ld %s returned wrong results", failures, reading ? "reads" : "lookups");
+    return elapsed;
+}
+
+static void Measure(void* arg)
+{
+    struct bench_config* config = arg;
+    bench_mount(config->image);
+
+    int threads;
+    for (threads = 1; threads <= config->threads; threads *= 2)
+    {
+        double resolve = Run(config, threads, 0);
+        double read = Run(config, threads, 1);
+        double lookups = threads * config->resolves / resolve;
+        double mbs = threads * config->reads * (double)BENCH_READ_SIZE / 1e6 / read;
+        printf("%7d %12.0f %12.0f %10.1f %10.1f\n", threads, lookups, lookups / threads, mbs, mbs / threads);
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: vfat_stressbench [-t max threads] [-r lookups per thread] [-n reads per thread]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_config config;
+    memset(&config, 0, sizeof(config));
+    config.threads = BENCH_DEFAULT_THREADS;
+    config.resolves = BENCH_DEFAULT_RESOLVES;
+    config.reads = BENCH_DEFAULT_READS;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:r:n:")) != -1)
+    {
+        if (opt == 't' && (config.threads = atoi(optarg)) > 0)
+            continue;
+        if (opt == 'r' && (config.resolves = atol(optarg)) > 0)
+            continue;
+        if (opt == 'n' && (config.reads = atol(optarg)) > 0)
+            continue;
+        usage();
+    }
+    bench_defaults();
+    config.image = bench_image("stressbench", (off_t)BENCH_IMAGE_MIB << 20, BENCH_CLUSTER_SECTORS);
+    bench_run(Populate, &config);
+
+    printf("%d files of %lld MiB in %d directories, %ld CPUs online, %d KiB reads\n",
+           BENCH_DIRS * BENCH_FILES, (long long)(BENCH_FILE_SIZE >> 20), BENCH_DIRS,
+           sysconf(_SC_NPROCESSORS_ONLN), BENCH_READ_SIZE >> 10);
+    printf("%7s %12s %12s %10s %10s\n", "threads", "lookups/s", "per thread", "read MB/s", "per thread");
+    bench_run(Measure, &config);
+    unlink(config.image);
+    return 0;
+}
@@ -0,0 +1,155 @@
+// vim: noet:ts=4:sts=4:sw=4:et
+// vfat_timebench: BuildTime() against the mktime() conversion it replaced
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vfat.h"
+
+#define BENCH_DEFAULT_COUNT 10000000
+#define BENCH_TABLE_SIZE    4096 // timestamps cycled through by one run
+
+// FAT timestamps converted by one run
+struct bench_stamp {
+    uint16_t date;
+    uint16_t time;
+    uint8_t  tenth;
+};
+
+// Keeps the compiler from dropping the conversions
+volatile time_t bench_sink;
+
+// The conversion BuildTime() used before, through the time zone database
+static time_t MktimeTime(uint16_t inputDate, uint16_t inputTime, uint8_t inputTenth)
+{
+    struct tm preciseTime;
+    memset(&preciseTime, 0, sizeof(preciseTime));
+    preciseTime.tm_year = (inputDate >> 9) + 80;
+    preciseTime.tm_mon = ((inputDate >> 5) & 0x000F) - 1;
+    preciseTime.tm_mday = inputDate & 0x001F;
+    preciseTime.tm_hour = inputTime >> 11;
+    preciseTime.tm_min = (inputTime >> 5) & 0x003F;
+    preciseTime.tm_sec = (inputTime & 0x001F) * 2 + (inputTenth / 10);
+    preciseTime.tm_isdst = -1;
+    return mktime(&preciseTime);
+}
+
+static double Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint16_t FatDate(int year, int month, int day)
+{
+    return ((year - 1980) << 9) | (month << 5) | day;
+}
+
+// Nanoseconds per conversion of count timestamps cycled from stamps
+static double Run(time_t (*convert)(uint16_t, uint16_t, uint8_t), const struct bench_stamp* stamps, long count)
+{
+    time_t sum = 0;
+    long i;
+    double start = Now();
+    for (i = 0; i < count; i++)
+    {
+        const struct bench_stamp* s = &stamps[i % BENCH_TABLE_SIZE];
+        sum += convert(s->date, s->time, s->tenth);
+    }
+    double elapsed = Now() - start;
+    bench_sink = sum;
+    return elapsed * 1e9 / count;
+}
+
+// Every valid day from 1980 to 2107 at a few times of day, mktime() results
+// differ where the local offset is not the one in effect at mount (DST)
+static void Compare(void)
+{
+    long checked = 0, mismatches = 0;
+    int year, month, day, hour;
+    for (year = 1980; year <= 2107; year++)
+    {
+        for (month = 1; month <= 12; month++)
+        {
+            for (day = 1; day <= 31; day++)
+            {
+                for (hour = 0; hour < 24; hour += 5)
+                {
+                    uint16_t date = FatDate(year, month, day);
+                    uint16_t time = (hour << 11) | (17 << 5) | 9;
+                    checked++;
+                    if (BuildTime(date, time, 0) != MktimeTime(date, time, 0))
+                    {
+                        mismatches++;
+                    }
+                }
+            }
+        }
+    }
+    printf("compared %ld timestamps, %ld differ from mktime()\n", checked, mismatches);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: vfat_timebench [-n conversions] [-o time_offset]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    long count = BENCH_DEFAULT_COUNT;
+    int offsetSet = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:o:")) != -1)
+    {
+        if (opt == 'n' && (count = atol(optarg)) > 0)
+            continue;
+        if (opt == 'o')
+        {
+            vfat_info.time_offset = atoi(optarg);
+            offsetSet = 1;
+            continue;
+        }
+        usage();
+    }
+
+    // Same default as a mount
+    if (!offsetSet)
+    {
+        struct tm local;
+        time_t now = time(NULL);
+        localtime_r(&now, &local);
+        vfat_info.time_offset = local.tm_gmtoff / 60;
+    }
+    printf("time_offset %d minutes\n", vfat_info.time_offset);
+    Compare();
+
+    // A directory: a handful of dates, as entries are written in batches
+    static struct bench_stamp directory[BENCH_TABLE_SIZE], scattered[BENCH_TABLE_SIZE];
+    int i;
+    srand(1);
+    for (i = 0; i < BENCH_TABLE_SIZE; i++)
+    {
+        directory[i].date = FatDate(2015 + i % 4, 3 + i % 2, 10 + i % 3);
+        directory[i].time = rand() & 0xBF7F; // hours below 24, minutes below 60
+        directory[i].tenth = rand() % 200;
+    }
+
+    // Dates all over the range
+    for (i = 0; i < BENCH_TABLE_SIZE; i++)
+    {
+        scattered[i].date = FatDate(1980 + rand() % 128, 1 + rand() % 12, 1 + rand() % 28);
+        scattered[i].time = rand() & 0xBF7F;
+        scattered[i].tenth = rand() % 200;
+    }
+
+    printf("%-18s %12s %12s\n", "", "mktime", "BuildTime");
+    printf("%-18s %9.1f ns %9.1f ns\n", "directory dates", Run(MktimeTime, directory, count), Run(BuildTime, directory, count));
+    printf("%-18s %9.1f ns %9.1f ns\n", "random dates", Run(MktimeTime, scattered, count), Run(BuildTime, scattered, count));
+    return 0;
+}
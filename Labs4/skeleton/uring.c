@@ -0,0 +1,455 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "util.h"
+#include "uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define VFAT_HAVE_URING 1
+#endif
+#endif
+
+unsigned long uring_batches = 0;
+unsigned long uring_reads = 0;
+unsigned long uring_prefetches = 0;
+
+// Reads every range with plain preads
+static int ReadSync(const struct uring_read* reads, size_t count)
+{
+    size_t k;
+    for (k = 0; k < count; k++)
+    {
+        if (pread_full(vfat_info.fd, reads[k].buf, reads[k].len, reads[k].offset) != 0)
+        {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+#ifdef VFAT_HAVE_URING
+
+// Rings are talked to through raw system calls, liburing is not required
+struct vfat_ring {
+    int                  fd;
+    unsigned*            sq_head;
+    unsigned*            sq_tail;
+    unsigned*            sq_mask;
+    unsigned*            sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned*            cq_head;
+    unsigned*            cq_tail;
+    unsigned*            cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned             queued;   // sqes filled in but not submitted yet
+    unsigned             inflight; // submitted, completion not reaped yet
+    int                  fixed_file;
+    int                  fixed_buffer;
+    uint8_t*             scratch;
+
+    void*                sq_ring;
+    size_t               sq_ring_size;
+    void*                cq_ring;
+    size_t               cq_ring_size;
+    size_t               sqes_size;
+};
+
+pthread_key_t uring_key;
+pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+
+static void RingDestroy(void* data)
+{
+    struct vfat_ring* ring = data;
+    if (ring == NULL)
+    {
+        return;
+    }
+    if (ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+    free(ring->scratch);
+    free(ring);
+}
+
+static struct vfat_ring* RingSetup(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    struct vfat_ring* ring = calloc(1, sizeof(struct vfat_ring));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+    ring->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+    if (ring->fd < 0)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        ring->sq_ring = NULL;
+        RingDestroy(ring);
+        return NULL;
+    }
+    ring->cq_ring = ring->sq_ring;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            ring->cq_ring = NULL;
+            RingDestroy(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        RingDestroy(ring);
+        return NULL;
+    }
+
+    uint8_t* sq = ring->sq_ring;
+    uint8_t* cq = ring->cq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // Both registrations are optimizations, plain reads work without them
+    ring->fixed_file = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, &vfat_info.fd, 1) == 0;
+    ring->scratch = malloc(URING_SCRATCH);
+    if (ring->scratch != NULL)
+    {
+        struct iovec iov = { ring->scratch, URING_SCRATCH };
+        ring->fixed_buffer = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    }
+    return ring;
+}
+
+static void MakeKey(void)
+{
+    pthread_key_create(&uring_key, RingDestroy);
+}
+
+// Ring of the calling thread, created on first use
+static struct vfat_ring* ThreadRing(void)
+{
+    pthread_once(&uring_key_once, MakeKey);
+    struct vfat_ring* ring = pthread_getspecific(uring_key);
+    if (ring == NULL && (ring = RingSetup()) != NULL)
+    {
+        pthread_setspecific(uring_key, ring);
+    }
+    return ring;
+}
+
+// Queues a read of len bytes at offset into buf, NULL reads into the scratch buffer
+static void QueueRead(struct vfat_ring* ring, void* buf, size_t len, off_t offset, uint64_t tag)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = vfat_info.fd;
+    if (ring->fixed_file)
+    {
+        sqe->fd = 0;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    if (buf == NULL)
+    {
+        buf = ring->scratch;
+        if (ring->fixed_buffer)
+        {
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->buf_index = 0;
+        }
+    }
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = tag;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    ring->inflight++;
+}
+
+// Submits what is queued and waits for at least wait completions
+static int Enter(struct vfat_ring* ring, unsigned wait)
+{
+    for (;;)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0)
+        {
+            ring->queued -= ret;
+            return 0;
+        }
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+}
+
+// Takes back the entries the kernel did not consume after a failed submission
+// Returns how many of them belong to a batch, prefetches carry tag 0
+static size_t Unqueue(struct vfat_ring* ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    size_t tagged = 0;
+    while (tail != head)
+    {
+        tail--;
+        if (ring->sqes[ring->sq_array[tail & *ring->sq_mask]].user_data != 0)
+        {
+            tagged++;
+        }
+        ring->inflight--;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    ring->queued = 0;
+    return tagged;
+}
+
+// Pops one completion, returns 0 if there is none
+static int Reap(struct vfat_ring* ring, uint64_t* tag, int* res)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+    struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+    *tag = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    ring->inflight--;
+    return 1;
+}
+
+// Waits for the pending submitted reads of a batch, whose buffers belong to
+// the caller. Completions are posted even when entering the ring keeps
+// failing, the kernel runs its pending work on the way back from any syscall
+static void Drain(struct vfat_ring* ring, size_t pending)
+{
+    uint64_t tag;
+    int res;
+    while (pending > 0)
+    {
+        while (Reap(ring, &tag, &res))
+        {
+            if (tag != 0)
+            {
+                pending--;
+            }
+        }
+        if (pending > 0 && Enter(ring, 1) != 0)
+        {
+            sched_yield();
+        }
+    }
+}
+
+// Reads every range in as few submissions as the ring allows, completions
+// of earlier prefetches are reaped on the way. Prefetches carry tag 0
+int uring_read_batch(const struct uring_read* reads, size_t count)
+{
+    struct vfat_ring* ring = vfat_info.uring ? ThreadRing() : NULL;
+    size_t next = 0, pending = 0;
+    int ret = 0;
+
+    if (ring == NULL)
+    {
+        return ReadSync(reads, count);
+    }
+
+    __atomic_fetch_add(&uring_batches, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&uring_reads, count, __ATOMIC_RELAXED);
+    while (next < count || pending > 0)
+    {
+        while (next < count && ring->inflight < URING_DEPTH)
+        {
+            QueueRead(ring, reads[next].buf, reads[next].len, reads[next].offset, next + 1);
+            next++;
+            pending++;
+        }
+
+        // Nothing of the batch may be left in the ring once we return, a
+        // later submission would read into buffers reused by then
+        if (Enter(ring, 1) != 0)
+        {
+            pending -= Unqueue(ring);
+            Drain(ring, pending);
+            return ReadSync(reads, count);
+        }
+
+        uint64_t tag;
+        int res;
+        while (Reap(ring, &tag, &res))
+        {
+            if (tag == 0)
+            {
+                continue;
+            }
+            pending--;
+
+            // Short or failed reads are finished synchronously
+            const struct uring_read* r = &reads[tag - 1];
+            size_t done = (res > 0) ? (size_t)res : 0;
+            if (done < r->len && pread_full(vfat_info.fd, (uint8_t*)r->buf + done, r->len - done, r->offset + done) != 0)
+            {
+                ret = -EIO;
+            }
+        }
+    }
+    return ret;
+}
+
+// Starts reading the ranges into the page cache without waiting for them
+void uring_prefetch(const struct uring_read* ranges, size_t count)
+{
+    struct vfat_ring* ring = vfat_info.uring ? ThreadRing() : NULL;
+    uint64_t tag;
+    int res;
+    size_t k;
+
+    if (ring == NULL || ring->scratch == NULL)
+    {
+        for (k = 0; k < count; k++)
+        {
+            posix_fadvise(vfat_info.fd, ranges[k].offset, ranges[k].len, POSIX_FADV_WILLNEED);
+        }
+        return;
+    }
+
+    while (Reap(ring, &tag, &res))
+    {
+    }
+    for (k = 0; k < count; k++)
+    {
+        off_t offset = ranges[k].offset;
+        size_t left = ranges[k].len;
+        while (left > 0)
+        {
+            size_t chunk = (left < URING_SCRATCH) ? left : URING_SCRATCH;
+            if (ring->inflight >= URING_DEPTH)
+            {
+                if (Enter(ring, 1) != 0)
+                {
+                    Unqueue(ring);
+                    return;
+                }
+                while (Reap(ring, &tag, &res))
+                {
+                }
+            }
+            QueueRead(ring, NULL, chunk, offset, 0);
+            __atomic_fetch_add(&uring_prefetches, 1, __ATOMIC_RELAXED);
+            offset += chunk;
+            left -= chunk;
+        }
+    }
+    if (Enter(ring, 0) != 0)
+    {
+        Unqueue(ring);
+    }
+}
+
+// Turns the backend off when the kernel has no io_uring
+void uring_init(void)
+{
+    if (!vfat_info.uring)
+    {
+        return;
+    }
+    struct vfat_ring* ring = RingSetup();
+    if (ring == NULL)
+    {
+        warn("io_uring unavailable, reading through mmap");
+        vfat_info.uring = 0;
+        return;
+    }
+    RingDestroy(ring);
+}
+
+#else
+
+void uring_init(void)
+{
+    if (vfat_info.uring)
+    {
+        warnx("built without io_uring, reading through mmap");
+        vfat_info.uring = 0;
+    }
+}
+
+int uring_read_batch(const struct uring_read* reads, size_t count)
+{
+    return ReadSync(reads, count);
+}
+
+void uring_prefetch(const struct uring_read* ranges, size_t count)
+{
+    size_t k;
+    for (k = 0; k < count; k++)
+    {
+        posix_fadvise(vfat_info.fd, ranges[k].offset, ranges[k].len, POSIX_FADV_WILLNEED);
+    }
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef H_URING
+#define H_URING
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Optional io_uring backend for reads of the image, enabled by -o uring.
+// Every fuse thread gets its own ring with the image registered as a fixed
+// file and a registered scratch buffer prefetches read into.
+//
+// It does not beat the mmap path on a hot page cache, see vfat_uringbench:
+// about 3.6 against 5 GB/s for 128 KiB reads and 2.5 against 1.6 us per
+// random 4 KiB read. From a cold cache sequential reads come out even and
+// random ones take about half as long, so mmap stays the default.
+
+#define URING_DEPTH     64                 // submission queue entries per ring
+#define URING_SCRATCH   ((size_t)256 << 10) // prefetch buffer per ring
+#define URING_BATCH     32                 // reads gathered by a single request
+
+// len bytes at offset of the image, copied to buf
+struct uring_read {
+    void*  buf;
+    size_t len;
+    off_t  offset;
+};
+
+void uring_init(void);
+int uring_read_batch(const struct uring_read* reads, size_t count);
+void uring_prefetch(const struct uring_read* ranges, size_t count);
+
+// Statistics, exported via .debug
+extern unsigned long uring_batches;
+extern unsigned long uring_reads;
+extern unsigned long uring_prefetches;
+
+#endif
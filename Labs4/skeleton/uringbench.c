@@ -0,0 +1,174 @@
+// vim: noet:ts=4:sts=4:sw=4:et
+// vfat_uringbench: file reads through the mmap of the data region against
+// -o uring, sequential requests and random 4 KiB ones
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "uring.h"
+#include "bench.h"
+
+#define BENCH_DEFAULT_MIB      256
+#define BENCH_DEFAULT_REQUEST  128  // KiB, the largest read fuse sends
+#define BENCH_DEFAULT_RANDOM   20000
+#define BENCH_RANDOM_SIZE      4096
+#define BENCH_CLUSTER_SECTORS  8    // 4 KiB clusters
+#define BENCH_FILE             "/data.bin"
+
+// Parameters shared with the children
+struct bench_config {
+    const char* image;
+    size_t      mib;
+    size_t      request;
+    long        random;
+    int         cold;
+    int         uring;
+    int         random_pass; // measure the random reads rather than the sequential ones
+};
+
+// Keeps the compiler from dropping the reads
+volatile char bench_sink;
+
+// xorshift64*, plenty for picking offsets
+static uint64_t Random(uint64_t* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ull;
+}
+
+static void Populate(void* arg)
+{
+    struct bench_config* config = arg;
+    vfat_info.writable = 1;
+    bench_mount(config->image);
+    int ret = bench_put(BENCH_FILE, (off_t)config->mib << 20, (size_t)1 << 20);
+    if (ret != 0)
+        errx(1, "writing %s: %s", BENCH_FILE, strerror(-ret));
+    bench_unmount();
+}
+
+// Reads len bytes at offs through the read op, as fuse would
+static void Read(struct fuse_file_info* fi, char* buf, size_t len, off_t offs)
+{
+    int ret = vfat_available_ops.read(BENCH_FILE, buf, len, offs, fi);
+    if (ret != (int)len)
+        errx(1, "read of %zu bytes at %lld returned %d", len, (long long)offs, ret);
+    bench_sink = buf[len - 1];
+}
+
+static void Measure(void* arg)
+{
+    struct bench_config* config = arg;
+    vfat_info.uring = config->uring;
+    bench_mount(config->image);
+    if (config->uring && !vfat_info.uring)
+    {
+        printf(config->random_pass ? "\n" : "%-6s unavailable", "uring");
+        return;
+    }
+
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDONLY;
+    if (vfat_available_ops.open(BENCH_FILE, &fi) != 0)
+        errx(1, "open %s", BENCH_FILE);
+
+    off_t size = (off_t)config->mib << 20;
+    char* buf = malloc(config->request);
+    if (buf == NULL)
+        err(1, "malloc");
+
+    double start = bench_now();
+    if (!config->random_pass)
+    {
+        off_t offs;
+        for (offs = 0; offs < size; offs += config->request)
+        {
+            Read(&fi, buf, (size - offs < (off_t)config->request) ? size - offs : config->request, offs);
+        }
+        printf("%-6s %9.1f MB/s", config->uring ? "uring" : "mmap", config->mib * 1048576.0 / 1e6 / (bench_now() - start));
+    }
+    else
+    {
+        uint64_t state = 88172645463325252ull;
+        long i;
+        for (i = 0; i < config->random; i++)
+        {
+            Read(&fi, buf, BENCH_RANDOM_SIZE, Random(&state) % (size / BENCH_RANDOM_SIZE) * BENCH_RANDOM_SIZE);
+        }
+        printf(" %9.1f us/read\n", (bench_now() - start) * 1e6 / config->random);
+    }
+
+    vfat_available_ops.release(BENCH_FILE, &fi);
+    free(buf);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: vfat_uringbench [-s file MiB] [-b request KiB] [-r random reads] [-c]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_config config;
+    memset(&config, 0, sizeof(config));
+    config.mib = BENCH_DEFAULT_MIB;
+    config.request = BENCH_DEFAULT_REQUEST;
+    config.random = BENCH_DEFAULT_RANDOM;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:b:r:c")) != -1)
+    {
+        if (opt == 's' && (config.mib = atol(optarg)) > 0)
+            continue;
+        if (opt == 'b' && (config.request = atol(optarg)) > 0)
+            continue;
+        if (opt == 'r' && (config.random = atol(optarg)) > 0)
+            continue;
+        if (opt == 'c')
+        {
+            config.cold = 1;
+            continue;
+        }
+        usage();
+    }
+    config.request <<= 10;
+
+    // Room for the file and its directory, a FAT32 volume of 4 KiB clusters starts at 256 MiB
+    off_t size = ((off_t)config.mib + 64) << 20;
+    if (size < ((off_t)320 << 20))
+        size = (off_t)320 << 20;
+    bench_defaults();
+    config.image = bench_image("uringbench", size, BENCH_CLUSTER_SECTORS);
+    bench_run(Populate, &config);
+
+    printf("file %zu MiB, %zu KiB requests, %ld random reads of %d bytes, %s page cache\n",
+           config.mib, config.request >> 10, config.random, BENCH_RANDOM_SIZE, config.cold ? "cold" : "hot");
+    printf("%-6s %14s %17s\n", "", "sequential", "random");
+
+    // A fresh mount per pass, pages the previous one mapped are gone with it
+    for (config.uring = 0; config.uring <= 1; config.uring++)
+    {
+        for (config.random_pass = 0; config.random_pass <= 1; config.random_pass++)
+        {
+            if (config.cold)
+            {
+                bench_drop_cache(config.image);
+            }
+            bench_run(Measure, &config);
+        }
+    }
+    unlink(config.image);
+    return 0;
+}
@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <sys/mman.h>
 #include <err.h>
+#include <errno.h>
 
 #include "util.h"
 
@@ -21,8 +22,8 @@ uintptr_t page_ceil(uintptr_t offset) {
 }
 
 // mmap file content at given offset
-// use unmap to release the mapping
-void* mmap_file(int fd, off_t offset, size_t size)
+// returns NULL if the mapping could not be established
+void* try_mmap_file(int fd, off_t offset, size_t size)
 {
     off_t offset_end = offset + size;
     assert(offset >= 0);
@@ -34,12 +35,44 @@ void* mmap_file(int fd, off_t offset, size_t size)
     uintptr_t len = end - start;
     void* buf = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, start);
     
+    if (buf == MAP_FAILED)
+        return NULL;
+
+    return ((void *)((uintptr_t)buf + (offset - start)));
+}
+
+// mmap file content at given offset as a private, writable copy
+// changes are never written back to the file
+void* mmap_file_private(int fd, off_t offset, size_t size)
+{
+    off_t offset_end = offset + size;
+    assert(offset >= 0);
+    assert(offset_end >= offset); // No overflow
+
+    uintptr_t end = page_ceil(offset_end);
+    uintptr_t start = page_floor(offset);
+
+    uintptr_t len = end - start;
+    void* buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, start);
+
     if (buf == MAP_FAILED)
         err(1, "mmap failed");
 
     return ((void *)((uintptr_t)buf + (offset - start)));
 }
 
+// mmap file content at given offset
+// use unmap to release the mapping
+void* mmap_file(int fd, off_t offset, size_t size)
+{
+    void* buf = try_mmap_file(fd, offset, size);
+
+    if (buf == NULL)
+        err(1, "mmap failed");
+
+    return buf;
+}
+
 // buf: buffer returned by mmap_file()
 // size: same size as supplied to the mmap_file()
 void unmap(void* buf, size_t size)
@@ -53,3 +86,77 @@ void unmap(void* buf, size_t size)
       err(1, "munmap failed");
 }
 
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+// Copies file content at given offset into anonymous memory, backed by huge
+// pages if some are reserved, advised for transparent huge pages otherwise.
+// *hugetlb tells which one was used. The copy is never unmapped
+void* load_file_huge(int fd, off_t offset, size_t size, int* hugetlb)
+{
+    size_t len = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    uint8_t* buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    *hugetlb = (buf != MAP_FAILED);
+
+    // Align the region on a huge page so the kernel can back all of it
+    if (buf == MAP_FAILED)
+    {
+        buf = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED)
+            err(1, "mmap failed");
+        uint8_t* aligned = (uint8_t*)(((uintptr_t)buf + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+        if (aligned > buf)
+            munmap(buf, aligned - buf);
+        if (aligned + len < buf + len + HUGE_PAGE_SIZE)
+            munmap(aligned + len, buf + len + HUGE_PAGE_SIZE - (aligned + len));
+        buf = aligned;
+#ifdef MADV_HUGEPAGE
+        madvise(buf, len, MADV_HUGEPAGE);
+#endif
+    }
+
+    if (pread_full(fd, buf, size, offset) != 0)
+        err(1, "read failed");
+    return buf;
+}
+
+// Reads exactly len bytes at offset, returns -1 on error or end of file
+int pread_full(int fd, void* buf, size_t len, off_t offset)
+{
+    char* dst = buf;
+    while (len > 0)
+    {
+        ssize_t ret = pread(fd, dst, len, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        dst += ret;
+        offset += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+// Writes exactly len bytes at offset, buf == NULL writes zeros
+int pwrite_full(int fd, const void* buf, size_t len, off_t offset)
+{
+    static const char zeros[65536];
+    const char* src = buf;
+    while (len > 0)
+    {
+        size_t chunk = len;
+        if (buf == NULL && chunk > sizeof(zeros))
+            chunk = sizeof(zeros);
+        ssize_t ret = pwrite(fd, (buf != NULL) ? src : zeros, chunk, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        if (buf != NULL)
+            src += ret;
+        offset += ret;
+        len -= ret;
+    }
+    return 0;
+}
@@ -1,7 +1,14 @@
 #ifndef H_UTIL
 #define H_UTIL
 
+#include <sys/types.h>
+
+void* try_mmap_file(int fd, off_t offset, size_t size);
 void* mmap_file(int fd, off_t offset, size_t size);
+void* mmap_file_private(int fd, off_t offset, size_t size);
 void unmap(void* buf, size_t size);
+void* load_file_huge(int fd, off_t offset, size_t size, int* hugetlb);
+int pread_full(int fd, void* buf, size_t len, off_t offset);
+int pwrite_full(int fd, const void* buf, size_t len, off_t offset);
 
 #endif
@@ -9,10 +9,14 @@
 #include <fcntl.h>
 #include <fuse.h>
 #include <iconv.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <time.h>
@@ -20,42 +24,246 @@
 #include "vfat.h"
 #include "util.h"
 #include "debugfs.h"
+#include "extent.h"
+#include "dcache.h"
+#include "write.h"
+#include "wbcache.h"
+#include "uring.h"
+#include "ccache.h"
+#include "cfat.h"
+#include "mount.h"
 
 #define DEBUG_PRINT(...) printf(__VA_ARGS)
 
+struct vfat_data vfat_info;
 iconv_t iconv_utf16;
+pthread_mutex_t iconv_lock = PTHREAD_MUTEX_INITIALIZER; // iconv handles keep conversion state
+pthread_rwlock_t vfat_tree_lock = PTHREAD_RWLOCK_INITIALIZER;
 char* DEBUGFS_PATH = "/.debug";
 
+// Largest data region we try to map in one piece. Bigger images (or a failed
+// whole-region mmap) fall back to a small set of VFAT_MAP_WINDOW_SIZE windows.
+#ifndef VFAT_MAP_BUDGET
+#define VFAT_MAP_BUDGET         ((sizeof(void*) >= 8) ? ((size_t)1 << 40) : ((size_t)1 << 29))
+#endif
+#define VFAT_MAP_WINDOW_SIZE    ((size_t)64 << 20) // multiple of any valid cluster size
+#define VFAT_MAP_WINDOWS        8
+
+struct vfat_window {
+    uint8_t*      base;  // NULL if slot is unused
+    size_t        index; // window number inside the data region
+    size_t        len;
+    int           refs;
+    unsigned long used;  // LRU stamp
+};
+
+// Generations of the files, see FileChanged(). Chains share the counters
+// by first cluster, a collision only costs a needless refresh
+#define VFAT_GENERATIONS        4096
+
+struct vfat_window vfat_windows[VFAT_MAP_WINDOWS];
+unsigned long vfat_windows_clock = 0;
+pthread_mutex_t vfat_windows_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long vfat_generations[VFAT_GENERATIONS];
+
 uint32_t FirstSectorofCluster(uint32_t N)
 {
     return ((N - 2) * vfat_info.sectors_per_cluster) + vfat_info.spec_FirstDataSector;
 }
 
+// Offset of cluster N relative to the beginning of the data region
+off_t ClusterDataOffset(uint32_t N)
+{
+    return (off_t)(N - 2) * vfat_info.cluster_size;
+}
+
+void MapDataRegion()
+{
+    vfat_info.data_begin_offset = (off_t)vfat_info.spec_FirstDataSector * vfat_info.bytes_per_sector;
+    vfat_info.data_size = (size_t)vfat_info.spec_CountofClusters * vfat_info.cluster_size;
+    vfat_info.data = NULL;
+
+    // The cluster cache replaces the mapping in direct mode
+    if (vfat_info.data_size <= VFAT_MAP_BUDGET && !vfat_info.direct)
+    {
+        vfat_info.data = (uint8_t*)try_mmap_file(vfat_info.fd, vfat_info.data_begin_offset, vfat_info.data_size);
+    }
+}
+
 uint8_t* ClusterMapped(uint32_t N)
 {
-    return (uint8_t*)mmap_file(vfat_info.fd, FirstSectorofCluster(N)*vfat_info.bytes_per_sector, vfat_info.cluster_size);
+    // Changes not flushed yet only exist in the write-back cache
+    uint8_t* cached = wbcache_cluster(N);
+    if (cached != NULL)
+    {
+        return cached;
+    }
+
+    // Direct mode serves clusters from its own cache, windows are the fallback
+    if (vfat_info.direct && (cached = ccache_get(N)) != NULL)
+    {
+        return cached;
+    }
+
+    // Whole data region is mapped, no syscall needed
+    if (vfat_info.data != NULL)
+    {
+        return vfat_info.data + ClusterDataOffset(N);
+    }
+
+    off_t dataOffset = ClusterDataOffset(N);
+    size_t index = dataOffset / VFAT_MAP_WINDOW_SIZE;
+    struct vfat_window* victim = NULL;
+    uint8_t* mapped = NULL;
+    int w;
+
+    pthread_mutex_lock(&vfat_windows_lock);
+
+    // Look for an already mapped window, remember the least recently used free one
+    for (w = 0; w < VFAT_MAP_WINDOWS; w++)
+    {
+        struct vfat_window* win = &vfat_windows[w];
+        if (win->base != NULL && win->index == index)
+        {
+            win->refs++;
+            win->used = ++vfat_windows_clock;
+            mapped = win->base + (dataOffset - index * VFAT_MAP_WINDOW_SIZE);
+            break;
+        }
+        if (win->refs == 0 && (victim == NULL || win->base == NULL || (victim->base != NULL && win->used < victim->used)))
+        {
+            victim = win;
+        }
+    }
+
+    // Every window is in use, map the single cluster
+    if (mapped == NULL && victim == NULL)
+    {
+        vfat_info.cluster_map_calls++;
+        mapped = (uint8_t*)mmap_file(vfat_info.fd, FirstSectorofCluster(N)*vfat_info.bytes_per_sector, vfat_info.cluster_size);
+    }
+
+    // Recycle the victim window
+    else if (mapped == NULL)
+    {
+        if (victim->base != NULL)
+        {
+            vfat_info.cluster_unmap_calls++;
+            unmap((void*)victim->base, victim->len);
+        }
+
+        victim->index = index;
+        victim->len = vfat_info.data_size - index * VFAT_MAP_WINDOW_SIZE;
+        if (victim->len > VFAT_MAP_WINDOW_SIZE)
+        {
+            victim->len = VFAT_MAP_WINDOW_SIZE;
+        }
+        vfat_info.cluster_map_calls++;
+        victim->base = (uint8_t*)mmap_file(vfat_info.fd, vfat_info.data_begin_offset + index * VFAT_MAP_WINDOW_SIZE, victim->len);
+        victim->refs = 1;
+        victim->used = ++vfat_windows_clock;
+        mapped = victim->base + (dataOffset - index * VFAT_MAP_WINDOW_SIZE);
+    }
+
+    pthread_mutex_unlock(&vfat_windows_lock);
+    return mapped;
+}
+
+// Copies len bytes starting at offset inner of cluster N, the range may span
+// physically contiguous clusters
+int ClusterRead(uint32_t N, off_t inner, char* dst, size_t len)
+{
+    off_t dataOffset = ClusterDataOffset(N) + inner;
+
+    if (vfat_info.direct)
+    {
+        if (ccache_read(N, inner, dst, len) != 0)
+        {
+            return -1;
+        }
+    }
+    else if (vfat_info.data != NULL)
+    {
+        memcpy(dst, vfat_info.data + dataOffset, len);
+    }
+    else if (pread_full(vfat_info.fd, dst, len, vfat_info.data_begin_offset + dataOffset) != 0)
+    {
+        return -1;
+    }
+    wbcache_overlay(dst, len, vfat_info.data_begin_offset + dataOffset);
+    return 0;
 }
 
 void ClusterUnmap(uint8_t* cluster)
 {
+    if (vfat_info.data != NULL || wbcache_owns(cluster))
+    {
+        return;
+    }
+    if (ccache_owns(cluster))
+    {
+        ccache_put(cluster);
+        return;
+    }
+
+    // Windows stay mapped until they are recycled
+    int w;
+    pthread_mutex_lock(&vfat_windows_lock);
+    for (w = 0; w < VFAT_MAP_WINDOWS; w++)
+    {
+        struct vfat_window* win = &vfat_windows[w];
+        if (win->base != NULL && cluster >= win->base && cluster < win->base + win->len)
+        {
+            win->refs--;
+            pthread_mutex_unlock(&vfat_windows_lock);
+            return;
+        }
+    }
+
+    vfat_info.cluster_unmap_calls++;
+    pthread_mutex_unlock(&vfat_windows_lock);
     unmap((void*)cluster, vfat_info.cluster_size);
 }
 
-time_t BuildTime(uint16_t inputDate, uint16_t inputTime, uint8_t inputTenth)
+// Days from 1970-01-01 to a proleptic Gregorian date, month in 1..12
+static int64_t DaysFromCivil(int64_t year, unsigned month, unsigned day)
 {
-    // Build temporary time structure
-    struct tm preciseTime;
-    preciseTime.tm_year = (inputDate >> 9) + 80;
-    preciseTime.tm_mon = ((inputDate >> 5) & 0x000F) - 1;
-    preciseTime.tm_mday = inputDate & 0x001F;
-    preciseTime.tm_hour = inputTime >> 11;
-    preciseTime.tm_min = (inputTime >> 5) & 0x003F;
-    preciseTime.tm_sec = (inputTime & 0x001F) * 2 + (inputTenth / 10);
+    year -= (month <= 2);
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    unsigned yoe = (unsigned)(year - era * 400);
+    unsigned doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
 
-    // Build final time structure
-    time_t result = mktime(&preciseTime);
+// Days from 1970-01-01 to a FAT date, months and days out of range roll over like with mktime()
+static int64_t FatDateDays(uint16_t date)
+{
+    int year = 1980 + (date >> 9);
+    int month = ((date >> 5) & 0x000F) - 1;
+    if (month < 0)
+    {
+        year--;
+        month += 12;
+    }
+    else if (month > 11)
+    {
+        year++;
+        month -= 12;
+    }
+    return DaysFromCivil(year, month + 1, 1) + (date & 0x001F) - 1;
+}
 
-    return result;
+// Seconds since the epoch of a FAT date and time, which are vfat_info.time_offset
+// minutes ahead of UTC. Plain arithmetic, no time zone database involved
+time_t BuildTime(uint16_t inputDate, uint16_t inputTime, uint8_t inputTenth)
+{
+    int64_t seconds = FatDateDays(inputDate) * 86400
+                    + (inputTime >> 11) * 3600
+                    + ((inputTime >> 5) & 0x003F) * 60
+                    + (inputTime & 0x001F) * 2 + (inputTenth / 10);
+    return (time_t)(seconds - (int64_t)vfat_info.time_offset * 60);
 }
 
 void print_boot_sector(struct fat_boot_header s)
@@ -151,12 +359,33 @@ void check_is_fat32(struct fat_boot_header s, struct vfat_data i)
     }
 }
 
-static void
-vfat_init(const char *dev)
+// Takes the free cluster count of FSInfo when it has a plausible one, the
+// MOUNT_FREE scan replaces it with the exact count
+static void LoadFsInfo()
+{
+    struct fat32_fsinfo info;
+
+    vfat_info.free_clusters = -1;
+    if (vfat_info.fsinfo_sector == 0 || vfat_info.fsinfo_sector == 0xFFFF ||
+        pread_full(vfat_info.fd, &info, sizeof(info), (off_t)vfat_info.fsinfo_sector * vfat_info.bytes_per_sector) != 0)
+    {
+        return;
+    }
+    if (le32toh(info.lead_signature) == VFAT_FSINFO_LEAD_SIGNATURE &&
+        le32toh(info.signature) == VFAT_FSINFO_SIGNATURE &&
+        le32toh(info.free_count) <= vfat_info.spec_CountofClusters)
+    {
+        vfat_info.free_clusters = le32toh(info.free_count);
+    }
+}
+
+void vfat_init(const char *dev)
 {
     struct fat_boot_header s;
 
-    iconv_utf16 = iconv_open("utf-8", "utf-16"); // from utf-16 to utf-8
+    iconv_utf16 = iconv_open("utf-8", "utf-16le"); // from on-disk utf-16 to utf-8
+    if (iconv_utf16 == (iconv_t)-1)
+        err(1, "iconv_open");
     // These are useful so that we can setup correct permissions in the mounted directories
     vfat_info.mount_uid = getuid();
     vfat_info.mount_gid = getgid();
@@ -164,9 +393,18 @@ vfat_init(const char *dev)
     // Use mount time as mtime and ctime for the filesystem root entry (e.g. "/")
     vfat_info.mount_time = time(NULL);
 
-    vfat_info.fd = open(dev, O_RDONLY);
+    // FAT timestamps are in local time, by default the offset in effect at mount
+    if (vfat_info.time_offset == VFAT_TIME_OFFSET_LOCAL)
+    {
+        struct tm local;
+        localtime_r(&vfat_info.mount_time, &local);
+        vfat_info.time_offset = local.tm_gmtoff / 60;
+    }
+
+    vfat_info.fd = open(dev, vfat_info.writable ? O_RDWR : O_RDONLY);
     if (vfat_info.fd < 0)
         err(1, "open(%s)", dev);
+    uring_init();
     if (pread(vfat_info.fd, &s, sizeof(s), 0) != sizeof(s))
         err(1, "read super block");
 
@@ -183,6 +421,8 @@ vfat_init(const char *dev)
     check_is_fat32(s, vfat_info);
 
     // Populate other vfat_info fields
+    vfat_info.fat_count = s.fat_count;
+    vfat_info.fsinfo_sector = s.fsinfo_sector;
     vfat_info.sectors_per_fat = s.sectors_per_fat;
 
     // Populate .debug
@@ -197,13 +437,44 @@ vfat_init(const char *dev)
     vfat_info.fat_size = vfat_info.fat_entries * 4;
     vfat_info.cluster_begin_offset = s.root_cluster;
     vfat_info.direntry_per_cluster = vfat_info.cluster_size / 32;
+    vfat_info.classify_cluster = DirentClassifier(vfat_info.direntry_per_cluster);
+
+    // Map the FAT from disk, a writable mount updates a private copy and writes entries through
+    // Copies that take a pass over the whole FAT replace the mapping later, see vfat_load_fat()
+    if (vfat_info.compactfat && vfat_info.writable)
+    {
+        warnx("compactfat needs a read-only mount, ignored");
+        vfat_info.compactfat = 0;
+    }
+    if (vfat_info.writable && vfat_info.hugefat)
+    {
+        // The allocator edits the copy, it has to be in place before the first request
+        mount_wait(MOUNT_FAT);
+    }
+    else if (vfat_info.writable)
+    {
+        vfat_info.fat = (uint32_t*)mmap_file_private(vfat_info.fd, vfat_info.fat_begin_offset, vfat_info.fat_size);
+        vfat_info.fat_backing = "private";
+    }
+    else
+    {
+        vfat_info.fat = (uint32_t*)mmap_file(vfat_info.fd, vfat_info.fat_begin_offset, vfat_info.fat_size);
+        vfat_info.fat_backing = "mmap";
+    }
+    vfat_info.alloc_hint = 2;
+    LoadFsInfo();
+    if (vfat_info.writable)
+    {
+        vfat_write_init();
+    }
 
-    // Load FAT table from disk
-    vfat_info.fat = (uint32_t*)mmap_file(vfat_info.fd, vfat_info.fat_begin_offset, vfat_info.fat_size);
+    // Map the data region once, clusters are then resolved by pointer arithmetic
+    ccache_init(dev);
+    MapDataRegion();
 
     // Set root inode infos
     vfat_info.root_inode.st_ino = le32toh(s.root_cluster);
-    vfat_info.root_inode.st_mode = 0555 | S_IFDIR;
+    vfat_info.root_inode.st_mode = EntryMode(VFAT_ATTR_DIR);
     vfat_info.root_inode.st_nlink = 1;
     vfat_info.root_inode.st_uid = vfat_info.mount_uid;
     vfat_info.root_inode.st_gid = vfat_info.mount_gid;
@@ -211,35 +482,284 @@ vfat_init(const char *dev)
     vfat_info.root_inode.st_atime = vfat_info.root_inode.st_mtime = vfat_info.root_inode.st_ctime = vfat_info.mount_time;
 }
 
+// Task MOUNT_FAT: a copy in huge pages keeps chain walks on large volumes from missing
+// the TLB, compact runs keep huge FATs small. A read-only mount serves requests from
+// the plain mapping meanwhile, whose contents are the same
+void vfat_load_fat(void)
+{
+    if (vfat_info.compactfat)
+    {
+        cfat_build();
+        __atomic_store_n(&vfat_info.fat_backing, "compact", __ATOMIC_RELEASE);
+    }
+    else if (vfat_info.hugefat)
+    {
+        int hugetlb;
+        uint32_t* copy = (uint32_t*)load_file_huge(vfat_info.fd, vfat_info.fat_begin_offset, vfat_info.fat_size, &hugetlb);
+        uint32_t* mapped = vfat_info.fat;
+        __atomic_store_n(&vfat_info.fat, copy, __ATOMIC_RELEASE);
+        __atomic_store_n(&vfat_info.fat_backing, hugetlb ? "hugetlb" : "thp", __ATOMIC_RELEASE);
+
+        // Readers may still hold the mapping, only its pages are dropped
+        if (mapped != NULL)
+        {
+            madvise(mapped, vfat_info.fat_size, MADV_DONTNEED);
+        }
+    }
+}
+
+// Permissions of an entry with the given attributes
+mode_t EntryMode(uint8_t attr)
+{
+    mode_t mode = (vfat_info.writable && (attr & VFAT_ATTR_RO) == 0) ? 0755 : 0555;
+    return mode | (((attr & VFAT_ATTR_DIR) == VFAT_ATTR_DIR) ? S_IFDIR : S_IFREG);
+}
+
 // Gives the number of next cluster, corresponding to input cluster number c
 int vfat_next_cluster(uint32_t c)
 {
-    return vfat_info.fat[c];
+    if (cfat_enabled())
+    {
+        return cfat_next(c);
+    }
+    return __atomic_load_n(&vfat_info.fat, __ATOMIC_ACQUIRE)[c];
+}
+
+// Checksum of a 8.3 name, stored in each of its long name entries
+uint8_t ShortNameChecksum(const char* nameext)
+{
+    uint8_t sum = 0;
+    int k;
+    for (k = 0; k < 11; k++)
+    {
+        sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)nameext[k];
+    }
+    return sum;
 }
 
-int vfat_readdir(uint32_t first_cluster, fuse_fill_dir_t callback, void *callbackdata)
+// Fills in the status infos stored in an 8.3 entry
+void DirentStat(const struct fat32_direntry* e, struct stat* st)
 {
-    // We can reuse same stat entry over and over again
+    st->st_ino = (((uint32_t)(e->cluster_hi)) << 16) | ((uint32_t)(e->cluster_lo));
+    st->st_mode = EntryMode(e->attr);
+    st->st_size = e->size;
+
+    // Convert dates
+    st->st_atime = BuildTime(e->atime_date, 0, 0);
+    st->st_mtime = BuildTime(e->mtime_date, e->mtime_time, 0);
+    st->st_ctime = BuildTime(e->ctime_date, e->ctime_time, e->ctime_ms);
+}
+
+// Classes of the low attribute bits, see ClassifyEntries(): volume label (0),
+// 8.3 entry (1) or long name slot (2)
+static const uint8_t AttrClass[16] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 2
+};
+
+// Lists the 8.3 entries and long name slots among the count entries of a cluster
+// into kept, in order, skipping deleted entries and volume labels. Sets *end if
+// an end of directory marker shows up. Always inlined with a constant count
+static inline __attribute__((always_inline))
+size_t ClassifyEntries(const struct fat32_direntry* entries, size_t count, uint16_t* kept, int* end)
+{
+    size_t i, n = 0;
+    *end = 0;
+    for (i = 0; i < count; i++)
+    {
+        uint8_t first = (uint8_t)entries[i].name[0];
+        if (first == 0x00)
+        {
+            *end = 1;
+            break;
+        }
+
+        // Written every time, only counted when kept
+        uint8_t class = AttrClass[entries[i].attr & 0x0F];
+        kept[n] = (uint16_t)i | ((class == 2) ? VFAT_KEPT_LFN : 0);
+        n += (first != 0xE5) & (class != 0);
+    }
+    return n;
+}
+
+// One classifier per cluster size, so its loop has a fixed trip count
+#define DEFINE_CLASSIFIER(count) \
+    static size_t ClassifyEntries##count(const struct fat32_direntry* entries, uint16_t* kept, int* end) \
+    { \
+        return ClassifyEntries(entries, count, kept, end); \
+    }
+
+DEFINE_CLASSIFIER(16)
+DEFINE_CLASSIFIER(32)
+DEFINE_CLASSIFIER(64)
+DEFINE_CLASSIFIER(128)
+DEFINE_CLASSIFIER(256)
+DEFINE_CLASSIFIER(512)
+DEFINE_CLASSIFIER(1024)
+DEFINE_CLASSIFIER(2048)
+DEFINE_CLASSIFIER(4096)
+DEFINE_CLASSIFIER(8192)
+DEFINE_CLASSIFIER(16384)
+
+// Classifier for clusters of direntry_per_cluster entries, picked at mount
+vfat_classify_fn DirentClassifier(size_t direntry_per_cluster)
+{
+    switch (direntry_per_cluster)
+    {
+        case 16:    return ClassifyEntries16;
+        case 32:    return ClassifyEntries32;
+        case 64:    return ClassifyEntries64;
+        case 128:   return ClassifyEntries128;
+        case 256:   return ClassifyEntries256;
+        case 512:   return ClassifyEntries512;
+        case 1024:  return ClassifyEntries1024;
+        case 2048:  return ClassifyEntries2048;
+        case 4096:  return ClassifyEntries4096;
+        case 8192:  return ClassifyEntries8192;
+        case 16384: return ClassifyEntries16384;
+    }
+    errx(1, "no directory entry classifier for %zu entries per cluster", direntry_per_cluster);
+}
+
+// Builds the "NAME.EXT" form of an 8.3 name, out holds at least 13 bytes
+void ShortNameToString(const char* nameext, char* out)
+{
+    ssize_t sizeCnt = 0;
+    while ((sizeCnt < 8) && (nameext[sizeCnt] != ' '))
+    {
+        out[sizeCnt] = nameext[sizeCnt];
+        sizeCnt++;
+    }
+    if (nameext[8] != ' ')
+    {
+        out[sizeCnt] = '.';
+        sizeCnt++;
+    }
+    ssize_t sizeName = sizeCnt;
+    while (((sizeCnt - sizeName) < 3) && (nameext[8 + sizeCnt - sizeName] != ' '))
+    {
+        out[sizeCnt] = nameext[8 + sizeCnt - sizeName];
+        sizeCnt++;
+    }
+    out[sizeCnt] = '\0';
+
+    // 0x05 stands for a leading 0xE5 character
+    if ((uint8_t)out[0] == 0x05)
+    {
+        out[0] = (char)0xE5;
+    }
+}
+
+// Converts a UTF-16LE long name to UTF-8 using the shared iconv_utf16 handle
+// Returns 0 on success
+int LongNameToUtf8(const uint16_t* units, size_t count, char* out, size_t outSize)
+{
+    char* in = (char*)units;
+    size_t inLeft = count * sizeof(uint16_t);
+    size_t outLeft = outSize - 1;
+    size_t ret;
+
+    // Plain ASCII names, the common case, need neither iconv nor its lock
+    size_t k;
+    for (k = 0; k < count && k < outLeft && units[k] < 0x80; k++)
+    {
+        out[k] = (char)units[k];
+    }
+    if (k == count)
+    {
+        out[k] = '\0';
+        return 0;
+    }
+
+    pthread_mutex_lock(&iconv_lock);
+    iconv(iconv_utf16, NULL, NULL, NULL, NULL);
+    ret = iconv(iconv_utf16, &in, &inLeft, &out, &outLeft);
+    pthread_mutex_unlock(&iconv_lock);
+
+    if (ret == (size_t)-1 || inLeft != 0)
+    {
+        return -1;
+    }
+    *out = '\0';
+    return 0;
+}
+
+// With the io_uring backend, directories spanning several clusters are
+// fetched in one batch instead of faulting their clusters in one by one
+static void PrefetchDirectory(uint32_t first_cluster)
+{
+    struct vfat_extent_map* extents = extent_map_get(first_cluster);
+    if (extents != NULL && extents->cluster_count > 1)
+    {
+        struct uring_read ranges[URING_BATCH];
+        size_t k, count = 0;
+        for (k = 0; k < extents->count && count < URING_BATCH; k++)
+        {
+            ranges[count].buf = NULL;
+            ranges[count].offset = vfat_info.data_begin_offset + ClusterDataOffset(extents->extents[k].physical);
+            ranges[count].len = (size_t)extents->extents[k].length * vfat_info.cluster_size;
+            count++;
+        }
+        uring_prefetch(ranges, count);
+    }
+    extent_map_put(extents);
+}
+
+// Decodes every entry of a directory and hands it to callback
+// Returns 1 if the callback stopped the scan, 0 otherwise
+int vfat_scan_dir(uint32_t first_cluster, vfat_dirent_cb callback, void *callbackdata)
+{
+    if (vfat_info.uring && !vfat_info.direct)
+    {
+        PrefetchDirectory(first_cluster & 0x0FFFFFFF);
+    }
+    return vfat_scan_dir_from(first_cluster, 0, callback, callbackdata);
+}
+
+// Same, starting at raw slot start of the directory, see vfat_dirent.slot
+// The cluster holding it is found through the extent map of the directory
+int vfat_scan_dir_from(uint32_t first_cluster, uint32_t start, vfat_dirent_cb callback, void *callbackdata)
+{
+
+    // We can reuse same entry over and over again
+    struct vfat_dirent de;
     struct stat st;
     memset(&st, 0, sizeof(st));
     st.st_uid = vfat_info.mount_uid;
     st.st_gid = vfat_info.mount_gid;
     st.st_nlink = 1;
+    int stopped = 0;
+
+    // Long name being assembled, each slot lands at its sequence number
+    uint16_t longNameUnits[VFAT_LFN_MAX_SLOTS * VFAT_LFN_SLOT_CHARS];
+    int lfnSlots = 0;    // slots announced by the last slot, 0 if no long name pending
+    int lfnExpected = 0; // sequence number of the next slot we expect
+    uint8_t lfnChecksum = 0;
+    uint32_t lfnCluster = 0, lfnIndex = 0;
 
-    // Buffer for storing long names
-    size_t longNameSize = 0;
-    unsigned char* longName = NULL;
-    unsigned char* longNamePart = (unsigned char*)calloc(13, sizeof(unsigned char));
+    // Buffers for the decoded names
+    char longName[VFAT_LFN_MAX_SLOTS * VFAT_LFN_SLOT_CHARS * 3 + 1];
+    char shortName[13];
 
-    // Buffer for storing short names
-    unsigned char* shortName = (unsigned char*)calloc(13, sizeof(unsigned char));
-    int j;
+    // Entries of the current cluster worth decoding, see ClassifyEntries()
+    uint16_t kept[VFAT_MAX_DIRENTRY_PER_CLUSTER];
 
-    // Cluster variable
+    // Cluster variable, with its index inside the chain
     uint32_t clusterId = (first_cluster & 0x0FFFFFFF);
+    uint32_t logical = start / vfat_info.direntry_per_cluster;
+    size_t startIndex = start % vfat_info.direntry_per_cluster;
+    if (logical > 0)
+    {
+        struct vfat_extent_map* extents = extent_map_get(clusterId);
+        uint32_t run;
+        if (extent_lookup(extents, logical, &clusterId, &run) != 0)
+        {
+            clusterId = 0; // past the end of the directory
+        }
+        extent_map_put(extents);
+    }
 
     // Loop on clusters
-    while ((clusterId > 0x00000001) && (clusterId < 0x0FFFFFF0))
+    while (!stopped && (clusterId > 0x00000001) && (clusterId < 0x0FFFFFF0))
     {
         // Load cluster data
         uint8_t* cluster = ClusterMapped(clusterId);
@@ -248,199 +768,164 @@ int vfat_readdir(uint32_t first_cluster, fuse_fill_dir_t callback, void *callbac
         struct fat32_direntry* direntries = (struct fat32_direntry*)cluster;
         struct fat32_direntry_long* direntrieslong = (struct fat32_direntry_long*)cluster;
 
-        // Marker of deletion
-        int isDeleted = 0;
-
-        // Go through direntries of the cluster
-        size_t i;
-        for (i=0; i<vfat_info.direntry_per_cluster; i++)
+        // Classify all entries of the cluster in one pass, then decode the kept ones
+        int end;
+        size_t keptCount = vfat_info.classify_cluster(direntries, kept, &end);
+        size_t next = startIndex; // entry after the last one decoded
+        size_t k;
+        for (k = 0; !stopped && k < keptCount; k++)
         {
-            // If directory entry is empty
-            if (direntries[i].name[0] == 0xE5)
+            size_t i = kept[k] & VFAT_KEPT_INDEX;
+            if (i < startIndex)
             {
                 continue;
             }
 
-            // If directory entry is empty and no other is full
-            if (direntries[i].name[0] == 0x00)
+            // A deleted entry or a volume label in between breaks a long name
+            if (i != next)
             {
-                break;
+                lfnSlots = 0;
             }
+            next = i + 1;
 
             // If directory entry is long name
-            if ((direntries[i].attr & 0x0F) == 0x0F)
+            if (kept[k] & VFAT_KEPT_LFN)
             {
-                // Read long name parts
-                longNamePart[0] = direntrieslong[i].name1[0];
-                longNamePart[1] = direntrieslong[i].name1[1];
-                longNamePart[2] = direntrieslong[i].name1[2];
-                longNamePart[3] = direntrieslong[i].name1[3];
-                longNamePart[4] = direntrieslong[i].name1[4];
-                longNamePart[5] = direntrieslong[i].name2[0];
-                longNamePart[6] = direntrieslong[i].name2[1];
-                longNamePart[7] = direntrieslong[i].name2[2];
-                longNamePart[8] = direntrieslong[i].name2[3];
-                longNamePart[9] = direntrieslong[i].name2[4];
-                longNamePart[10] = direntrieslong[i].name2[5];
-                longNamePart[11] = direntrieslong[i].name3[0];
-                longNamePart[12] = direntrieslong[i].name3[1];
-
-                // Search for \0
-                size_t zeropos = 0;
-                for (zeropos = 0; zeropos < 13; zeropos++)
-                {
-                    if (longNamePart[zeropos] == '\0')
-                    {
-                        break;
-                    }
-                }
-                ssize_t currpos = 0;
-
-                // Extend long name storage
-                longNameSize += zeropos;
-                longName = realloc(longName, longNameSize * sizeof(unsigned char));
+                struct fat32_direntry_long* lfn = &direntrieslong[i];
+                int seq = lfn->seq & VFAT_LFN_SEQ_MASK;
 
-                // Shift all previous content to right
-                for (currpos = longNameSize - zeropos - 1; (currpos >= 0) && (longNameSize - zeropos > 0); currpos--)
+                // The last slot comes first and announces how many follow
+                if (lfn->seq & VFAT_LFN_SEQ_START)
                 {
-                    longName[currpos + zeropos] = longName[currpos];
+                    lfnSlots = (seq >= 1 && seq <= VFAT_LFN_MAX_SLOTS) ? seq : 0;
+                    lfnExpected = seq;
+                    lfnChecksum = lfn->csum;
+                    lfnCluster = clusterId;
+                    lfnIndex = i;
                 }
 
-                // Copy all chars before \0
-                for (currpos = 0; currpos < zeropos; currpos++)
+                // Orphaned or out of order slot, forget the long name
+                if (lfnSlots == 0 || seq != lfnExpected || lfn->csum != lfnChecksum)
                 {
-                    longName[currpos] = longNamePart[currpos];
+                    lfnSlots = 0;
+                    continue;
                 }
-            }
 
-            // If directory entry is VOLUME_ID directory entry
-            else if ((direntries[i].attr & 0x08) == 0x08)
-            {
-                // Do nothing
+                // Store the 13 code units of the slot at their final position
+                uint16_t* slot = &longNameUnits[(seq - 1) * VFAT_LFN_SLOT_CHARS];
+                memcpy(slot, lfn->name1, sizeof(lfn->name1));
+                memcpy(slot + 5, lfn->name2, sizeof(lfn->name2));
+                memcpy(slot + 11, lfn->name3, sizeof(lfn->name3));
+                lfnExpected--;
             }
 
             // If directory entry is standard directory entry
             else
             {
-                // Fill in status infos
-                st.st_ino = (((uint32_t)(direntries[i].cluster_hi)) << 16) | ((uint32_t)(direntries[i].cluster_lo));
-                st.st_mode = 0555;
-                if ((direntries[i].attr & 0x10) == 0x10)
-                {
-                    st.st_mode = st.st_mode | S_IFDIR;
-                }
-                else
-                {
-                    st.st_mode = st.st_mode | S_IFREG;
-                }
-                st.st_size = direntries[i].size;
-
-                // Convert dates
-                st.st_atime = BuildTime(direntries[i].atime_date, 0, 0);
-                st.st_mtime = BuildTime(direntries[i].mtime_date, direntries[i].mtime_time, 0);
-                st.st_ctime = BuildTime(direntries[i].ctime_date, direntries[i].ctime_time, direntries[i].ctime_ms);
-
-                // Define name pointer
-                unsigned char* name = NULL;
-
-                // Build short name
-                ssize_t sizeCnt = 0;
-                while ((sizeCnt < 8) && (direntries[i].name[sizeCnt] != ' '))
-                {
-                    shortName[sizeCnt] = direntries[i].name[sizeCnt];
-                    sizeCnt++;
-                }
-                if (direntries[i].ext[0] != ' ')
+                // Fill in status infos and build short name
+                DirentStat(&direntries[i], &st);
+                ShortNameToString(direntries[i].nameext, shortName);
+
+                // Use the long name if it is complete and belongs to this entry
+                de.name = shortName;
+                de.pos.dir = first_cluster & 0x0FFFFFFF;
+                de.pos.cluster = de.pos.first_cluster = clusterId;
+                de.pos.index = de.pos.first_index = i;
+                de.pos.count = 1;
+                memcpy(de.pos.nameext, direntries[i].nameext, sizeof(de.pos.nameext));
+                if (lfnSlots != 0 && lfnExpected == 0 && lfnChecksum == ShortNameChecksum(direntries[i].nameext))
                 {
-                    shortName[sizeCnt] = '.';
-                    sizeCnt++;
-                }
-                ssize_t sizeName = sizeCnt;
-                while (((sizeCnt - sizeName) < 3) && (direntries[i].ext[sizeCnt-sizeName] != ' '))
-                {
-                    shortName[sizeCnt] = direntries[i].ext[sizeCnt-sizeName];
-                    sizeCnt++;
-                }
-                shortName[sizeCnt] = '\0';
-
-                // Check for deletion in short name
-                for (j=0; j<sizeCnt; j++)
-                {
-                    if (shortName[j] == 0xE5)
+                    // Name ends at the first 0x0000, unused units are padded with 0xFFFF
+                    size_t units = 0;
+                    while (units < lfnSlots * VFAT_LFN_SLOT_CHARS && longNameUnits[units] != 0x0000)
                     {
-                        isDeleted = 1;
+                        units++;
                     }
-                }
-
-                // If long name
-                if (longName != NULL)
-                {
-                    longName = realloc(longName, (longNameSize+1) * sizeof(unsigned char));
-                    longName[longNameSize] = '\0';
-                    for (j=0; j<longNameSize; j++)
+                    if (LongNameToUtf8(longNameUnits, units, longName, sizeof(longName)) == 0)
                     {
-                        if (longName[j] == 0xE5)
-                        {
-                            isDeleted = 1;
-                        }
+                        de.name = longName;
+                        de.pos.first_cluster = lfnCluster;
+                        de.pos.first_index = lfnIndex;
+                        de.pos.count = lfnSlots + 1;
                     }
-                    name = longName;
-                }
-
-                // If short name
-                else
-                {
-                    name = shortName;
                 }
+                lfnSlots = 0;
 
                 // Callback
-                if (isDeleted == 0)
-                {
-                    callback(callbackdata, (const char*)name, &st, 0);
-                }
-                isDeleted = 0;
-
-                // Free long name
-                if (longName != NULL)
-                {
-                    free(longName);
-                    longName = NULL;
-                    longNameSize = 0;
-                }
+                de.short_name = shortName;
+                de.st = st;
+                de.slot = logical * vfat_info.direntry_per_cluster + i;
+                stopped = callback(callbackdata, &de);
             }
         }
 
+        // Same for deleted entries at the end of the cluster
+        if (!end && next != vfat_info.direntry_per_cluster)
+        {
+            lfnSlots = 0;
+        }
+
         // Unmap cluster
         ClusterUnmap(cluster);
 
         // Go to next cluster
-        clusterId = vfat_next_cluster(clusterId);
+        clusterId = vfat_next_cluster(clusterId) & 0x0FFFFFFF;
+        logical++;
+        startIndex = 0;
     }
 
-    return 0;
+    return stopped;
 }
 
-
-// Used by vfat_search_entry()
-struct vfat_search_data {
-    const char*  name;
-    int          found;
-    struct stat* st;
+// Used by vfat_readdir_entry()
+struct vfat_readdir_data {
+    fuse_fill_dir_t  callback;
+    void*            callbackdata;
+    uint32_t         dir;   // first cluster of the listed directory
+    struct dirindex* index; // name index built along the way, may be NULL
 };
 
-
-// You can use this in vfat_resolve as a callback function for vfat_readdir
-// This way you can get the struct stat of the subdirectory/file.
-int vfat_search_entry(void *data, const char *name, const struct stat *st, off_t offs)
+int vfat_readdir_entry(void *data, const struct vfat_dirent *de)
 {
-    struct vfat_search_data *sd = data;
+    struct vfat_readdir_data *rd = data;
+
+    if (rd->index != NULL)
+    {
+        dirindex_add(rd->index, de);
+    }
+
+    // ls -l stats every listed name next, have the dentry cache answer it
+    if (strcmp(de->name, ".") != 0 && strcmp(de->name, "..") != 0)
+    {
+        dcache_insert(rd->dir, de->name, &de->st);
+    }
+
+    // The offset of an entry is the cookie of the next one, the filler
+    // returns non-zero once the reply buffer is full
+    return rd->callback(rd->callbackdata, de->name, &de->st, (off_t)de->slot + 1);
+}
 
-    if (strcmp(sd->name, name) != 0) return 0;
+// Lists a directory through a fuse filler from the cookie offs on, 0 being
+// the start. A listing from the start that fits in one reply builds the name index
+int vfat_readdir(uint32_t first_cluster, fuse_fill_dir_t callback, void *callbackdata, off_t offs)
+{
+    struct vfat_readdir_data rd;
+    rd.callback = callback;
+    rd.callbackdata = callbackdata;
+    rd.dir = first_cluster;
+    rd.index = (offs != 0 || dirindex_contains(first_cluster)) ? NULL : dirindex_begin(first_cluster);
 
-    sd->found = 1;
-    *sd->st = *st;
+    int full = (offs == 0) ? vfat_scan_dir(first_cluster, vfat_readdir_entry, &rd)
+                           : vfat_scan_dir_from(first_cluster, offs, vfat_readdir_entry, &rd);
 
-    return 1;
+    if (rd.index != NULL)
+    {
+        if (full)
+            dirindex_discard(rd.index);
+        else
+            dirindex_commit(rd.index);
+    }
+    return 0;
 }
 
 /**
@@ -455,44 +940,49 @@ int vfat_resolve(const char *path, struct stat *st)
     struct stat myStat;
     myStat = vfat_info.root_inode;
 
-    // Temporary vfat_search_data structure
-    struct vfat_search_data searchData;
-    searchData.name = NULL;
-    searchData.found = 0;
-    searchData.st = (struct stat*)malloc(sizeof(struct stat));
+    // Stat structure of the current component
+    struct stat foundStat;
 
-    // Tokenize the string
+    // Tokenize a private copy, the caller's path stays untouched
+    char pathCopy[PATH_MAX];
+    if (strlen(path) >= sizeof(pathCopy))
+    {
+        return -ENAMETOOLONG;
+    }
+    strcpy(pathCopy, path);
+
+    char* saveptr;
     char* token;
-    token = strtok((char*)path, "/");
+    token = strtok_r(pathCopy, "/", &saveptr);
 
     // For each token ("folder")
     while (token != NULL)
     {
-        // Read the parent dir and search for it
-        searchData.name = token;
-        vfat_readdir(myStat.st_ino, vfat_search_entry, (void*)(&searchData));
+        // Ask the dentry cache first, then the name index of the parent dir
+        int found = dcache_lookup(myStat.st_ino, token, &foundStat);
+        if (found == DCACHE_MISS)
+        {
+            found = dirindex_lookup(myStat.st_ino, token, &foundStat);
+            dcache_insert(myStat.st_ino, token, (found == DCACHE_POSITIVE) ? &foundStat : NULL);
+        }
 
         // If dest found
-        if (searchData.found == 1)
+        if (found == DCACHE_POSITIVE)
         {
             // Copy stat into my stat
-            myStat = *(searchData.st);
-
-            // Cancel found
-            searchData.found = 0;
+            myStat = foundStat;
 
             // If it is a file
             if ((myStat.st_mode & S_IFDIR) == 0)
             {
                 // Check next token is NULL
-                token = strtok(NULL, "/");
+                token = strtok_r(NULL, "/", &saveptr);
                 if (token == NULL)
                 {
                     break;
                 }
                 else
                 {
-                    free(searchData.st);
                     return -ENOTDIR;
                 }
             }
@@ -505,15 +995,35 @@ int vfat_resolve(const char *path, struct stat *st)
         }
 
         // Next token
-        token = strtok(NULL, "/");
+        token = strtok_r(NULL, "/", &saveptr);
     }
 
     // Put stat in output
-    free(searchData.st);
     *st = myStat;
     return 0;
 }
 
+// Volume sizes in clusters, free space comes from vfat_info.free_clusters
+int vfat_fuse_statfs(const char *path, struct statvfs *st)
+{
+    long free = __atomic_load_n(&vfat_info.free_clusters, __ATOMIC_ACQUIRE);
+    if (free < 0)
+    {
+        // Neither FSInfo nor the free space scan gave a count yet
+        mount_wait(MOUNT_FREE);
+        free = __atomic_load_n(&vfat_info.free_clusters, __ATOMIC_ACQUIRE);
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = vfat_info.cluster_size;
+    st->f_frsize = vfat_info.cluster_size;
+    st->f_blocks = vfat_info.spec_CountofClusters;
+    st->f_bfree = st->f_bavail = (free > 0) ? free : 0;
+    st->f_namemax = VFAT_LFN_MAX_CHARS;
+    st->f_flag = vfat_info.writable ? 0 : ST_RDONLY;
+    return 0;
+}
+
 // Get file attributes
 int vfat_fuse_getattr(const char *path, struct stat *st)
 {
@@ -525,7 +1035,10 @@ int vfat_fuse_getattr(const char *path, struct stat *st)
     // Real FAT filesystem
     else
     {
-        return vfat_resolve(path, st);
+        pthread_rwlock_rdlock(&vfat_tree_lock);
+        int ret = vfat_resolve(path, st);
+        pthread_rwlock_unlock(&vfat_tree_lock);
+        return ret;
     }
 }
 
@@ -533,7 +1046,9 @@ int vfat_fuse_getattr(const char *path, struct stat *st)
 int vfat_fuse_getxattr(const char *path, const char* name, char* buf, size_t size)
 {
     struct stat st;
+    pthread_rwlock_rdlock(&vfat_tree_lock);
     int ret = vfat_resolve(path, &st);
+    pthread_rwlock_unlock(&vfat_tree_lock);
     if (ret != 0) return ret;
     if (strcmp(name, "debug.cluster") != 0) return -ENODATA;
 
@@ -550,11 +1065,11 @@ int vfat_fuse_getxattr(const char *path, const char* name, char* buf, size_t siz
 
 int vfat_fuse_readdir(
         const char *path, void *callback_data,
-        fuse_fill_dir_t callback, off_t unused_offs, struct fuse_file_info *unused_fi)
+        fuse_fill_dir_t callback, off_t offs, struct fuse_file_info *unused_fi)
 {
     // Virtual debug filesystem
     if (strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0) {
-        return debugfs_fuse_readdir(path + strlen(DEBUGFS_PATH), callback_data, callback, unused_offs, unused_fi);
+        return debugfs_fuse_readdir(path + strlen(DEBUGFS_PATH), callback_data, callback, offs, unused_fi);
     }
 
     // Real FAT filesystem
@@ -562,137 +1077,573 @@ int vfat_fuse_readdir(
     {
         struct stat dirStat;
 
+        pthread_rwlock_rdlock(&vfat_tree_lock);
+
         // If path can be resolved to a stat structure
-        if (vfat_resolve(path, &dirStat) == 0)
+        int ret = vfat_resolve(path, &dirStat);
+        if (ret == 0)
         {
-            return vfat_readdir(dirStat.st_ino, callback, callback_data);
+            ret = vfat_readdir(dirStat.st_ino, callback, callback_data, offs);
         }
 
-        // If path cannot be resolved
+        pthread_rwlock_unlock(&vfat_tree_lock);
+        return ret;
+    }
+}
+
+// Initial readahead window, doubled on every sequential read up to vfat_info.readahead
+#define VFAT_READAHEAD_MIN      4
+
+// Asks the kernel to start fetching clusters [first, first + count) of a chain
+// The io_uring backend submits every extent of the window in one batch
+void PrefetchClusters(struct vfat_extent_map* extents, uint32_t first, uint32_t count)
+{
+    struct uring_read ranges[URING_BATCH];
+    size_t batched = 0;
+    uint32_t physical, run;
+
+    // Direct mode keeps the data out of the page cache
+    if (vfat_info.direct)
+    {
+        return;
+    }
+    while (count > 0 && extent_lookup(extents, first, &physical, &run) == 0)
+    {
+        if (run > count)
+        {
+            run = count;
+        }
+
+        off_t start = vfat_info.data_begin_offset + ClusterDataOffset(physical);
+        size_t len = (size_t)run * vfat_info.cluster_size;
+        if (vfat_info.uring)
+        {
+            ranges[batched].buf = NULL;
+            ranges[batched].offset = start;
+            ranges[batched].len = len;
+            if (++batched == URING_BATCH)
+            {
+                uring_prefetch(ranges, batched);
+                batched = 0;
+            }
+        }
+        else if (vfat_info.data != NULL)
+        {
+            uintptr_t addr = (uintptr_t)(vfat_info.data + ClusterDataOffset(physical));
+            uintptr_t page = addr & ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+            madvise((void*)page, len + (addr - page), MADV_WILLNEED);
+        }
         else
         {
-            return -errno;
+            posix_fadvise(vfat_info.fd, start, len, POSIX_FADV_WILLNEED);
         }
+
+        __atomic_fetch_add(&vfat_info.readahead_requests, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&vfat_info.readahead_clusters, run, __ATOMIC_RELAXED);
+        first += run;
+        count -= run;
+    }
+    if (batched > 0)
+    {
+        uring_prefetch(ranges, batched);
     }
-    return 0;
 }
 
-int vfat_fuse_read(
-        const char *path, char *buf, size_t size, off_t offs,
-        struct fuse_file_info *unused)
+// Detects sequential readers and keeps the data behind the request prefetched
+// The window grows while the reader keeps streaming and collapses on a seek
+void ReadAhead(struct vfat_file* file, struct vfat_extent_map* extents, off_t offs, size_t size)
 {
-    // Virtual debug filesystem
-    if (strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0)
+    if (vfat_info.readahead == 0 || extents == NULL)
     {
-        return debugfs_fuse_read(path + strlen(DEBUGFS_PATH), buf, size, offs, unused);
+        return;
     }
 
-    // Real FAT filesystem
-    else
+    uint32_t first = 0, count = 0;
+    uint32_t end = (offs + size + vfat_info.cluster_size - 1) / vfat_info.cluster_size;
+
+    pthread_mutex_lock(&file->lock);
+    if (offs == file->ra_last_end && offs != 0)
     {
-        struct stat fileStat;
+        __atomic_fetch_add(&vfat_info.sequential_reads, 1, __ATOMIC_RELAXED);
+        file->ra_window = file->ra_window ? file->ra_window * 2 : VFAT_READAHEAD_MIN;
+        if (file->ra_window > vfat_info.readahead)
+        {
+            file->ra_window = vfat_info.readahead;
+        }
 
-        // If path can be resolved to a stat structure
-        if (vfat_resolve(path, &fileStat) == 0)
+        // Only prefetch what previous requests did not cover yet
+        first = (file->ra_next > end) ? file->ra_next : end;
+        if (end + file->ra_window > first)
         {
-            // Determine theoretical cluster # in clusters chain
-            size_t startClusterNumber = offs / vfat_info.cluster_size;
+            count = end + file->ra_window - first;
+            file->ra_next = first + count;
+        }
+    }
+    else
+    {
+        __atomic_fetch_add(&vfat_info.random_reads, 1, __ATOMIC_RELAXED);
+        file->ra_window = 0;
+        file->ra_next = 0;
+    }
+    file->ra_last_end = offs + size;
+    pthread_mutex_unlock(&file->lock);
 
-            // Find cluster number
-            uint32_t clusterId = fileStat.st_ino & 0x0FFFFFFF;
-            size_t clusterNumber;
-            for (clusterNumber = 0; clusterNumber < startClusterNumber; clusterNumber++)
-            {
-                clusterId = vfat_next_cluster(clusterId) & 0x0FFFFFFF;
+    if (count > 0)
+    {
+        PrefetchClusters(extents, first, count);
+    }
+}
 
-                // Reached end cluster
-                if ((clusterId <= 0x00000001) || (clusterId >= 0x0FFFFFF0))
-                {
-                    return 0;
-                }
-            }
+// Takes a consistent view of an open file's size and chain, the chain of a
+// file opened on a writable mount may be replaced at any time
+// Release the returned map with extent_map_put()
+struct vfat_extent_map* FileSnapshot(struct vfat_file* file, off_t* size)
+{
+    pthread_mutex_lock(&file->lock);
+    struct vfat_extent_map* extents = extent_map_hold(file->extents);
+    *size = file->st.st_size;
+    pthread_mutex_unlock(&file->lock);
+    return extents;
+}
 
-            // Prepare buffer
-            char* tmpbuff = (char*)calloc(size, sizeof(char));
+// Points an open file at new attributes, reloading its chain if it changed
+void FileSetChain(struct vfat_file* file, const struct stat* st)
+{
+    struct vfat_extent_map* old = NULL;
 
-            // Compute offset inside cluster
-            off_t innerOffset = offs % vfat_info.cluster_size;
+    pthread_mutex_lock(&file->lock);
+    if (file->st.st_ino != st->st_ino || (file->extents != NULL && __atomic_load_n(&file->extents->stale, __ATOMIC_RELAXED)))
+    {
+        old = file->extents;
+        file->extents = extent_map_get(st->st_ino);
+        file->cursor_run = 0;
+    }
+    file->st = *st;
+    file->generation = FileGeneration(st->st_ino);
+    pthread_mutex_unlock(&file->lock);
 
-            // Read size
-            size_t readSize = 0;
+    extent_map_put(old);
+}
 
-            // Loop on clusters
-            while ((clusterId > 0x00000001) && (clusterId < 0x0FFFFFF0))
-            {
-                // Load cluster data
-                uint8_t* cluster = ClusterMapped(clusterId);
+// Generation of the file whose chain starts at first_cluster, 0 for empty files
+unsigned long FileGeneration(uint32_t first_cluster)
+{
+    return __atomic_load_n(&vfat_generations[first_cluster % VFAT_GENERATIONS], __ATOMIC_ACQUIRE);
+}
 
-                // Start reading at innerOffset
-                while ((innerOffset < vfat_info.cluster_size) && (readSize < size) && (offs + readSize < fileStat.st_size))
-                {
-                    tmpbuff[readSize] = (char)(cluster[innerOffset]);
-                    readSize++;
-                    innerOffset++;
-                }
+// Called under the tree write lock by writers changing the entry or the
+// chain of a file, so that handles holding its old state refresh it
+void FileChanged(uint32_t first_cluster)
+{
+    __atomic_fetch_add(&vfat_generations[first_cluster % VFAT_GENERATIONS], 1, __ATOMIC_RELEASE);
+}
 
-                // Unmap cluster
-                ClusterUnmap(cluster);
+// Whether no writer changed the file since the handle took its state
+int FileIsCurrent(struct vfat_file* file)
+{
+    pthread_mutex_lock(&file->lock);
+    int current = file->generation == FileGeneration(file->st.st_ino);
+    pthread_mutex_unlock(&file->lock);
+    return current;
+}
 
-                // If there is still room for data
-                if (readSize < size)
-                {
-                    innerOffset = 0;
-                    clusterId = vfat_next_cluster(clusterId);
-                }
+// Other handles may have changed the file since it was opened, pick up its
+// current size and chain. The path is only resolved again when they did
+void RefreshFile(const char *path, struct vfat_file* file)
+{
+    struct stat st;
+    if (FileIsCurrent(file))
+    {
+        return;
+    }
 
-                // If buffer is full
-                else
-                {
-                    clusterId = 0x00000000;
-                }
-            }
+    // A writer's copy of its entry may be older now, see RefreshWriter()
+    pthread_mutex_lock(&file->lock);
+    file->entry.name[0] = 0;
+    pthread_mutex_unlock(&file->lock);
+    if (vfat_resolve(path, &st) == 0)
+    {
+        FileSetChain(file, &st);
+        return;
+    }
+
+    // Removed meanwhile, keep reading what the handle has
+    pthread_mutex_lock(&file->lock);
+    file->generation = FileGeneration(file->st.st_ino);
+    pthread_mutex_unlock(&file->lock);
+}
+
+// Runs of one request gathered for the io_uring backend
+struct vfat_read_batch {
+    struct uring_read reads[URING_BATCH];
+    size_t            count;
+};
+
+static int BatchFlush(struct vfat_read_batch* batch)
+{
+    size_t k;
+    int ret = uring_read_batch(batch->reads, batch->count);
+    for (k = 0; ret == 0 && k < batch->count; k++)
+    {
+        wbcache_overlay(batch->reads[k].buf, batch->reads[k].len, batch->reads[k].offset);
+    }
+    batch->count = 0;
+    return ret;
+}
+
+// Copies len bytes at offset inner of cluster N, right away without the
+// io_uring backend, as part of the next batch with it
+static int BatchRead(struct vfat_read_batch* batch, uint32_t N, off_t inner, char* dst, size_t len)
+{
+    if (!vfat_info.uring || vfat_info.direct)
+    {
+        return ClusterRead(N, inner, dst, len);
+    }
+
+    struct uring_read* r = &batch->reads[batch->count++];
+    r->buf = dst;
+    r->len = len;
+    r->offset = vfat_info.data_begin_offset + ClusterDataOffset(N) + inner;
+    return (batch->count == URING_BATCH) ? BatchFlush(batch) : 0;
+}
+
+// Reads from an open file, advancing its cursor
+int vfat_read_file(struct vfat_file* file, char *buf, size_t size, off_t offs)
+{
+    off_t fileSize;
+    struct vfat_extent_map* extents = FileSnapshot(file, &fileSize);
 
-            // Copy chars into output buffer
-            memcpy(buf, tmpbuff, readSize * sizeof(char));
-            free(tmpbuff);
-            return readSize;
+    // Never read past the end of file
+    if (offs >= fileSize)
+    {
+        extent_map_put(extents);
+        return 0;
+    }
+    if (size > fileSize - offs)
+    {
+        size = fileSize - offs;
+    }
+
+    // Keep the disk busy with what comes next while this request is copied
+    ReadAhead(file, extents, offs, size);
+
+    // Determine theoretical cluster # in clusters chain
+    uint32_t logicalCluster = offs / vfat_info.cluster_size;
+
+    // Compute offset inside cluster
+    off_t innerOffset = offs % vfat_info.cluster_size;
+
+    // Read size
+    size_t readSize = 0;
+    struct vfat_read_batch batch;
+    batch.count = 0;
+
+    // Loop on runs of physically contiguous clusters
+    uint32_t runStart, runClusters;
+    while (readSize < size)
+    {
+        // Sequential reads continue from the cursor, others look the chain up
+        int fromCursor = 0;
+        pthread_mutex_lock(&file->lock);
+        if (file->cursor_run > 0 && file->cursor_logical == logicalCluster && extents != NULL && file->cursor_map == extents->id)
+        {
+            runStart = file->cursor_physical;
+            runClusters = file->cursor_run;
+            fromCursor = 1;
+        }
+        pthread_mutex_unlock(&file->lock);
+        if (!fromCursor && extent_lookup(extents, logicalCluster, &runStart, &runClusters) != 0)
+        {
+            break;
         }
 
+        size_t runLength = (size_t)runClusters * vfat_info.cluster_size - innerOffset;
+        if (runLength > size - readSize)
+        {
+            runLength = size - readSize;
+        }
+
+        // Copy the whole run straight into the output buffer
+        if (BatchRead(&batch, runStart, innerOffset, buf + readSize, runLength) != 0)
+        {
+            extent_map_put(extents);
+            return -EIO;
+        }
+        readSize += runLength;
+
+        // Remember the first cluster not completely consumed yet
+        uint32_t consumed = (innerOffset + runLength) / vfat_info.cluster_size;
+        pthread_mutex_lock(&file->lock);
+        file->cursor_logical = logicalCluster + consumed;
+        file->cursor_physical = runStart + consumed;
+        file->cursor_run = runClusters - consumed;
+        file->cursor_map = extents->id;
+        pthread_mutex_unlock(&file->lock);
+
+        logicalCluster += runClusters;
+        innerOffset = 0;
+    }
+
+    extent_map_put(extents);
+    if (batch.count > 0 && BatchFlush(&batch) != 0)
+    {
+        return -EIO;
+    }
+    return readSize;
+}
+
+int vfat_fuse_open(const char *path, struct fuse_file_info *fi)
+{
+    // Virtual debug filesystem
+    if (strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0)
+    {
+        fi->fh = 0;
+        return 0;
+    }
+
+    // Read-only filesystem
+    int writing = (fi->flags & O_ACCMODE) != O_RDONLY;
+    if (writing && !vfat_info.writable)
+    {
+        return -EROFS;
+    }
+
+    struct vfat_file* file = (struct vfat_file*)calloc(1, sizeof(struct vfat_file));
+    if (file == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    // Resolve once, reads then go through the handle
+    pthread_rwlock_rdlock(&vfat_tree_lock);
+    int ret = writing ? vfat_locate_file(path, file) : vfat_resolve(path, &file->st);
+    if (ret == 0 && writing && S_ISDIR(file->st.st_mode))
+    {
+        ret = -EISDIR;
+    }
+    if (ret != 0)
+    {
+        pthread_rwlock_unlock(&vfat_tree_lock);
+        free(file->name);
+        free(file);
+        return ret;
+    }
+    file->writable = writing;
+    file->extents = extent_map_get(file->st.st_ino);
+    file->generation = FileGeneration(file->st.st_ino);
+    pthread_rwlock_unlock(&vfat_tree_lock);
+    pthread_mutex_init(&file->lock, NULL);
+
+    fi->fh = (uint64_t)(uintptr_t)file;
+    return 0;
+}
+
+int vfat_fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    struct vfat_file* file = (struct vfat_file*)(uintptr_t)fi->fh;
+    if (file != NULL)
+    {
+        vfat_sync_entry(path, file);
+        extent_map_put(file->extents);
+        pthread_mutex_destroy(&file->lock);
+        free(file->name);
+        free(file);
+        fi->fh = 0;
+    }
+    return 0;
+}
+
+int vfat_fuse_read(
+        const char *path, char *buf, size_t size, off_t offs,
+        struct fuse_file_info *fi)
+{
+    // Virtual debug filesystem
+    if (strncmp(path, DEBUGFS_PATH, strlen(DEBUGFS_PATH)) == 0)
+    {
+        return debugfs_fuse_read(path + strlen(DEBUGFS_PATH), buf, size, offs, fi);
+    }
+
+    int ret;
+    pthread_rwlock_rdlock(&vfat_tree_lock);
+
+    // Real FAT filesystem, opened through vfat_fuse_open()
+    if (fi != NULL && fi->fh != 0)
+    {
+        struct vfat_file* file = (struct vfat_file*)(uintptr_t)fi->fh;
+        RefreshFile(path, file);
+        ret = vfat_read_file(file, buf, size, offs);
+    }
+
+    // Real FAT filesystem without a file handle
+    else
+    {
+        struct vfat_file file;
+        memset(&file, 0, sizeof(file));
+        pthread_mutex_init(&file.lock, NULL);
+
         // If path cannot be resolved
+        if (vfat_resolve(path, &file.st) != 0)
+        {
+            ret = -ENOENT;
+        }
         else
         {
-            return -ENOENT;
+            file.extents = extent_map_get(file.st.st_ino);
+            ret = vfat_read_file(&file, buf, size, offs);
+            extent_map_put(file.extents);
         }
+        pthread_mutex_destroy(&file.lock);
+    }
+
+    pthread_rwlock_unlock(&vfat_tree_lock);
+    return ret;
+}
+
+#if FUSE_VERSION >= 29
+// Copying fallback of vfat_fuse_read_buf()
+static int ReadBufCopy(
+        const char *path, struct fuse_bufvec **bufp, size_t size, off_t offs,
+        struct fuse_file_info *fi)
+{
+    struct fuse_bufvec* bufv = (struct fuse_bufvec*)malloc(sizeof(struct fuse_bufvec));
+    if (bufv == NULL)
+    {
+        return -ENOMEM;
     }
+    *bufv = FUSE_BUFVEC_INIT(size);
+    bufv->buf[0].mem = malloc(size);
+    if (bufv->buf[0].mem == NULL)
+    {
+        free(bufv);
+        return -ENOMEM;
+    }
+
+    int ret = vfat_fuse_read(path, (char*)bufv->buf[0].mem, size, offs, fi);
+    bufv->buf[0].size = (ret > 0) ? ret : 0;
+    *bufp = bufv;
+    return (ret < 0) ? ret : 0;
 }
 
-////////////// No need to modify anything below this point
-int
-vfat_opt_args(void *data, const char *arg, int key, struct fuse_args *oargs)
+// Zero-copy variant of vfat_fuse_read(): instead of copying data we describe
+// every extent of the request as (image fd, offset) so fuse can splice it
+int vfat_fuse_read_buf(
+        const char *path, struct fuse_bufvec **bufp, size_t size, off_t offs,
+        struct fuse_file_info *fi)
 {
-    if (key == FUSE_OPT_KEY_NONOPT && !vfat_info.dev) {
-        vfat_info.dev = strdup(arg);
-        return (0);
+    struct vfat_file* file = (fi != NULL) ? (struct vfat_file*)(uintptr_t)fi->fh : NULL;
+
+    // Debug files, reads without a handle and direct mode go through the copying path
+    if (file == NULL || vfat_info.direct)
+    {
+        return ReadBufCopy(path, bufp, size, offs, fi);
+    }
+
+    pthread_rwlock_rdlock(&vfat_tree_lock);
+    RefreshFile(path, file);
+    off_t fileSize;
+    struct vfat_extent_map* extents = FileSnapshot(file, &fileSize);
+
+    // Never read past the end of file
+    if (offs >= fileSize)
+    {
+        size = 0;
+    }
+    else if (size > fileSize - offs)
+    {
+        size = fileSize - offs;
+    }
+
+    ReadAhead(file, extents, offs, size);
+
+    // Count the extents covered by the request
+    uint32_t firstCluster = offs / vfat_info.cluster_size;
+    uint32_t lastCluster = (size > 0) ? (offs + size - 1) / vfat_info.cluster_size : firstCluster;
+    uint32_t logicalCluster, runStart, runClusters;
+    size_t count = 0;
+    int dirty = 0;
+    for (logicalCluster = firstCluster; size > 0 && logicalCluster <= lastCluster; logicalCluster += runClusters)
+    {
+        if (extent_lookup(extents, logicalCluster, &runStart, &runClusters) != 0)
+        {
+            break;
+        }
+        uint32_t covered = lastCluster - logicalCluster + 1;
+        dirty |= wbcache_dirty_range(runStart, (runClusters < covered) ? runClusters : covered);
+        count++;
+    }
+
+    // The image is stale where the write-back cache holds changes
+    if (dirty)
+    {
+        extent_map_put(extents);
+        pthread_rwlock_unlock(&vfat_tree_lock);
+        return ReadBufCopy(path, bufp, size, offs, fi);
+    }
+
+    struct fuse_bufvec* bufv = (struct fuse_bufvec*)calloc(1, sizeof(struct fuse_bufvec) + (count ? count - 1 : 0) * sizeof(struct fuse_buf));
+    if (bufv == NULL)
+    {
+        extent_map_put(extents);
+        pthread_rwlock_unlock(&vfat_tree_lock);
+        return -ENOMEM;
+    }
+    bufv->count = count ? count : 1;
+
+    // One fd-backed buffer per extent
+    off_t innerOffset = offs % vfat_info.cluster_size;
+    size_t readSize = 0;
+    size_t i;
+    logicalCluster = firstCluster;
+    for (i = 0; i < count; i++)
+    {
+        extent_lookup(extents, logicalCluster, &runStart, &runClusters);
+
+        size_t runLength = (size_t)runClusters * vfat_info.cluster_size - innerOffset;
+        if (runLength > size - readSize)
+        {
+            runLength = size - readSize;
+        }
+
+        bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufv->buf[i].fd = vfat_info.fd;
+        bufv->buf[i].pos = vfat_info.data_begin_offset + ClusterDataOffset(runStart) + innerOffset;
+        bufv->buf[i].size = runLength;
+
+        readSize += runLength;
+        logicalCluster += runClusters;
+        innerOffset = 0;
     }
-    return (1);
+
+    extent_map_put(extents);
+    pthread_rwlock_unlock(&vfat_tree_lock);
+    *bufp = bufv;
+    return 0;
 }
+#endif
 
 struct fuse_operations vfat_available_ops = {
     .getattr = vfat_fuse_getattr,
+    .statfs = vfat_fuse_statfs,
     .getxattr = vfat_fuse_getxattr,
     .readdir = vfat_fuse_readdir,
+    .open = vfat_fuse_open,
     .read = vfat_fuse_read,
+    .release = vfat_fuse_release,
+    .create = vfat_fuse_create,
+    .write = vfat_fuse_write,
+    .truncate = vfat_fuse_truncate,
+    .ftruncate = vfat_fuse_ftruncate,
+    .fsync = vfat_fuse_fsync,
+    .flush = vfat_fuse_flush,
+    .unlink = vfat_fuse_unlink,
+    .mkdir = vfat_fuse_mkdir,
+    .rmdir = vfat_fuse_rmdir,
+    .rename = vfat_fuse_rename,
+    .chmod = vfat_fuse_chmod,
+    .utimens = vfat_fuse_utimens,
+    .init = vfat_fuse_init,
+    .destroy = vfat_fuse_destroy,
+#if FUSE_VERSION >= 29
+    .read_buf = vfat_fuse_read_buf,
+#endif
 };
-
-int main(int argc, char **argv)
-{
-    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-
-    fuse_opt_parse(&args, NULL, NULL, vfat_opt_args);
-
-    if (!vfat_info.dev)
-        errx(1, "missing file system parameter");
-
-    vfat_init(vfat_info.dev);
-    return (fuse_main(args.argc, args.argv, &vfat_available_ops, NULL));
-}
@@ -2,6 +2,8 @@
 #ifndef VFAT_H
 #define VFAT_H
 
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -42,6 +44,21 @@ struct fat_boot_header {
     /*510*/ uint16_t signature;
 } __attribute__ ((__packed__));
 
+// FSInfo sector, its counts are hints that may be stale or unknown
+struct fat32_fsinfo {
+    /*  0*/ uint32_t lead_signature;
+    /*  4*/ char     reserved1[480];
+    /*484*/ uint32_t signature;
+    /*488*/ uint32_t free_count;
+    /*492*/ uint32_t next_free;
+    /*496*/ char     reserved2[12];
+    /*508*/ uint32_t trail_signature;
+} __attribute__ ((__packed__));
+
+#define VFAT_FSINFO_LEAD_SIGNATURE 0x41615252
+#define VFAT_FSINFO_SIGNATURE      0x61417272
+#define VFAT_FSINFO_UNKNOWN        0xFFFFFFFF
+
 
 struct fat32_direntry {
     /* 0*/  union {
@@ -64,7 +81,9 @@ struct fat32_direntry {
     /*28*/  uint32_t size;
 } __attribute__ ((__packed__));
 
+#define VFAT_ATTR_RO    0x01
 #define VFAT_ATTR_DIR   0x10
+#define VFAT_ATTR_ARCH  0x20
 #define VFAT_ATTR_LFN   0xf
 #define VFAT_ATTR_INVAL (0x80|0x40|0x08)
 
@@ -82,6 +101,19 @@ struct fat32_direntry_long {
 #define VFAT_LFN_SEQ_START      0x40
 #define VFAT_LFN_SEQ_DELETED    0x80
 #define VFAT_LFN_SEQ_MASK       0x3f
+#define VFAT_LFN_SLOT_CHARS     13
+#define VFAT_LFN_MAX_SLOTS      20 // 255 characters
+#define VFAT_LFN_MAX_CHARS      255
+
+// Lists the entries of one directory cluster worth decoding, see ClassifyEntries()
+// Each kept value is an entry index, flagged with VFAT_KEPT_LFN for a long name slot
+typedef size_t (*vfat_classify_fn)(const struct fat32_direntry* entries, uint16_t* kept, int* end);
+
+#define VFAT_KEPT_INDEX 0x7FFF
+#define VFAT_KEPT_LFN   0x8000
+
+// Entries in the largest cluster, 128 sectors of 4096 bytes
+#define VFAT_MAX_DIRENTRY_PER_CLUSTER 16384
 
 
 // A kitchen sink for all important data about filesystem
@@ -108,20 +140,146 @@ struct vfat_data {
     size_t      fat_entries;
 
     // Other fields
+    size_t      fat_count;
+    uint16_t    fsinfo_sector;
     size_t      sectors_per_fat;
     size_t      cluster_size;
     size_t      fat_size;
     off_t       cluster_begin_offset;
     size_t      direntry_per_cluster;
+    vfat_classify_fn classify_cluster; // see DirentClassifier()
 
     // Root inode
     struct stat root_inode;
 
     // FAT mapping
-    uint32_t*   fat; // use util::mmap_file() to map this directly into the memory 
+    uint32_t*   fat; // use util::mmap_file() to map this directly into the memory, see vfat_load_fat()
+    const char* fat_backing; // how fat is held, exported via .debug
+
+    // Data region mapping, see ClusterMapped()
+    off_t       data_begin_offset;
+    size_t      data_size;
+    uint8_t*    data; // whole data region, NULL when falling back to windows
+
+    // Mapping statistics, exported via .debug
+    unsigned long cluster_map_calls;
+    unsigned long cluster_unmap_calls;
+
+    // Mount options
+    unsigned int readahead; // max clusters prefetched ahead of a sequential reader, 0 disables
+    int          writable;  // -o rw, image opened read-write and FAT kept as a private copy
+    unsigned int writeback; // -o writeback=N, MiB of dirty clusters kept in memory, 0 writes through
+    int          uring;     // -o uring, file reads and prefetches go through io_uring
+    unsigned int direct;    // -o direct=N, data read with O_DIRECT into N MiB of our own cache
+    int          hugefat;   // -o hugefat, FAT copied into huge pages
+    int          compactfat; // -o compactfat, FAT kept as runs of contiguous clusters, read-only
+    unsigned int crawl;     // -o crawl=N, N workers index the whole tree after mount, 0 disables
+    int          time_offset; // -o time_offset=N, minutes FAT timestamps are ahead of UTC
+
+    // Next cluster the allocator looks at
+    uint32_t    alloc_hint;
+
+    // Free data clusters, -1 until known, kept up to date by the allocator, see vfat_fuse_statfs()
+    long        free_clusters;
+
+    // Readahead statistics, exported via .debug
+    unsigned long sequential_reads;
+    unsigned long random_reads;
+    unsigned long readahead_requests;
+    unsigned long readahead_clusters;
 };
 
-struct vfat_data vfat_info;
+extern struct vfat_data vfat_info;
+
+// Where the entries of a file live inside its parent directory
+struct vfat_entry_pos {
+    uint32_t dir;           // first cluster of the parent directory
+    uint32_t cluster;       // cluster holding the 8.3 entry
+    uint32_t index;         // index of the 8.3 entry inside that cluster
+    uint32_t first_cluster; // cluster holding the first long name slot (or the 8.3 entry)
+    uint32_t first_index;   // its index
+    uint32_t count;         // long name slots + 1
+    char     nameext[11];   // 8.3 name of the entry, to notice it moved
+};
+
+// Directory entry as decoded by vfat_scan_dir()
+struct vfat_dirent {
+    const char*  name;       // long name if present, short name otherwise
+    const char*  short_name; // 8.3 name
+    struct stat  st;
+    struct vfat_entry_pos pos;
+    uint32_t     slot;       // raw slot of the 8.3 entry, counted from the start of the directory
+};
+
+// Open file, stored in fuse_file_info->fh
+struct vfat_file {
+    struct stat              st;
+    struct vfat_extent_map*  extents;
+    unsigned long            generation; // FileGeneration() st and extents are from, protected by lock
+
+    // Where the previous read stopped, so sequential reads skip the lookup
+    pthread_mutex_t lock;            // protects the cursor, reads may run concurrently
+    uint32_t        cursor_logical;  // logical cluster following the previous read
+    uint32_t        cursor_physical; // its physical cluster
+    uint32_t        cursor_run;      // contiguous clusters left from there, 0 if unknown
+    unsigned long   cursor_map;      // id of the extent map the cursor was computed from
+
+    // Sequential access detection, also protected by lock
+    off_t           ra_last_end;     // offset following the previous read
+    uint32_t        ra_window;       // current readahead window in clusters
+    uint32_t        ra_next;         // first logical cluster not prefetched yet
+
+    // Directory entry of the file, only known for files opened for writing
+    int                   writable;
+    struct vfat_entry_pos pos;
+    char*                 name;    // name the entry is cached under
+    struct fat32_direntry entry;   // copy of the 8.3 entry, entry.name[0] is 0 to locate it again
+    int                   touched; // modification time not stored yet, see vfat_fuse_write()
+};
+
+struct vfat_extent_map* FileSnapshot(struct vfat_file* file, off_t* size);
+void FileSetChain(struct vfat_file* file, const struct stat* st);
+unsigned long FileGeneration(uint32_t first_cluster);
+void FileChanged(uint32_t first_cluster);
+int FileIsCurrent(struct vfat_file* file);
+void RefreshFile(const char *path, struct vfat_file* file);
+
+// Return non-zero to stop the scan
+typedef int (*vfat_dirent_cb)(void *data, const struct vfat_dirent *de);
+
+int vfat_scan_dir(uint32_t first_cluster, vfat_dirent_cb callback, void *callbackdata);
+int vfat_scan_dir_from(uint32_t first_cluster, uint32_t start, vfat_dirent_cb callback, void *callbackdata);
+
+// Serializes modifications of the tree against everything else
+extern pthread_rwlock_t vfat_tree_lock;
+
+off_t ClusterDataOffset(uint32_t N);
+uint8_t* ClusterMapped(uint32_t N);
+void ClusterUnmap(uint8_t* cluster);
+time_t BuildTime(uint16_t inputDate, uint16_t inputTime, uint8_t inputTenth);
+mode_t EntryMode(uint8_t attr);
+void DirentStat(const struct fat32_direntry* e, struct stat* st);
+void ShortNameToString(const char* nameext, char* out);
+vfat_classify_fn DirentClassifier(size_t direntry_per_cluster);
+uint8_t ShortNameChecksum(const char* nameext);
+int vfat_read_file(struct vfat_file* file, char *buf, size_t size, off_t offs);
+
+// Default of -o readahead=N, in clusters
+#define VFAT_READAHEAD_DEFAULT  256
+
+// Default of -o time_offset=N, replaced by the local offset at mount
+#define VFAT_TIME_OFFSET_LOCAL  INT_MIN
+
+// Seconds the kernel keeps names and attributes of a read-only mount,
+// nothing can change them behind its back
+#define VFAT_RO_CACHE_TIMEOUT   "3600"
+
+void vfat_init(const char *dev);
+void vfat_load_fat(void);
+
+// Operations handed to fuse_main()
+struct fuse_operations;
+extern struct fuse_operations vfat_available_ops;
 
 /// FOR debugfs
 int vfat_next_cluster(unsigned int c);
@@ -0,0 +1,505 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "util.h"
+#include "wbcache.h"
+
+// Never fewer slots than this, whatever the budget and cluster size
+#define WBCACHE_MIN_SLOTS 16
+
+// One cached cluster, its contents live at wbcache_arena + index * cluster_size
+struct wb_slot {
+    uint32_t        cluster; // 0 while the slot is free
+    int             kind;    // WBCACHE_DATA or WBCACHE_DIR
+    struct wb_slot* next;    // hash chain, or free list
+};
+
+struct wb_slot*  wbcache_slots = NULL;
+struct wb_slot** wbcache_buckets = NULL;
+struct wb_slot*  wbcache_free = NULL;
+uint8_t*         wbcache_arena = NULL;
+size_t           wbcache_slot_count = 0;
+size_t           wbcache_bucket_mask = 0;
+
+// One bit per sector of a FAT copy
+uint8_t*         wbcache_fat_bits = NULL;
+
+pthread_t        wbcache_thread;
+int              wbcache_running = 0;
+pthread_mutex_t  wbcache_timer_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t   wbcache_timer_cond = PTHREAD_COND_INITIALIZER;
+
+unsigned long wbcache_dirty = 0;
+unsigned long wbcache_fat_dirty_sectors = 0;
+unsigned long wbcache_flushes = 0;
+unsigned long wbcache_writes = 0;
+
+int wbcache_enabled(void)
+{
+    return wbcache_slots != NULL;
+}
+
+// Sizes the cache from -o writeback=N (MiB), nothing is cached when 0
+void wbcache_init(void)
+{
+    size_t k;
+
+    if (!vfat_info.writable || vfat_info.writeback == 0)
+    {
+        return;
+    }
+
+    wbcache_slot_count = ((size_t)vfat_info.writeback << 20) / vfat_info.cluster_size;
+    if (wbcache_slot_count < WBCACHE_MIN_SLOTS)
+    {
+        wbcache_slot_count = WBCACHE_MIN_SLOTS;
+    }
+    size_t buckets = 1;
+    while (buckets < wbcache_slot_count)
+    {
+        buckets <<= 1;
+    }
+    wbcache_bucket_mask = buckets - 1;
+
+    size_t sectors = vfat_info.fat_size / vfat_info.bytes_per_sector;
+    wbcache_slots = calloc(wbcache_slot_count, sizeof(struct wb_slot));
+    wbcache_buckets = calloc(buckets, sizeof(struct wb_slot*));
+    wbcache_arena = malloc(wbcache_slot_count * vfat_info.cluster_size);
+    wbcache_fat_bits = calloc((sectors + 7) / 8, 1);
+    if (wbcache_slots == NULL || wbcache_buckets == NULL || wbcache_arena == NULL || wbcache_fat_bits == NULL)
+    {
+        err(1, "write-back cache of %u MiB", vfat_info.writeback);
+    }
+
+    for (k = 0; k < wbcache_slot_count; k++)
+    {
+        wbcache_slots[k].next = wbcache_free;
+        wbcache_free = &wbcache_slots[k];
+    }
+}
+
+static uint8_t* SlotData(const struct wb_slot* slot)
+{
+    return wbcache_arena + (size_t)(slot - wbcache_slots) * vfat_info.cluster_size;
+}
+
+static struct wb_slot* Find(uint32_t cluster)
+{
+    struct wb_slot* slot = wbcache_buckets[cluster & wbcache_bucket_mask];
+    while (slot != NULL && slot->cluster != cluster)
+    {
+        slot = slot->next;
+    }
+    return slot;
+}
+
+static off_t ClusterOffset(uint32_t cluster)
+{
+    return vfat_info.data_begin_offset + ClusterDataOffset(cluster);
+}
+
+// Takes a free slot for cluster, flushing everything when the budget is used up
+// whole == 0 loads the current contents first
+static struct wb_slot* Load(uint32_t cluster, int kind, int whole)
+{
+    if (wbcache_free == NULL && wbcache_flush() != 0)
+    {
+        return NULL;
+    }
+
+    struct wb_slot* slot = wbcache_free;
+    if (!whole && pread_full(vfat_info.fd, SlotData(slot), vfat_info.cluster_size, ClusterOffset(cluster)) != 0)
+    {
+        return NULL;
+    }
+    wbcache_free = slot->next;
+    slot->cluster = cluster;
+    slot->kind = kind;
+    slot->next = wbcache_buckets[cluster & wbcache_bucket_mask];
+    wbcache_buckets[cluster & wbcache_bucket_mask] = slot;
+    wbcache_dirty++;
+    return slot;
+}
+
+// Stores len bytes at offset of the data region, buf == NULL writes zeros
+// Partial clusters are kept in memory, whole clusters nobody cached go
+// straight to disk since no later flush could coalesce them any better
+int wbcache_write(const void* buf, size_t len, off_t offset, int kind)
+{
+    const uint8_t* src = buf;
+    size_t size = vfat_info.cluster_size;
+    off_t inner = (offset - vfat_info.data_begin_offset) % size;
+    uint32_t cluster = (offset - vfat_info.data_begin_offset) / size + 2;
+
+    while (len > 0)
+    {
+        size_t chunk = size - inner;
+        if (chunk > len)
+        {
+            chunk = len;
+        }
+
+        struct wb_slot* slot = Find(cluster);
+        if (slot == NULL && chunk == size)
+        {
+            size_t run = chunk;
+            while (run + size <= len && Find(cluster + run / size) == NULL)
+            {
+                run += size;
+            }
+            wbcache_writes++;
+            if (pwrite_full(vfat_info.fd, src, run, ClusterOffset(cluster)) != 0)
+            {
+                return -EIO;
+            }
+            chunk = run;
+        }
+        else
+        {
+            if (slot == NULL && (slot = Load(cluster, kind, 0)) == NULL)
+            {
+                return -EIO;
+            }
+            if (src != NULL)
+            {
+                memcpy(SlotData(slot) + inner, src, chunk);
+            }
+            else
+            {
+                memset(SlotData(slot) + inner, 0, chunk);
+            }
+            if (kind == WBCACHE_DIR)
+            {
+                slot->kind = WBCACHE_DIR;
+            }
+        }
+
+        if (src != NULL)
+        {
+            src += chunk;
+        }
+        cluster += (inner + chunk) / size;
+        len -= chunk;
+        inner = 0;
+    }
+    return 0;
+}
+
+// FAT entries [from, to] of the in-memory copy changed
+void wbcache_fat_dirty(uint32_t from, uint32_t to)
+{
+    size_t first = (size_t)from * 4 / vfat_info.bytes_per_sector;
+    size_t last = (size_t)to * 4 / vfat_info.bytes_per_sector;
+    size_t s;
+    for (s = first; s <= last; s++)
+    {
+        if ((wbcache_fat_bits[s / 8] & (1 << (s % 8))) == 0)
+        {
+            wbcache_fat_bits[s / 8] |= 1 << (s % 8);
+            wbcache_fat_dirty_sectors++;
+        }
+    }
+}
+
+// Cached copy of cluster, NULL if the disk is up to date
+uint8_t* wbcache_cluster(uint32_t cluster)
+{
+    if (wbcache_dirty == 0)
+    {
+        return NULL;
+    }
+    struct wb_slot* slot = Find(cluster);
+    return (slot != NULL) ? SlotData(slot) : NULL;
+}
+
+int wbcache_owns(const uint8_t* ptr)
+{
+    return wbcache_arena != NULL && ptr >= wbcache_arena
+        && ptr < wbcache_arena + wbcache_slot_count * vfat_info.cluster_size;
+}
+
+// Whether one of count clusters starting at first is only up to date in memory
+int wbcache_dirty_range(uint32_t first, uint32_t count)
+{
+    uint32_t k;
+    if (wbcache_dirty == 0)
+    {
+        return 0;
+    }
+    for (k = 0; k < count; k++)
+    {
+        if (Find(first + k) != NULL)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Patches len bytes just read from offset of the image with cached clusters
+void wbcache_overlay(void* buf, size_t len, off_t offset)
+{
+    if (wbcache_dirty == 0 || offset + (off_t)len <= vfat_info.data_begin_offset)
+    {
+        return;
+    }
+
+    uint8_t* dst = buf;
+    size_t size = vfat_info.cluster_size;
+    if (offset < vfat_info.data_begin_offset)
+    {
+        size_t skip = vfat_info.data_begin_offset - offset;
+        dst += skip;
+        len -= skip;
+        offset += skip;
+    }
+    off_t inner = (offset - vfat_info.data_begin_offset) % size;
+    uint32_t cluster = (offset - vfat_info.data_begin_offset) / size + 2;
+
+    while (len > 0)
+    {
+        size_t chunk = size - inner;
+        if (chunk > len)
+        {
+            chunk = len;
+        }
+        struct wb_slot* slot = Find(cluster);
+        if (slot != NULL)
+        {
+            memcpy(dst, SlotData(slot) + inner, chunk);
+        }
+        dst += chunk;
+        len -= chunk;
+        cluster++;
+        inner = 0;
+    }
+}
+
+static int CompareSlots(const void* a, const void* b)
+{
+    uint32_t x = (*(struct wb_slot* const*)a)->cluster;
+    uint32_t y = (*(struct wb_slot* const*)b)->cluster;
+    return (x > y) - (x < y);
+}
+
+// Writes the sorted slots of one kind, adjacent clusters with a single pwritev
+static int FlushSlots(struct wb_slot** sorted, size_t count, int kind)
+{
+    struct iovec iov[IOV_MAX < 1024 ? IOV_MAX : 1024];
+    size_t k = 0;
+
+    while (k < count)
+    {
+        if (sorted[k]->kind != kind)
+        {
+            k++;
+            continue;
+        }
+
+        uint32_t first = sorted[k]->cluster;
+        int n = 0;
+        while (k < count && n < (int)(sizeof(iov) / sizeof(iov[0])) && sorted[k]->kind == kind
+               && sorted[k]->cluster == first + n)
+        {
+            iov[n].iov_base = SlotData(sorted[k]);
+            iov[n].iov_len = vfat_info.cluster_size;
+            n++;
+            k++;
+        }
+
+        off_t offset = ClusterOffset(first);
+        size_t left = (size_t)n * vfat_info.cluster_size;
+        struct iovec* vec = iov;
+        while (left > 0)
+        {
+            wbcache_writes++;
+            ssize_t ret = pwritev(vfat_info.fd, vec, n, offset);
+            if (ret < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (ret <= 0)
+            {
+                return -EIO;
+            }
+            offset += ret;
+            left -= ret;
+
+            // Short write, skip what went out
+            while (n > 0 && (size_t)ret >= vec->iov_len)
+            {
+                ret -= vec->iov_len;
+                vec++;
+                n--;
+            }
+            if (n > 0)
+            {
+                vec->iov_base = (uint8_t*)vec->iov_base + ret;
+                vec->iov_len -= ret;
+            }
+        }
+    }
+    return 0;
+}
+
+// Writes runs of dirty sectors to every FAT copy
+static int FlushFat(void)
+{
+    size_t sectors = vfat_info.fat_size / vfat_info.bytes_per_sector;
+    size_t bps = vfat_info.bytes_per_sector;
+    size_t s = 0, k;
+
+    while (s < sectors)
+    {
+        if ((wbcache_fat_bits[s / 8] & (1 << (s % 8))) == 0)
+        {
+            s++;
+            continue;
+        }
+        size_t first = s;
+        while (s < sectors && (wbcache_fat_bits[s / 8] & (1 << (s % 8))) != 0)
+        {
+            s++;
+        }
+
+        for (k = 0; k < vfat_info.fat_count; k++)
+        {
+            off_t offset = vfat_info.fat_begin_offset + (off_t)k * vfat_info.fat_size + (off_t)first * bps;
+            wbcache_writes++;
+            if (pwrite_full(vfat_info.fd, (uint8_t*)vfat_info.fat + first * bps, (s - first) * bps, offset) != 0)
+            {
+                return -EIO;
+            }
+        }
+    }
+    memset(wbcache_fat_bits, 0, (sectors + 7) / 8);
+    wbcache_fat_dirty_sectors = 0;
+    return 0;
+}
+
+// Writes every dirty cluster and FAT sector out, in the order file data,
+// FAT, directories. Each step is on disk before the next one starts
+// The caller holds the tree write lock, on error everything stays cached
+int wbcache_flush(void)
+{
+    size_t count = 0, k;
+    int ret = 0;
+
+    if (!wbcache_enabled() || (wbcache_dirty == 0 && wbcache_fat_dirty_sectors == 0))
+    {
+        return 0;
+    }
+
+    struct wb_slot** sorted = malloc(wbcache_dirty * sizeof(struct wb_slot*) + 1);
+    if (sorted == NULL)
+    {
+        return -ENOMEM;
+    }
+    int data = 0, dirs = 0;
+    for (k = 0; k < wbcache_slot_count; k++)
+    {
+        if (wbcache_slots[k].cluster != 0)
+        {
+            sorted[count++] = &wbcache_slots[k];
+            data |= wbcache_slots[k].kind == WBCACHE_DATA;
+            dirs |= wbcache_slots[k].kind == WBCACHE_DIR;
+        }
+    }
+    qsort(sorted, count, sizeof(struct wb_slot*), CompareSlots);
+
+    int fat = wbcache_fat_dirty_sectors != 0;
+    ret = FlushSlots(sorted, count, WBCACHE_DATA);
+    if (ret == 0 && data && (fat || dirs) && fdatasync(vfat_info.fd) != 0)
+    {
+        ret = -EIO;
+    }
+    if (ret == 0 && fat && (ret = FlushFat()) == 0 && dirs && fdatasync(vfat_info.fd) != 0)
+    {
+        ret = -EIO;
+    }
+    if (ret == 0)
+    {
+        ret = FlushSlots(sorted, count, WBCACHE_DIR);
+    }
+
+    if (ret == 0)
+    {
+        for (k = 0; k < count; k++)
+        {
+            sorted[k]->cluster = 0;
+            sorted[k]->next = wbcache_free;
+            wbcache_free = sorted[k];
+        }
+        memset(wbcache_buckets, 0, (wbcache_bucket_mask + 1) * sizeof(struct wb_slot*));
+        wbcache_dirty = 0;
+        wbcache_flushes++;
+    }
+    free(sorted);
+    return ret;
+}
+
+static void* FlushThread(void* unused)
+{
+    pthread_mutex_lock(&wbcache_timer_lock);
+    while (wbcache_running)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WBCACHE_FLUSH_INTERVAL;
+        if (pthread_cond_timedwait(&wbcache_timer_cond, &wbcache_timer_lock, &deadline) != ETIMEDOUT)
+        {
+            continue;
+        }
+        pthread_mutex_unlock(&wbcache_timer_lock);
+
+        pthread_rwlock_wrlock(&vfat_tree_lock);
+        wbcache_flush();
+        pthread_rwlock_unlock(&vfat_tree_lock);
+
+        pthread_mutex_lock(&wbcache_timer_lock);
+    }
+    pthread_mutex_unlock(&wbcache_timer_lock);
+    return NULL;
+}
+
+// Starts the periodic flush, called once fuse runs since threads do not
+// survive its daemonization
+void wbcache_start(void)
+{
+    if (!wbcache_enabled())
+    {
+        return;
+    }
+    wbcache_running = 1;
+    if (pthread_create(&wbcache_thread, NULL, FlushThread, NULL) != 0)
+    {
+        wbcache_running = 0;
+    }
+}
+
+// Stops the periodic flush and writes out what is left
+void wbcache_stop(void)
+{
+    if (wbcache_running)
+    {
+        pthread_mutex_lock(&wbcache_timer_lock);
+        wbcache_running = 0;
+        pthread_cond_signal(&wbcache_timer_cond);
+        pthread_mutex_unlock(&wbcache_timer_lock);
+        pthread_join(wbcache_thread, NULL);
+    }
+
+    pthread_rwlock_wrlock(&vfat_tree_lock);
+    wbcache_flush();
+    pthread_rwlock_unlock(&vfat_tree_lock);
+}
@@ -0,0 +1,40 @@
+#ifndef H_WBCACHE
+#define H_WBCACHE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Write-back cache of dirty data region clusters and FAT sectors, enabled
+// by -o rw,writeback=N. Everything in it is modified under the tree write
+// lock, readers holding the read lock may look clusters up.
+
+// What a cached cluster holds, flushes write file data, then the FAT, then
+// directories so that nothing on disk refers to unwritten clusters
+#define WBCACHE_DATA 0
+#define WBCACHE_DIR  1
+
+// Seconds between background flushes
+#define WBCACHE_FLUSH_INTERVAL 5
+
+void wbcache_init(void);
+void wbcache_start(void);
+void wbcache_stop(void);
+int wbcache_enabled(void);
+
+int wbcache_write(const void* buf, size_t len, off_t offset, int kind);
+void wbcache_fat_dirty(uint32_t from, uint32_t to);
+int wbcache_flush(void);
+
+uint8_t* wbcache_cluster(uint32_t cluster);
+int wbcache_owns(const uint8_t* ptr);
+int wbcache_dirty_range(uint32_t first, uint32_t count);
+void wbcache_overlay(void* buf, size_t len, off_t offset);
+
+// Statistics, exported via .debug
+extern unsigned long wbcache_dirty;
+extern unsigned long wbcache_fat_dirty_sectors;
+extern unsigned long wbcache_flushes;
+extern unsigned long wbcache_writes;
+
+#endif
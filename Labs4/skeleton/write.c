@@ -0,0 +1,1689 @@
+// vim: noet:ts=4:sts=4:sw=4:et
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <endian.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <iconv.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "util.h"
+#include "extent.h"
+#include "dcache.h"
+#include "wbcache.h"
+#include "mount.h"
+#include "ccache.h"
+#include "write.h"
+
+#define VFAT_FAT_MASK           0x0FFFFFFF
+#define VFAT_FAT_EOC            0x0FFFFFFF
+#define VFAT_DIRENT_SIZE        32
+#define VFAT_DIR_MAX_ENTRIES    65536 // a directory spans at most 2 MiB
+#define VFAT_FILE_MAX_SIZE      0xFFFFFFFFLL
+#define VFAT_NAME_MAX           (VFAT_LFN_MAX_SLOTS * VFAT_LFN_SLOT_CHARS * 3 + 1)
+
+iconv_t iconv_to_utf16; // utf-8 to on-disk utf-16, only used under the tree write lock
+int fsinfo_invalidated = 0;
+int fsinfo_stale = 0; // FSInfo on disk says unknown until UpdateFsInfo()
+
+void vfat_write_init(void)
+{
+    iconv_to_utf16 = iconv_open("utf-16le", "utf-8");
+    if (iconv_to_utf16 == (iconv_t)-1)
+        err(1, "iconv_open");
+    wbcache_init();
+}
+
+// Writes len bytes at offset of the image, buf == NULL writes zeros
+// The data region goes through the write-back cache when there is one
+static int StoreImage(const void* buf, size_t len, off_t offset, int kind)
+{
+    if (offset >= vfat_info.data_begin_offset && len > 0)
+    {
+        off_t inner = offset - vfat_info.data_begin_offset;
+        uint32_t first = inner / vfat_info.cluster_size;
+        ccache_invalidate(first + 2, (inner + len - 1) / vfat_info.cluster_size - first + 1);
+    }
+    if (wbcache_enabled() && offset >= vfat_info.data_begin_offset)
+    {
+        return wbcache_write(buf, len, offset, kind);
+    }
+    return (pwrite_full(vfat_info.fd, buf, len, offset) == 0) ? 0 : -EIO;
+}
+
+static int WriteImage(const void* buf, size_t len, off_t offset)
+{
+    return StoreImage(buf, len, offset, WBCACHE_DATA);
+}
+
+// Same for directory entries, which are flushed after the FAT
+static int WriteDirectory(const void* buf, size_t len, off_t offset)
+{
+    return StoreImage(buf, len, offset, WBCACHE_DIR);
+}
+
+static int ReadImage(void* buf, size_t len, off_t offset)
+{
+    if (pread_full(vfat_info.fd, buf, len, offset) != 0)
+    {
+        return -EIO;
+    }
+    wbcache_overlay(buf, len, offset);
+    return 0;
+}
+
+// Highest cluster number of the volume
+static uint32_t LastCluster()
+{
+    return vfat_info.spec_CountofClusters + 1;
+}
+
+static int IsDataCluster(uint32_t c)
+{
+    return c >= 2 && c <= LastCluster();
+}
+
+// FSInfo on disk falls behind the FAT as soon as it changes, mark its counts
+// unknown before the first change, UpdateFsInfo() writes them back
+static void InvalidateFsInfo()
+{
+    if (fsinfo_invalidated || vfat_info.fsinfo_sector == 0 || vfat_info.fsinfo_sector == 0xFFFF)
+    {
+        return;
+    }
+    fsinfo_invalidated = 1;
+
+    off_t sector = (off_t)vfat_info.fsinfo_sector * vfat_info.bytes_per_sector;
+    uint32_t signature;
+    uint32_t unknown[2] = { VFAT_FSINFO_UNKNOWN, VFAT_FSINFO_UNKNOWN }; // free count, next free
+    if (ReadImage(&signature, sizeof(signature), sector + offsetof(struct fat32_fsinfo, signature)) == 0 &&
+        le32toh(signature) == VFAT_FSINFO_SIGNATURE &&
+        WriteImage(unknown, sizeof(unknown), sector + offsetof(struct fat32_fsinfo, free_count)) == 0)
+    {
+        fsinfo_stale = 1;
+    }
+}
+
+// Writes the free cluster count kept in memory to FSInfo, once the FAT it
+// describes has been written. Caller holds the tree write lock
+static int UpdateFsInfo()
+{
+    if (!fsinfo_stale || vfat_info.free_clusters < 0)
+    {
+        return 0;
+    }
+
+    off_t sector = (off_t)vfat_info.fsinfo_sector * vfat_info.bytes_per_sector;
+    uint32_t counts[2] = {
+        htole32((uint32_t)vfat_info.free_clusters),
+        htole32(IsDataCluster(vfat_info.alloc_hint) ? vfat_info.alloc_hint : VFAT_FSINFO_UNKNOWN),
+    };
+    if (WriteImage(counts, sizeof(counts), sector + offsetof(struct fat32_fsinfo, free_count)) != 0)
+    {
+        return -EIO;
+    }
+    fsinfo_stale = 0;
+    fsinfo_invalidated = 0;
+    return 0;
+}
+
+// Writes FAT entries [from, to] of the in-memory copy to every FAT on disk,
+// or leaves them to the next flush of the write-back cache
+static int FatFlush(uint32_t from, uint32_t to)
+{
+    size_t k;
+    if (wbcache_enabled())
+    {
+        wbcache_fat_dirty(from, to);
+        return 0;
+    }
+    for (k = 0; k < vfat_info.fat_count; k++)
+    {
+        off_t offset = vfat_info.fat_begin_offset + (off_t)k * vfat_info.fat_size + (off_t)from * 4;
+        if (WriteImage(&vfat_info.fat[from], (size_t)(to - from + 1) * 4, offset) != 0)
+        {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+// FAT entries changed in memory but not written out yet, adjacent entries
+// are written with a single pwrite per FAT copy
+struct fat_span {
+    uint32_t from;
+    uint32_t to;
+    int      active;
+    int      error;
+};
+
+static void FatSet(struct fat_span* span, uint32_t c, uint32_t value)
+{
+    InvalidateFsInfo();
+
+    // The count is unknown until the free space scan, which excludes writers
+    int wasFree = (vfat_info.fat[c] & VFAT_FAT_MASK) == 0;
+    if (vfat_info.free_clusters >= 0 && wasFree != ((value & VFAT_FAT_MASK) == 0))
+    {
+        __atomic_store_n(&vfat_info.free_clusters, vfat_info.free_clusters + (wasFree ? -1 : 1), __ATOMIC_RELEASE);
+    }
+    vfat_info.fat[c] = (vfat_info.fat[c] & ~VFAT_FAT_MASK) | (value & VFAT_FAT_MASK);
+
+    if (span->active && c >= span->from && c <= span->to + 1)
+    {
+        if (c > span->to)
+        {
+            span->to = c;
+        }
+        return;
+    }
+    if (span->active && FatFlush(span->from, span->to) != 0)
+    {
+        span->error = -EIO;
+    }
+    span->from = span->to = c;
+    span->active = 1;
+}
+
+static int FatDone(struct fat_span* span)
+{
+    if (span->active && FatFlush(span->from, span->to) != 0)
+    {
+        span->error = -EIO;
+    }
+    span->active = 0;
+    return span->error;
+}
+
+static int IsFree(uint32_t c)
+{
+    return (vfat_info.fat[c] & VFAT_FAT_MASK) == 0;
+}
+
+// Allocates count clusters linked into a new chain ending with EOC
+// A single contiguous run at or after hint is preferred, if the volume is
+// too fragmented the first free clusters found are used
+static int AllocChain(uint32_t count, uint32_t hint, uint32_t* first, uint32_t* last)
+{
+    uint32_t lo = 2, hi = LastCluster();
+    uint32_t total = hi - lo + 1;
+    uint32_t found = 0, runStart = 0, runLength = 0, seen, c, i;
+
+    if (!IsDataCluster(hint))
+    {
+        hint = IsDataCluster(vfat_info.alloc_hint) ? vfat_info.alloc_hint : lo;
+    }
+
+    uint32_t* clusters = malloc((size_t)count * sizeof(uint32_t));
+    if (clusters == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    // First fit, runs do not wrap around the end of the volume
+    for (c = hint, seen = 0; seen < total && runLength < count; seen++)
+    {
+        if (c == lo)
+        {
+            runLength = 0;
+        }
+        if (IsFree(c))
+        {
+            if (runLength == 0)
+            {
+                runStart = c;
+            }
+            runLength++;
+        }
+        else
+        {
+            runLength = 0;
+        }
+        c = (c == hi) ? lo : c + 1;
+    }
+
+    if (runLength == count)
+    {
+        for (found = 0; found < count; found++)
+        {
+            clusters[found] = runStart + found;
+        }
+    }
+    else
+    {
+        for (c = hint, seen = 0; seen < total && found < count; seen++)
+        {
+            if (IsFree(c))
+            {
+                clusters[found++] = c;
+            }
+            c = (c == hi) ? lo : c + 1;
+        }
+    }
+
+    if (found < count)
+    {
+        free(clusters);
+        return -ENOSPC;
+    }
+
+    struct fat_span span = { 0 };
+    for (i = 0; i < count; i++)
+    {
+        FatSet(&span, clusters[i], (i + 1 < count) ? clusters[i + 1] : VFAT_FAT_EOC);
+    }
+    *first = clusters[0];
+    *last = clusters[count - 1];
+    vfat_info.alloc_hint = (*last == hi) ? lo : *last + 1;
+    free(clusters);
+    return FatDone(&span);
+}
+
+// Marks every cluster of a chain free
+static int FreeChain(uint32_t first)
+{
+    struct fat_span span = { 0 };
+    uint32_t c = first & VFAT_FAT_MASK;
+    size_t n = 0;
+    while (IsDataCluster(c) && n++ < vfat_info.fat_entries)
+    {
+        uint32_t next = vfat_info.fat[c] & VFAT_FAT_MASK;
+        FatSet(&span, c, 0);
+        c = next;
+    }
+    return FatDone(&span);
+}
+
+// FAT date (high half) and time (low half) of t, vfat_info.time_offset minutes
+// ahead of UTC like BuildTime()
+static uint32_t FatTimestamp(time_t t)
+{
+    struct tm tm;
+    time_t local = t + (time_t)vfat_info.time_offset * 60;
+    gmtime_r(&local, &tm);
+    if (tm.tm_year < 80)
+    {
+        return ((1 << 5) | 1) << 16; // 1980-01-01
+    }
+    uint32_t date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+    uint32_t time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+    return (date << 16) | time;
+}
+
+// Fills in a fresh 8.3 entry stamped with the current time, the name is set by AddEntry()
+static void NewEntry(struct fat32_direntry* e, uint8_t attr, uint32_t cluster)
+{
+    time_t now = time(NULL);
+    memset(e, 0, sizeof(*e));
+    memset(e->nameext, ' ', sizeof(e->nameext));
+    e->attr = attr;
+    e->cluster_hi = cluster >> 16;
+    e->cluster_lo = cluster & 0xFFFF;
+    uint32_t stamp = FatTimestamp(now);
+    e->ctime_date = stamp >> 16;
+    e->ctime_time = stamp & 0xFFFF;
+    e->ctime_ms = (now % 2) * 100;
+    e->mtime_date = e->atime_date = e->ctime_date;
+    e->mtime_time = e->ctime_time;
+}
+
+static uint32_t EntryCluster(const struct fat32_direntry* e)
+{
+    return (((uint32_t)e->cluster_hi) << 16) | e->cluster_lo;
+}
+
+static off_t EntryOffset(uint32_t cluster, uint32_t index)
+{
+    return vfat_info.data_begin_offset + ClusterDataOffset(cluster) + (off_t)index * VFAT_DIRENT_SIZE;
+}
+
+static int ReadEntry(uint32_t cluster, uint32_t index, struct fat32_direntry* e)
+{
+    return ReadImage(e, sizeof(*e), EntryOffset(cluster, index));
+}
+
+// Moves (cluster, index) to the following entry of a directory
+// returns -1 at the end of its chain
+static int NextEntry(uint32_t* cluster, uint32_t* index)
+{
+    if (++*index < vfat_info.direntry_per_cluster)
+    {
+        return 0;
+    }
+    uint32_t next = vfat_info.fat[*cluster] & VFAT_FAT_MASK;
+    if (!IsDataCluster(next))
+    {
+        return -1;
+    }
+    *cluster = next;
+    *index = 0;
+    return 0;
+}
+
+// Writes count consecutive entries starting at (cluster, index), one pwrite per cluster
+static int WriteEntries(uint32_t cluster, uint32_t index, const struct fat32_direntry* entries, uint32_t count)
+{
+    while (count > 0)
+    {
+        uint32_t chunk = vfat_info.direntry_per_cluster - index;
+        if (chunk > count)
+        {
+            chunk = count;
+        }
+        if (WriteDirectory(entries, (size_t)chunk * VFAT_DIRENT_SIZE, EntryOffset(cluster, index)) != 0)
+        {
+            return -EIO;
+        }
+        entries += chunk;
+        count -= chunk;
+        index += chunk - 1;
+        if (count > 0 && NextEntry(&cluster, &index) != 0)
+        {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+// Marks the long name slots and the 8.3 entry of pos deleted
+static int DeleteEntries(const struct vfat_entry_pos* pos)
+{
+    uint32_t cluster = pos->first_cluster, index = pos->first_index, k;
+    uint8_t deleted = 0xE5;
+    for (k = 0; k < pos->count; k++)
+    {
+        if ((k > 0 && NextEntry(&cluster, &index) != 0) || WriteDirectory(&deleted, 1, EntryOffset(cluster, index)) != 0)
+        {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+// The dentry cache and name index mirror the directories, keep them in sync
+static void CacheEntryChanged(const struct vfat_entry_pos* pos, const char* name, const struct stat* st)
+{
+    char shortName[13];
+    ShortNameToString(pos->nameext, shortName);
+
+    struct vfat_dirent de;
+    de.name = name;
+    de.short_name = shortName;
+    de.st = *st;
+    de.pos = *pos;
+
+    dcache_insert(pos->dir, name, st);
+    if (strcmp(name, shortName) != 0)
+    {
+        dcache_insert(pos->dir, shortName, st);
+    }
+    dirindex_set(pos->dir, &de);
+}
+
+static void CacheEntryRemoved(const struct vfat_entry_pos* pos, const char* name, const struct stat* st)
+{
+    char shortName[13];
+    ShortNameToString(pos->nameext, shortName);
+
+    struct vfat_dirent de;
+    de.name = name;
+    de.short_name = shortName;
+    de.st = *st;
+    de.pos = *pos;
+
+    dcache_insert(pos->dir, name, NULL);
+    if (strcmp(name, shortName) != 0)
+    {
+        dcache_insert(pos->dir, shortName, NULL);
+    }
+    dirindex_forget(pos->dir, &de);
+}
+
+// Stat structure of an 8.3 entry
+static void EntryStat(const struct fat32_direntry* e, struct stat* st)
+{
+    *st = vfat_info.root_inode;
+    DirentStat(e, st);
+}
+
+// Used by LocateEntry()
+struct vfat_locate_data {
+    const char*           name;
+    int                   found; // 2 for a name match, 1 for a short name alias
+    struct stat           st;
+    struct vfat_entry_pos pos;
+    char                  entry_name[VFAT_NAME_MAX];
+};
+
+static int LocateEntry(void* data, const struct vfat_dirent* de)
+{
+    struct vfat_locate_data* ld = data;
+    int match = (strcmp(de->name, ld->name) == 0) ? 2 : ((strcmp(de->short_name, ld->name) == 0) ? 1 : 0);
+
+    // Long names win over a short name alias that happens to be equal
+    if (match > ld->found)
+    {
+        ld->found = match;
+        ld->st = de->st;
+        ld->pos = de->pos;
+        snprintf(ld->entry_name, sizeof(ld->entry_name), "%s", de->name);
+    }
+    return ld->found == 2;
+}
+
+// Finds the entry called name in directory dir
+static int FindEntry(uint32_t dir, const char* name, struct vfat_locate_data* ld)
+{
+    struct stat st;
+
+    // The name index answers misses without a scan
+    if (dirindex_lookup(dir, name, &st) != DCACHE_POSITIVE)
+    {
+        return -ENOENT;
+    }
+
+    memset(ld, 0, sizeof(*ld));
+    ld->name = name;
+    vfat_scan_dir(dir, LocateEntry, ld);
+    return ld->found ? 0 : -ENOENT;
+}
+
+// Resolves the directory holding the last component of path and copies
+// that component to name
+static int ResolveParent(const char* path, struct stat* parent, char* name, size_t nameSize)
+{
+    char dirPath[PATH_MAX];
+    if (strlen(path) >= sizeof(dirPath))
+    {
+        return -ENAMETOOLONG;
+    }
+    strcpy(dirPath, path);
+
+    size_t len = strlen(dirPath);
+    while (len > 1 && dirPath[len - 1] == '/')
+    {
+        dirPath[--len] = '\0';
+    }
+
+    // The root directory has no entry
+    char* slash = strrchr(dirPath, '/');
+    if (slash == NULL || slash[1] == '\0')
+    {
+        return -EBUSY;
+    }
+    if (strlen(slash + 1) >= nameSize)
+    {
+        return -ENAMETOOLONG;
+    }
+    strcpy(name, slash + 1);
+    slash[slash == dirPath ? 1 : 0] = '\0';
+
+    int ret = vfat_resolve(dirPath, parent);
+    if (ret == 0 && !S_ISDIR(parent->st_mode))
+    {
+        ret = -ENOTDIR;
+    }
+    return ret;
+}
+
+/**
+ * Finds the directory entry of a file or directory given the path
+ * @st its stat structure
+ * @pos where its entries live in the parent directory
+ * @name if not NULL, receives a malloc'ed copy of the name it is cached under
+ * @returns 0 iff operation completed succesfully -errno on error
+*/
+int vfat_locate(const char* path, struct stat* st, struct vfat_entry_pos* pos, char** name)
+{
+    struct stat parent;
+    char last[VFAT_NAME_MAX];
+    struct vfat_locate_data ld;
+
+    int ret = ResolveParent(path, &parent, last, sizeof(last));
+    if (ret == 0)
+    {
+        ret = FindEntry(parent.st_ino, last, &ld);
+    }
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    *st = ld.st;
+    *pos = ld.pos;
+    if (name != NULL && (*name = strdup(ld.entry_name)) == NULL)
+    {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+// Characters allowed in a short name besides upper case letters and digits
+static int IsShortNameChar(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c != '\0' && strchr("$%'-_@~`!(){}^#&", c) != NULL);
+}
+
+// Checks a name can be stored in a directory entry
+static int CheckName(const char* name)
+{
+    size_t len = strlen(name);
+    if (len == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        return -EINVAL;
+    }
+
+    // Windows silently drops trailing dots and spaces, refuse them instead
+    if (name[len - 1] == '.' || name[len - 1] == ' ')
+    {
+        return -EINVAL;
+    }
+
+    const unsigned char* p;
+    for (p = (const unsigned char*)name; *p; p++)
+    {
+        if (*p < 0x20 || strchr("\"*/:<>?\\|", *p) != NULL)
+        {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+// Converts name to UTF-16LE, returns the number of code units or -errno
+static int NameToUtf16(const char* name, uint16_t* units, size_t maxUnits)
+{
+    char* in = (char*)name;
+    size_t inLeft = strlen(name);
+    char* out = (char*)units;
+    size_t outLeft = maxUnits * sizeof(uint16_t);
+
+    iconv(iconv_to_utf16, NULL, NULL, NULL, NULL);
+    if (iconv(iconv_to_utf16, &in, &inLeft, &out, &outLeft) == (size_t)-1)
+    {
+        return (errno == E2BIG) ? -ENAMETOOLONG : -EINVAL;
+    }
+    return (maxUnits * sizeof(uint16_t) - outLeft) / sizeof(uint16_t);
+}
+
+// Copies up to max characters of [name, end) usable in a short name, upper cased
+static size_t ShortNamePart(const char* name, const char* end, char* out, size_t max)
+{
+    size_t n = 0;
+    const unsigned char* p;
+    for (p = (const unsigned char*)name; p < (const unsigned char*)end && n < max; p++)
+    {
+        unsigned char c = *p;
+        if (c == ' ' || c == '.' || (c & 0xC0) == 0x80)
+        {
+            continue; // dropped, as are continuation bytes of multibyte characters
+        }
+        c = toupper(c);
+        out[n++] = IsShortNameChar(c) ? c : '_';
+    }
+    return n;
+}
+
+// Picks the 8.3 name of a new entry called name in directory dir
+// Sets *lfn if long name slots are needed, the short name is then made
+// unique with a ~N tail
+static int MakeShortName(uint32_t dir, const char* name, char* nameext, int* lfn)
+{
+    const char* dot = strrchr(name, '.');
+    if (dot == name)
+    {
+        dot = NULL; // ".profile" has no extension
+    }
+    const char* baseEnd = dot ? dot : name + strlen(name);
+    size_t baseLen = baseEnd - name;
+    size_t extLen = dot ? strlen(dot + 1) : 0;
+
+    // Names that already are upper case 8.3 names are stored as they are
+    int fits = baseLen >= 1 && baseLen <= 8 && extLen <= 3;
+    const char* p;
+    for (p = name; fits && *p; p++)
+    {
+        fits = (p == dot) || IsShortNameChar(*p);
+    }
+
+    memset(nameext, ' ', 11);
+    if (fits)
+    {
+        memcpy(nameext, name, baseLen);
+        if (dot)
+        {
+            memcpy(nameext + 8, dot + 1, extLen);
+        }
+        *lfn = 0;
+        return 0;
+    }
+
+    char base[8], ext[3];
+    size_t baseN = ShortNamePart(name, baseEnd, base, sizeof(base));
+    size_t extN = dot ? ShortNamePart(dot + 1, dot + 1 + extLen, ext, sizeof(ext)) : 0;
+    if (baseN == 0)
+    {
+        base[baseN++] = '_';
+    }
+
+    *lfn = 1;
+    unsigned int tail;
+    for (tail = 1; tail < 1000000; tail++)
+    {
+        char suffix[9];
+        char candidate[13];
+        struct stat st;
+        size_t suffixLen = snprintf(suffix, sizeof(suffix), "~%u", tail);
+        size_t keep = (baseN + suffixLen > 8) ? 8 - suffixLen : baseN;
+
+        memset(nameext, ' ', 11);
+        memcpy(nameext, base, keep);
+        memcpy(nameext + keep, suffix, suffixLen);
+        memcpy(nameext + 8, ext, extN);
+
+        ShortNameToString(nameext, candidate);
+        if (dirindex_lookup(dir, candidate, &st) != DCACHE_POSITIVE)
+        {
+            return 0;
+        }
+    }
+    return -EEXIST;
+}
+
+// Finds count consecutive free entries in directory dir, the directory
+// grows by zeroed clusters if it has none
+static int FindFreeEntries(uint32_t dir, uint32_t count, uint32_t* cluster, uint32_t* index)
+{
+    uint32_t c = dir, last = dir, i;
+    uint32_t runCluster = 0, runIndex = 0, run = 0;
+    size_t entries = 0;
+
+    while (IsDataCluster(c) && entries < VFAT_DIR_MAX_ENTRIES)
+    {
+        uint8_t* data = ClusterMapped(c);
+        struct fat32_direntry* direntries = (struct fat32_direntry*)data;
+        for (i = 0; i < vfat_info.direntry_per_cluster; i++, entries++)
+        {
+            uint8_t first = direntries[i].name[0];
+            if (first != 0xE5 && first != 0x00)
+            {
+                run = 0;
+                continue;
+            }
+            if (run == 0)
+            {
+                runCluster = c;
+                runIndex = i;
+            }
+            if (++run == count)
+            {
+                ClusterUnmap(data);
+                *cluster = runCluster;
+                *index = runIndex;
+                return 0;
+            }
+        }
+        ClusterUnmap(data);
+        last = c;
+        c = vfat_info.fat[c] & VFAT_FAT_MASK;
+    }
+
+    // Append zeroed clusters, the free run may start in the last one
+    while (run < count)
+    {
+        uint32_t added, unused;
+        if (entries + vfat_info.direntry_per_cluster > VFAT_DIR_MAX_ENTRIES)
+        {
+            return -ENOSPC;
+        }
+        int ret = AllocChain(1, last + 1, &added, &unused);
+        if (ret == 0)
+        {
+            ret = WriteDirectory(NULL, vfat_info.cluster_size, EntryOffset(added, 0));
+        }
+        if (ret != 0)
+        {
+            return ret;
+        }
+
+        struct fat_span span = { 0 };
+        FatSet(&span, last, added);
+        if ((ret = FatDone(&span)) != 0)
+        {
+            return ret;
+        }
+        extent_cache_invalidate(dir);
+
+        if (run == 0)
+        {
+            runCluster = added;
+            runIndex = 0;
+        }
+        run += vfat_info.direntry_per_cluster;
+        entries += vfat_info.direntry_per_cluster;
+        last = added;
+    }
+    *cluster = runCluster;
+    *index = runIndex;
+    return 0;
+}
+
+// Adds an entry called name to directory dir, preceded by long name slots
+// if needed. entry holds everything but the 8.3 name, which is filled in
+static int AddEntry(uint32_t dir, const char* name, struct fat32_direntry* entry, struct vfat_entry_pos* pos)
+{
+    struct fat32_direntry entries[VFAT_LFN_MAX_SLOTS + 1];
+    uint16_t units[VFAT_LFN_MAX_SLOTS * VFAT_LFN_SLOT_CHARS];
+    int lfn, slots = 0, k;
+
+    int ret = CheckName(name);
+    if (ret == 0)
+    {
+        ret = MakeShortName(dir, name, entry->nameext, &lfn);
+    }
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    // The name ends with 0x0000 unless it fills the slots, the rest is 0xFFFF padding
+    if (lfn)
+    {
+        int n = NameToUtf16(name, units, sizeof(units) / sizeof(units[0]));
+        if (n <= 0)
+        {
+            return (n < 0) ? n : -EINVAL;
+        }
+        if (n > VFAT_LFN_MAX_CHARS)
+        {
+            return -ENAMETOOLONG;
+        }
+        slots = (n + VFAT_LFN_SLOT_CHARS - 1) / VFAT_LFN_SLOT_CHARS;
+        for (k = n; k < slots * VFAT_LFN_SLOT_CHARS; k++)
+        {
+            units[k] = (k == n) ? 0x0000 : 0xFFFF;
+        }
+    }
+
+    // Slots are stored last one first, right before the 8.3 entry
+    uint8_t checksum = ShortNameChecksum(entry->nameext);
+    for (k = 0; k < slots; k++)
+    {
+        struct fat32_direntry_long* slot = (struct fat32_direntry_long*)&entries[k];
+        int seq = slots - k;
+        const uint16_t* chars = &units[(seq - 1) * VFAT_LFN_SLOT_CHARS];
+        memset(slot, 0, sizeof(*slot));
+        slot->seq = seq | ((k == 0) ? VFAT_LFN_SEQ_START : 0);
+        slot->attr = VFAT_ATTR_LFN;
+        slot->csum = checksum;
+        memcpy(slot->name1, chars, sizeof(slot->name1));
+        memcpy(slot->name2, chars + 5, sizeof(slot->name2));
+        memcpy(slot->name3, chars + 11, sizeof(slot->name3));
+    }
+    entries[slots] = *entry;
+
+    uint32_t cluster, index;
+    if ((ret = FindFreeEntries(dir, slots + 1, &cluster, &index)) != 0)
+    {
+        return ret;
+    }
+    pos->dir = dir;
+    pos->first_cluster = cluster;
+    pos->first_index = index;
+    pos->count = slots + 1;
+    memcpy(pos->nameext, entry->nameext, sizeof(pos->nameext));
+    if ((ret = WriteEntries(cluster, index, entries, slots + 1)) != 0)
+    {
+        return ret;
+    }
+
+    for (k = 0; k < slots; k++)
+    {
+        NextEntry(&cluster, &index);
+    }
+    pos->cluster = cluster;
+    pos->index = index;
+    return 0;
+}
+
+// Removes an entry and frees its clusters
+static int RemoveEntry(const struct vfat_entry_pos* pos, const char* name, const struct stat* st)
+{
+    int ret = DeleteEntries(pos);
+    if (ret == 0)
+    {
+        ret = FreeChain(st->st_ino);
+    }
+    extent_cache_invalidate(st->st_ino);
+    FileChanged(st->st_ino);
+    CacheEntryRemoved(pos, name, st);
+    if (S_ISDIR(st->st_mode))
+    {
+        dcache_invalidate_parent(st->st_ino);
+        dirindex_invalidate(st->st_ino);
+    }
+    return ret;
+}
+
+// Used by DirIsEmpty()
+static int DirEntryFound(void* data, const struct vfat_dirent* de)
+{
+    if (strcmp(de->short_name, ".") == 0 || strcmp(de->short_name, "..") == 0)
+    {
+        return 0;
+    }
+    *(int*)data = 0;
+    return 1;
+}
+
+static int DirIsEmpty(uint32_t dir)
+{
+    int empty = 1;
+    vfat_scan_dir(dir, DirEntryFound, &empty);
+    return empty;
+}
+
+// First cluster of the parent of directory dir, read from its ".." entry
+static uint32_t ParentCluster(uint32_t dir)
+{
+    struct fat32_direntry e;
+    if (ReadEntry(dir, 1, &e) != 0 || memcmp(e.nameext, "..         ", 11) != 0)
+    {
+        return vfat_info.root_inode.st_ino;
+    }
+    uint32_t parent = EntryCluster(&e);
+    return (parent == 0) ? vfat_info.root_inode.st_ino : parent;
+}
+
+// Clusters needed to hold size bytes
+static uint32_t ClustersFor(off_t size)
+{
+    return (size + vfat_info.cluster_size - 1) / vfat_info.cluster_size;
+}
+
+static uint32_t ChainLength(struct vfat_file* file)
+{
+    off_t size;
+    struct vfat_extent_map* extents = FileSnapshot(file, &size);
+    uint32_t count = extents ? extents->cluster_count : 0;
+    extent_map_put(extents);
+    return count;
+}
+
+// Grows or shrinks the chain of an open file to count clusters, new
+// clusters continue the last run when possible
+static int ResizeChain(struct vfat_file* file, uint32_t count)
+{
+    off_t size;
+    struct vfat_extent_map* extents = FileSnapshot(file, &size);
+    uint32_t have = extents ? extents->cluster_count : 0;
+    uint32_t first = file->st.st_ino;
+    uint32_t lastPhysical = 0, run, added = 0;
+    struct stat st = file->st;
+    struct fat_span span = { 0 };
+    int ret = 0;
+
+    if (count > have)
+    {
+        uint32_t addedLast, hint = vfat_info.alloc_hint;
+        if (have > 0 && extent_lookup(extents, have - 1, &lastPhysical, &run) == 0)
+        {
+            hint = lastPhysical + 1;
+        }
+        ret = AllocChain(count - have, hint, &added, &addedLast);
+        if (ret == 0 && have == 0)
+        {
+            st.st_ino = added;
+        }
+        else if (ret == 0)
+        {
+            FatSet(&span, lastPhysical, added);
+        }
+    }
+    else if (count < have && count == 0)
+    {
+        ret = FreeChain(first);
+        st.st_ino = 0;
+    }
+    else if (count < have && extent_lookup(extents, count - 1, &lastPhysical, &run) == 0)
+    {
+        uint32_t next = vfat_info.fat[lastPhysical] & VFAT_FAT_MASK;
+        FatSet(&span, lastPhysical, VFAT_FAT_EOC);
+        ret = FreeChain(next);
+    }
+    if (FatDone(&span) != 0)
+    {
+        ret = -EIO;
+    }
+
+    // A grown chain keeps the runs it had, only the new clusters are walked
+    if (ret == 0 && count > have && have > 0)
+    {
+        extent_map_put(extent_map_append(extents, added));
+    }
+    else if (count != have)
+    {
+        extent_cache_invalidate(first);
+    }
+    extent_map_put(extents);
+
+    if (count != have)
+    {
+        FileChanged(first);
+        FileSetChain(file, &st);
+    }
+    return ret;
+}
+
+// Copies buf to [offs, offs + size) of an open file, one pwrite per run of
+// contiguous clusters. buf == NULL writes zeros. The chain must be long enough
+static int WriteClusters(struct vfat_file* file, const char* buf, size_t size, off_t offs)
+{
+    off_t fileSize;
+    struct vfat_extent_map* extents = FileSnapshot(file, &fileSize);
+    uint32_t logicalCluster = offs / vfat_info.cluster_size;
+    off_t innerOffset = offs % vfat_info.cluster_size;
+    uint32_t runStart, runClusters;
+    size_t written = 0;
+    int ret = 0;
+
+    while (ret == 0 && written < size)
+    {
+        if (extent_lookup(extents, logicalCluster, &runStart, &runClusters) != 0)
+        {
+            ret = -EIO;
+            break;
+        }
+
+        size_t runLength = (size_t)runClusters * vfat_info.cluster_size - innerOffset;
+        if (runLength > size - written)
+        {
+            runLength = size - written;
+        }
+        ret = WriteImage(buf ? buf + written : NULL, runLength,
+                         vfat_info.data_begin_offset + ClusterDataOffset(runStart) + innerOffset);
+
+        written += runLength;
+        logicalCluster += runClusters;
+        innerOffset = 0;
+    }
+
+    extent_map_put(extents);
+    return ret;
+}
+
+// Writes size and first cluster of an open file back to its entry, touch
+// also updates the modification time. The handle's copy of the entry must
+// be current, see RefreshWriter()
+static int StoreFileEntry(struct vfat_file* file, off_t size, int touch)
+{
+    struct fat32_direntry e = file->entry;
+    e.cluster_hi = file->st.st_ino >> 16;
+    e.cluster_lo = file->st.st_ino & 0xFFFF;
+    e.size = size;
+    if (touch)
+    {
+        uint32_t stamp = FatTimestamp(time(NULL));
+        e.mtime_date = stamp >> 16;
+        e.mtime_time = stamp & 0xFFFF;
+        e.atime_date = e.mtime_date;
+        e.attr |= VFAT_ATTR_ARCH;
+    }
+    int ret = WriteEntries(file->pos.cluster, file->pos.index, &e, 1);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    file->entry = e;
+    if (touch)
+    {
+        file->touched = 0;
+    }
+
+    struct stat st;
+    EntryStat(&e, &st);
+    FileChanged(st.st_ino);
+    FileSetChain(file, &st);
+    CacheEntryChanged(&file->pos, file->name, &st);
+    return 0;
+}
+
+// Sets the size of an open file, growing files are zero filled
+static int ResizeFile(struct vfat_file* file, off_t size)
+{
+    if (size > VFAT_FILE_MAX_SIZE)
+    {
+        return -EFBIG;
+    }
+
+    off_t oldSize = file->st.st_size;
+    int ret = 0;
+    if (ClustersFor(size) != ChainLength(file))
+    {
+        ret = ResizeChain(file, ClustersFor(size));
+    }
+    if (ret == 0 && size > oldSize)
+    {
+        ret = WriteClusters(file, NULL, size - oldSize, oldSize);
+    }
+    if (ret == 0)
+    {
+        ret = StoreFileEntry(file, size, 1);
+    }
+    return ret;
+}
+
+// Locates the entry of path for a handle opened for writing, filling in
+// its st, pos, name and entry
+int vfat_locate_file(const char* path, struct vfat_file* file)
+{
+    int ret = vfat_locate(path, &file->st, &file->pos, &file->name);
+    if (ret == 0 && (ret = ReadEntry(file->pos.cluster, file->pos.index, &file->entry)) != 0)
+    {
+        free(file->name);
+        file->name = NULL;
+    }
+    return ret;
+}
+
+// Brings a handle opened for writing up to date with changes made through
+// other handles or paths. Those bump the generation of the file, until then
+// its entry stays where the handle found it. RefreshFile() clears the copy
+// when it catches up with them first
+static int RefreshWriter(const char* path, struct vfat_file* file)
+{
+    if (file->entry.name[0] != 0 && FileIsCurrent(file))
+    {
+        return 0;
+    }
+
+    struct stat st;
+    struct vfat_entry_pos pos;
+    struct fat32_direntry e;
+    char* name;
+    int ret = vfat_locate(path, &st, &pos, &name);
+    if (ret == 0 && (ret = ReadEntry(pos.cluster, pos.index, &e)) != 0)
+    {
+        free(name);
+    }
+    if (ret != 0)
+    {
+        return ret;
+    }
+    free(file->name);
+    file->name = name;
+    file->pos = pos;
+    file->entry = e;
+    FileSetChain(file, &st);
+    return 0;
+}
+
+// Writes the modification time left pending by writes in place, caller
+// holds the tree write lock. A file removed meanwhile has nothing to update
+static int StoreTouched(const char* path, struct vfat_file* file)
+{
+    if (!file->touched)
+    {
+        return 0;
+    }
+    int ret = RefreshWriter(path, file);
+    if (ret == 0)
+    {
+        return StoreFileEntry(file, file->st.st_size, 1);
+    }
+    file->touched = 0;
+    return (ret == -ENOENT) ? 0 : ret;
+}
+
+// Same for a handle about to be released
+int vfat_sync_entry(const char* path, struct vfat_file* file)
+{
+    if (!file->writable || !file->touched)
+    {
+        return 0;
+    }
+    pthread_rwlock_wrlock(&vfat_tree_lock);
+    int ret = StoreTouched(path, file);
+    pthread_rwlock_unlock(&vfat_tree_lock);
+    return ret;
+}
+
+// Sets up a temporary handle for operations given a path
+static int OpenTemporary(const char* path, struct vfat_file* file)
+{
+    memset(file, 0, sizeof(*file));
+    int ret = vfat_locate_file(path, file);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    pthread_mutex_init(&file->lock, NULL);
+    file->writable = 1;
+    file->extents = extent_map_get(file->st.st_ino);
+    file->generation = FileGeneration(file->st.st_ino);
+    return 0;
+}
+
+static void CloseTemporary(struct vfat_file* file)
+{
+    extent_map_put(file->extents);
+    pthread_mutex_destroy(&file->lock);
+    free(file->name);
+}
+
+int vfat_fuse_create(const char* path, mode_t mode, struct fuse_file_info* fi)
+{
+    if (!vfat_info.writable)
+    {
+        return -EROFS;
+    }
+
+    struct vfat_file* file = (struct vfat_file*)calloc(1, sizeof(struct vfat_file));
+    if (file == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    struct stat parent, st;
+    char name[VFAT_NAME_MAX];
+    struct fat32_direntry e;
+
+    pthread_rwlock_wrlock(&vfat_tree_lock);
+    int ret = ResolveParent(path, &parent, name, sizeof(name));
+    if (ret == 0 && dirindex_lookup(parent.st_ino, name, &st) == DCACHE_POSITIVE)
+    {
+        ret = -EEXIST;
+    }
+    if (ret == 0)
+    {
+        NewEntry(&e, VFAT_ATTR_ARCH | ((mode & S_IWUSR) ? 0 : VFAT_ATTR_RO), 0);
+        ret = AddEntry(parent.st_ino, name, &e, &file->pos);
+    }
+    if (ret == 0 && (file->name = strdup(name)) == NULL)
+    {
+        ret = -ENOMEM;
+    }
+    if (ret == 0)
+    {
+        EntryStat(&e, &file->st);
+        file->entry = e;
+        file->generation = FileGeneration(file->st.st_ino);
+        CacheEntryChanged(&file->pos, name, &file->st);
+    }
+    pthread_rwlock_unlock(&vfat_tree_lock);
+
+    if (ret != 0)
+    {
+        free(file);
+        return ret;
+    }
+    file->writable = 1;
+    pthread_mutex_init(&file->lock, NULL);
+    fi->fh = (uint64_t)(uintptr_t)file;
+    return 0;
+}
+
+int vfat_fuse_write(const char* path, const char* buf, size_t size, off_t offs, struct fuse_file_info* fi)
+{
+    struct vfat_file* file = (fi != NULL) ? (struct vfat_file*)(uintptr_t)fi->fh : NULL;
+    if (file == NULL || !file->writable)
+    {
+        return -EBADF;
+    }
+    if (offs + (off_t)size > VFAT_FILE_MAX_SIZE)
+    {
+        return -EFBIG;
+    }
+
+    pthread_rwlock_wrlock(&vfat_tree_lock);
+    int ret = RefreshWriter(path, file);
+    off_t oldSize = file->st.st_size;
+    off_t end = offs + size;
+
+    // Allocate the whole request at once so it lands in one run
+    if (ret == 0 && ClustersFor(end) > ChainLength(file))
+    {
+        ret = ResizeChain(file, ClustersFor(end));
+    }
+    if (ret == 0 && offs > oldSize)
+    {
+        ret = WriteClusters(file, NULL, offs - oldSize, oldSize);
+    }
+    if (ret == 0)
+    {
+        ret = WriteClusters(file, buf, size, offs);
+    }
+
+    // The entry only changes along with the size, the chain never grows
+    // otherwise. Writes in place leave the modification time to flush
+    if (ret == 0 && end > oldSize)
+    {
+        ret = StoreFileEntry(file, end, 1);
+    }
+    else if (ret == 0)
+    {
+        file->touched = 1;
+    }
+    pthread_rwlock_unlock(&vfat_tree_lock);
+
+    return (ret == 0) ? (int)size : ret;
+}
+
+int vfat_fuse_truncate(const char* path, off_t size)
+{
+    if (!vfat_info.writable)
+    {
+        return -EROFS;
+    }
+
+    struct vfat_file file;
+    pthread_rwlock_wrlock(&vfat_tree_lock);
+    int ret = OpenTemporary(path, &file);
+    if (ret == 0)
+    {
+        ret = S_ISDIR(file.st.st_mode) ? -EISDIR : ResizeFile(&file, size);
+        CloseTemporary(&file);
+    }
+    pthread_rwlock_unlock(&vfat_tree_lock);
+    return ret;
+}
+
+int vfat_fuse_ftruncate(const char* path, off_t size, struct fuse_file_info* fi)
+{
+    struct vfat_file* file = (fi != NULL) ? (struct vfat_file*)(uintptr_t)fi->fh : NULL;
+    if (file == NULL || !file->writable)
+    {
+        return vfat_fuse_truncate(path, size);
+    }
+
+    pthread_rwlock_wrlock(&vfat_tree_lock);
+    int ret = RefreshWriter(path, file);
+    if (ret == 0)
+    {
+        ret = ResizeFile(file, size);
+    }
+    pthread_rwlock_unlock(&vfat_tree_lock);
+    return ret;
+}
+
+// Empties the write-back cache, then syncs the image itself
+int vfat_fuse_fsync(const char* path, int datasync, struct fuse_file_info* fi)
+{
+    struct vfat_file* file = (fi != NULL) ? (struct vfat_file*)(uintptr_t)fi->fh : NULL;
+    if (!vfat_info.writable)
+    {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&vfat_tree_lock);
+    int ret = (file != NULL && file->writable) ? StoreTouched(path, file) : 0;
+    if (ret == 0)
+    {
+        ret = wbcache_flush();
+    }
+    if (ret == 0)
+    {
+        ret = UpdateFsInfo();
+    }
+    pthread_rwlock_unlock(&vfat_tree_lock);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    return (fdatasync(vfat_info.fd) == 0) ? 0 : -errno;
+}
+
+// Closing a file written to stores its modification time and pushes the
+// cache out, without waiting for the disk
+int vfat_fuse_flush(const char* path, struct fuse_file_info* fi)
+{
+    struct vfat_file* file = (fi != NULL) ? (struct vfat_file*)(uintptr_t)fi->fh : NULL;
+    if (file == NULL || !file->writable)
+    {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&vfat_tree_lock);
+    int ret = StoreTouched(path, file);
+    if (ret == 0 && wbcache_enabled())
+    {
+        ret = wbcache_flush();
+    }
+    pthread_rwlock_unlock(&vfat_tree_lock);
+    return ret;
+}
+
+void* vfat_fuse_init(struct fuse_conn_info* conn)
+{
+    wbcache_start();
+    mount_start();
+    return NULL;
+}
+
+void vfat_fuse_destroy(void* unused)
+{
+    wbcache_stop();
+    if (vfat_info.writable)
+    {
+        pthread_rwlock_wrlock(&vfat_tree_lock);
+        UpdateFsInfo();
+        pthread_rwlock_unlock(&vfat_tree_lock);
+        fdatasync(vfat_info.fd);
+    }
+}
+
+int vfat_fuse_unlink(const char* path)
+{
+    if (!vfat_info.writable)
+    {
+        return -EROFS;
+    }
+
+    struct stat st;
+    struct vfat_entry_pos pos;
+    char* name;
+
+    pthread_rwlock_wrlock(&vfat_tree_lock);
+    int ret = vfat_locate(path, &st, &pos, &name);
+    if (ret == 0)
+    {
+        ret = S_ISDIR(st.st_mode) ? -EISDIR : RemoveEntry(&pos, name, &st);
+        free(name);
+    }
+    pthread_rwlock_unlock(&vfat_tree_lock);
+    return ret;
+}
+
+int vfat_fuse_mkdir(const char* path, mode_t mode)
+{
+    if (!vfat_info.writable)
+    {
+        return -EROFS;
+    }
+
+    struct stat parent, st;
+    char name[VFAT_NAME_MAX];
+    struct vfat_entry_pos pos;
+    struct fat32_direntry e, dots[2];
+    uint32_t cluster, unused;
+
+    pthread_rwlock_wrlock(&vfat_tree_lock);
+    int ret = ResolveParent(path, &parent, name, sizeof(name));
+    if (ret == 0 && dirindex_lookup(parent.st_ino, name, &st) == DCACHE_POSITIVE)
+    {
+        ret = -EEXIST;
+    }
+    if (ret == 0)
+    {
+        ret = AllocChain(1, vfat_info.alloc_hint, &cluster, &unused);
+    }
+    if (ret != 0)
+    {
+        pthread_rwlock_unlock(&vfat_tree_lock);
+        return ret;
+    }
+
+    // New directory holds "." and "..", the latter is 0 for the root directory
+    uint32_t parentCluster = (parent.st_ino == vfat_info.root_inode.st_ino) ? 0 : parent.st_ino;
+    NewEntry(&e, VFAT_ATTR_DIR | ((mode & S_IWUSR) ? 0 : VFAT_ATTR_RO), cluster);
+    NewEntry(&dots[0], VFAT_ATTR_DIR, cluster);
+    NewEntry(&dots[1], VFAT_ATTR_DIR, parentCluster);
+    dots[0].name[0] = '.';
+    dots[1].name[0] = dots[1].name[1] = '.';
+
+    ret = WriteDirectory(NULL, vfat_info.cluster_size, EntryOffset(cluster, 0));
+    if (ret == 0)
+    {
+        ret = WriteEntries(cluster, 0, dots, 2);
+    }
+    if (ret == 0)
+    {
+        ret = AddEntry(parent.st_ino, name, &e, &pos);
+    }
+
+    extent_cache_invalidate(cluster);
+    dcache_invalidate_parent(cluster);
+    dirindex_invalidate(cluster);
+    if (ret == 0)
+    {
+        EntryStat(&e, &st);
+        CacheEntryChanged(&pos, name, &st);
+    }
+    else
+    {
+        FreeChain(cluster);
+    }
+    pthread_rwlock_unlock(&vfat_tree_lock);
+    return ret;
+}
+
+int vfat_fuse_rmdir(const char* path)
+{
+    if (!vfat_info.writable)
+    {
+        return -EROFS;
+    }
+
+    struct stat st;
+    struct vfat_entry_pos pos;
+    char* name;
+
+    pthread_rwlock_wrlock(&vfat_tree_lock);
+    int ret = vfat_locate(path, &st, &pos, &name);
+    if (ret == 0)
+    {
+        if (!S_ISDIR(st.st_mode))
+        {
+            ret = -ENOTDIR;
+        }
+        else if (!DirIsEmpty(st.st_ino))
+        {
+            ret = -ENOTEMPTY;
+        }
+        else
+        {
+            ret = RemoveEntry(&pos, name, &st);
+        }
+        free(name);
+    }
+    pthread_rwlock_unlock(&vfat_tree_lock);
+    return ret;
+}
+
+// Checks directory dir is not an ancestor of (or equal to) directory child
+static int OutsideOf(uint32_t dir, uint32_t child)
+{
+    size_t depth;
+    for (depth = 0; child != vfat_info.root_inode.st_ino && depth < PATH_MAX; depth++)
+    {
+        if (child == dir)
+        {
+            return 0;
+        }
+        child = ParentCluster(child);
+    }
+    return child != dir;
+}
+
+int vfat_fuse_rename(const char* from, const char* to)
+{
+    if (!vfat_info.writable)
+    {
+        return -EROFS;
+    }
+
+    struct stat st, parent;
+    struct vfat_entry_pos pos;
+    struct vfat_locate_data target;
+    struct fat32_direntry e;
+    char toName[VFAT_NAME_MAX];
+    char* name = NULL;
+
+    pthread_rwlock_wrlock(&vfat_tree_lock);
+    int ret = vfat_locate(from, &st, &pos, &name);
+    if (ret == 0)
+    {
+        ret = ResolveParent(to, &parent, toName, sizeof(toName));
+    }
+    if (ret == 0 && S_ISDIR(st.st_mode) && !OutsideOf(st.st_ino, parent.st_ino))
+    {
+        ret = -EINVAL;
+    }
+
+    // An existing target is replaced, unless it is the entry itself under another name
+    int sameEntry = 0;
+    if (ret == 0 && FindEntry(parent.st_ino, toName, &target) == 0)
+    {
+        sameEntry = target.pos.cluster == pos.cluster && target.pos.index == pos.index;
+        if (sameEntry)
+        {
+            ret = (strcmp(name, toName) == 0) ? 1 : 0; // 1: nothing to do
+        }
+        else if (S_ISDIR(st.st_mode) && !S_ISDIR(target.st.st_mode))
+        {
+            ret = -ENOTDIR;
+        }
+        else if (!S_ISDIR(st.st_mode) && S_ISDIR(target.st.st_mode))
+        {
+            ret = -EISDIR;
+        }
+        else if (S_ISDIR(target.st.st_mode) && !DirIsEmpty(target.st.st_ino))
+        {
+            ret = -ENOTEMPTY;
+        }
+        else
+        {
+            ret = RemoveEntry(&target.pos, target.entry_name, &target.st);
+        }
+    }
+
+    // Write the new entries before dropping the old ones, the entry keeps its
+    // attributes, times and clusters
+    struct vfat_entry_pos newPos;
+    if (ret == 0)
+    {
+        ret = ReadEntry(pos.cluster, pos.index, &e);
+    }
+    if (ret == 0)
+    {
+        ret = AddEntry(parent.st_ino, toName, &e, &newPos);
+    }
+    if (ret == 0)
+    {
+        ret = DeleteEntries(&pos);
+        CacheEntryRemoved(&pos, name, &st);
+        FileChanged(st.st_ino);
+    }
+
+    // A moved directory points its ".." at the new parent
+    if (ret == 0 && S_ISDIR(st.st_mode) && parent.st_ino != pos.dir)
+    {
+        struct fat32_direntry dotdot;
+        uint32_t parentCluster = (parent.st_ino == vfat_info.root_inode.st_ino) ? 0 : parent.st_ino;
+        ret = ReadEntry(st.st_ino, 1, &dotdot);
+        if (ret == 0 && memcmp(dotdot.nameext, "..         ", 11) == 0)
+        {
+            dotdot.cluster_hi = parentCluster >> 16;
+            dotdot.cluster_lo = parentCluster & 0xFFFF;
+            ret = WriteEntries(st.st_ino, 1, &dotdot, 1);
+        }
+        dirindex_invalidate(st.st_ino);
+    }
+    if (ret == 0)
+    {
+        EntryStat(&e, &st);
+        CacheEntryChanged(&newPos, toName, &st);
+    }
+    pthread_rwlock_unlock(&vfat_tree_lock);
+
+    free(name);
+    return (ret == 1) ? 0 : ret;
+}
+
+// Only the owner write bit can be stored, as the read-only attribute
+int vfat_fuse_chmod(const char* path, mode_t mode)
+{
+    if (!vfat_info.writable)
+    {
+        return -EROFS;
+    }
+
+    struct vfat_file file;
+    struct fat32_direntry e;
+
+    pthread_rwlock_wrlock(&vfat_tree_lock);
+    int ret = OpenTemporary(path, &file);
+    if (ret == -EBUSY)
+    {
+        ret = 0; // root directory
+    }
+    else if (ret == 0)
+    {
+        e = file.entry;
+        e.attr = (mode & S_IWUSR) ? (e.attr & ~VFAT_ATTR_RO) : (e.attr | VFAT_ATTR_RO);
+        ret = WriteEntries(file.pos.cluster, file.pos.index, &e, 1);
+        if (ret == 0)
+        {
+            EntryStat(&e, &file.st);
+            FileChanged(file.st.st_ino);
+            CacheEntryChanged(&file.pos, file.name, &file.st);
+        }
+        CloseTemporary(&file);
+    }
+    pthread_rwlock_unlock(&vfat_tree_lock);
+    return ret;
+}
+
+int vfat_fuse_utimens(const char* path, const struct timespec tv[2])
+{
+    if (!vfat_info.writable)
+    {
+        return -EROFS;
+    }
+
+    struct vfat_file file;
+    struct fat32_direntry e;
+
+    pthread_rwlock_wrlock(&vfat_tree_lock);
+    int ret = OpenTemporary(path, &file);
+    if (ret == -EBUSY)
+    {
+        ret = 0; // root directory
+    }
+    else if (ret == 0)
+    {
+        e = file.entry;
+        if (tv[0].tv_nsec != UTIME_OMIT)
+        {
+            e.atime_date = FatTimestamp((tv[0].tv_nsec == UTIME_NOW) ? time(NULL) : tv[0].tv_sec) >> 16;
+        }
+        if (tv[1].tv_nsec != UTIME_OMIT)
+        {
+            uint32_t stamp = FatTimestamp((tv[1].tv_nsec == UTIME_NOW) ? time(NULL) : tv[1].tv_sec);
+            e.mtime_date = stamp >> 16;
+            e.mtime_time = stamp & 0xFFFF;
+        }
+        ret = WriteEntries(file.pos.cluster, file.pos.index, &e, 1);
+        if (ret == 0)
+        {
+            EntryStat(&e, &file.st);
+            FileChanged(file.st.st_ino);
+            CacheEntryChanged(&file.pos, file.name, &file.st);
+        }
+        CloseTemporary(&file);
+    }
+    pthread_rwlock_unlock(&vfat_tree_lock);
+    return ret;
+}
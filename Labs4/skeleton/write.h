@@ -0,0 +1,34 @@
+#ifndef H_WRITE
+#define H_WRITE
+
+#include <fuse.h>
+#include <sys/stat.h>
+
+struct vfat_entry_pos;
+struct vfat_file;
+
+void vfat_write_init(void);
+int vfat_locate(const char* path, struct stat* st, struct vfat_entry_pos* pos, char** name);
+int vfat_locate_file(const char* path, struct vfat_file* file);
+int vfat_sync_entry(const char* path, struct vfat_file* file);
+
+// Modifying fuse operations, only available with -o rw
+int vfat_fuse_create(const char* path, mode_t mode, struct fuse_file_info* fi);
+int vfat_fuse_write(const char* path, const char* buf, size_t size, off_t offs, struct fuse_file_info* fi);
+int vfat_fuse_truncate(const char* path, off_t size);
+int vfat_fuse_ftruncate(const char* path, off_t size, struct fuse_file_info* fi);
+int vfat_fuse_fsync(const char* path, int datasync, struct fuse_file_info* fi);
+int vfat_fuse_flush(const char* path, struct fuse_file_info* fi);
+int vfat_fuse_unlink(const char* path);
+int vfat_fuse_mkdir(const char* path, mode_t mode);
+int vfat_fuse_rmdir(const char* path);
+int vfat_fuse_rename(const char* from, const char* to);
+int vfat_fuse_chmod(const char* path, mode_t mode);
+int vfat_fuse_utimens(const char* path, const struct timespec tv[2]);
+
+
+// Mount lifetime, runs the write-back cache flusher and the background mount work
+void* vfat_fuse_init(struct fuse_conn_info* conn);
+void vfat_fuse_destroy(void* unused);
+
+#endif
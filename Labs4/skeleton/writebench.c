@@ -0,0 +1,130 @@
+// vim: noet:ts=4:sts=4:sw=4:et
+// vfat_writebench: sequential write throughput of a new file, then of the
+// same file overwritten in place, written through and with -o writeback
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vfat.h"
+#include "bench.h"
+
+#define BENCH_DEFAULT_MIB       256
+#define BENCH_DEFAULT_REQUEST   4   // KiB, the largest write fuse 2.6 sends
+#define BENCH_DEFAULT_WRITEBACK 64  // MiB
+#define BENCH_CLUSTER_SECTORS   8   // 4 KiB clusters
+#define BENCH_FILE              "/data.bin"
+
+// Parameters shared with the children
+struct bench_config {
+    const char*  image;
+    size_t       mib;
+    size_t       request;
+    unsigned int writeback;
+};
+
+// Writes the whole file in requests, then closes it, MB/s
+static double Pass(const struct bench_config* config, const char* buf, int create)
+{
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY;
+
+    double start = bench_now();
+    int ret = create ? vfat_available_ops.create(BENCH_FILE, 0644, &fi) : vfat_available_ops.open(BENCH_FILE, &fi);
+    if (ret != 0)
+        errx(1, "opening %s: %s", BENCH_FILE, strerror(-ret));
+
+    off_t size = (off_t)config->mib << 20;
+    off_t offs;
+    for (offs = 0; offs < size; offs += config->request)
+    {
+        ret = vfat_available_ops.write(BENCH_FILE, buf, config->request, offs, &fi);
+        if (ret != (int)config->request)
+            errx(1, "write at %lld returned %d", (long long)offs, ret);
+    }
+    if ((ret = vfat_available_ops.flush(BENCH_FILE, &fi)) != 0)
+        errx(1, "flush: %s", strerror(-ret));
+    vfat_available_ops.release(BENCH_FILE, &fi);
+    return config->mib * 1048576.0 / 1e6 / (bench_now() - start);
+}
+
+static void Measure(void* arg)
+{
+    struct bench_config* config = arg;
+    vfat_info.writable = 1;
+    vfat_info.writeback = config->writeback;
+    bench_mount(config->image);
+
+    char* buf = malloc(config->request);
+    if (buf == NULL)
+        err(1, "malloc");
+    memset(buf, 'w', config->request);
+
+    double append = Pass(config, buf, 1);
+    double overwrite = Pass(config, buf, 0);
+    bench_unmount();
+    free(buf);
+
+    char mode[32];
+    if (config->writeback != 0)
+        snprintf(mode, sizeof(mode), "writeback=%u", config->writeback);
+    else
+        snprintf(mode, sizeof(mode), "write-through");
+    printf("%-14s %9.1f MB/s %9.1f MB/s\n", mode, append, overwrite);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: vfat_writebench [-s file MiB] [-b request KiB] [-w writeback MiB]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_config config;
+    memset(&config, 0, sizeof(config));
+    config.mib = BENCH_DEFAULT_MIB;
+    config.request = BENCH_DEFAULT_REQUEST;
+    unsigned int writeback = BENCH_DEFAULT_WRITEBACK;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:b:w:")) != -1)
+    {
+        if (opt == 's' && (config.mib = atol(optarg)) > 0)
+            continue;
+        if (opt == 'b' && (config.request = atol(optarg)) > 0)
+            continue;
+        if (opt == 'w' && (writeback = atol(optarg)) > 0)
+            continue;
+        usage();
+    }
+    config.request <<= 10;
+
+    // Room for the file and its directory, a FAT32 volume of 4 KiB clusters starts at 256 MiB
+    off_t size = ((off_t)config.mib + 64) << 20;
+    if (size < ((off_t)320 << 20))
+        size = (off_t)320 << 20;
+    bench_defaults();
+
+    printf("file %zu MiB in %zu KiB writes, flushed on close\n", config.mib, config.request >> 10);
+    printf("%-14s %14s %14s\n", "", "new file", "overwrite");
+
+    // A fresh image per mode, so both allocate the same clusters
+    unsigned int modes[2] = { 0, writeback };
+    int m;
+    for (m = 0; m < 2; m++)
+    {
+        config.writeback = modes[m];
+        config.image = bench_image("writebench", size, BENCH_CLUSTER_SECTORS);
+        bench_run(Measure, &config);
+        unlink(config.image);
+        free((char*)config.image);
+    }
+    return 0;
+}